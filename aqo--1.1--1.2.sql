@@ -0,0 +1,311 @@
+CREATE FUNCTION aqo_model_pack(features double precision[][],
+							   targets double precision[])
+	RETURNS bytea
+	AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION aqo_model_features(model bytea)
+	RETURNS double precision[][]
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION aqo_model_targets(model bytea)
+	RETURNS double precision[]
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION aqo_stat_pack(execution_time_with_aqo double precision[],
+							  execution_time_without_aqo double precision[],
+							  planning_time_with_aqo double precision[],
+							  planning_time_without_aqo double precision[],
+							  cardinality_error_with_aqo double precision[],
+							  cardinality_error_without_aqo double precision[],
+							  executions_with_aqo bigint,
+							  executions_without_aqo bigint)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION aqo_stat_unpack(stat bytea,
+								OUT execution_time_with_aqo double precision[],
+								OUT execution_time_without_aqo double precision[],
+								OUT planning_time_with_aqo double precision[],
+								OUT planning_time_without_aqo double precision[],
+								OUT cardinality_error_with_aqo double precision[],
+								OUT cardinality_error_without_aqo double precision[],
+								OUT executions_with_aqo bigint,
+								OUT executions_without_aqo bigint)
+	RETURNS record
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE;
+
+-- Models are stored in the packed binary format. The table is rebuilt to
+-- keep the attribute numbers used by the extension.
+CREATE TABLE public.aqo_data_new (
+	fspace_hash		int NOT NULL REFERENCES public.aqo_queries ON DELETE CASCADE,
+	fsspace_hash	int NOT NULL,
+	nfeatures		int NOT NULL,
+	model			bytea NOT NULL
+);
+
+INSERT INTO public.aqo_data_new
+	SELECT fspace_hash, fsspace_hash, nfeatures,
+		   aqo_model_pack(features, targets)
+	FROM public.aqo_data;
+
+DROP TABLE public.aqo_data;
+ALTER TABLE public.aqo_data_new RENAME TO aqo_data;
+
+CREATE UNIQUE INDEX aqo_fss_access_idx ON public.aqo_data (fspace_hash, fsspace_hash);
+
+-- Query statistics is stored as one packed record of ring buffers.
+CREATE TABLE public.aqo_query_stat_new (
+	query_hash		int PRIMARY KEY REFERENCES public.aqo_queries ON DELETE CASCADE,
+	stat			bytea NOT NULL
+);
+
+INSERT INTO public.aqo_query_stat_new
+	SELECT query_hash,
+		   aqo_stat_pack(execution_time_with_aqo, execution_time_without_aqo,
+						 planning_time_with_aqo, planning_time_without_aqo,
+						 cardinality_error_with_aqo,
+						 cardinality_error_without_aqo,
+						 executions_with_aqo, executions_without_aqo)
+	FROM public.aqo_query_stat;
+
+DROP TABLE public.aqo_query_stat;
+ALTER TABLE public.aqo_query_stat_new RENAME TO aqo_query_stat;
+ALTER INDEX public.aqo_query_stat_new_pkey RENAME TO aqo_query_stat_idx;
+
+CREATE FUNCTION invalidate_fss_cache() RETURNS trigger
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE TRIGGER aqo_data_invalidate AFTER INSERT OR UPDATE OR TRUNCATE
+	ON public.aqo_data FOR EACH STATEMENT
+	EXECUTE PROCEDURE invalidate_fss_cache();
+
+-- Deletion, e.g. by aqo_gc(), keeps the other models in the shared cache
+CREATE FUNCTION forget_fss() RETURNS trigger
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE TRIGGER aqo_data_forget AFTER DELETE
+	ON public.aqo_data FOR EACH ROW
+	EXECUTE PROCEDURE forget_fss();
+
+CREATE FUNCTION invalidate_stat_cache() RETURNS trigger
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE TRIGGER aqo_query_stat_invalidate AFTER INSERT OR UPDATE OR TRUNCATE
+	ON public.aqo_query_stat FOR EACH STATEMENT
+	EXECUTE PROCEDURE invalidate_stat_cache();
+
+-- Deletion keeps the statistics of other query types in shared memory
+CREATE FUNCTION forget_query_stat() RETURNS trigger
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE TRIGGER aqo_query_stat_forget AFTER DELETE
+	ON public.aqo_query_stat FOR EACH ROW
+	EXECUTE PROCEDURE forget_query_stat();
+
+DROP TRIGGER aqo_queries_invalidate ON public.aqo_queries;
+CREATE TRIGGER aqo_queries_invalidate AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE
+	ON public.aqo_queries FOR EACH STATEMENT
+	EXECUTE PROCEDURE invalidate_deactivated_queries_cache();
+
+-- Durable copies of the knowledge base for the unlogged mode.
+CREATE TABLE public.aqo_data_snapshot (LIKE public.aqo_data INCLUDING INDEXES);
+CREATE TABLE public.aqo_query_stat_snapshot (LIKE public.aqo_query_stat INCLUDING INDEXES);
+
+-- Crash recovery empties this table together with the unlogged knowledge
+-- base, which tells that the knowledge base must be restored.
+CREATE UNLOGGED TABLE public.aqo_snapshot_marker (restored boolean);
+
+-- Restores the unlogged knowledge base from the snapshot after a crash.
+-- Returns true if the knowledge base was restored.
+CREATE FUNCTION aqo_restore_snapshot() RETURNS boolean AS $$
+BEGIN
+	IF (SELECT relpersistence FROM pg_catalog.pg_class
+		WHERE oid = 'public.aqo_data'::regclass) <> 'u' OR
+	   EXISTS (SELECT 1 FROM public.aqo_snapshot_marker) THEN
+		RETURN false;
+	END IF;
+
+	INSERT INTO public.aqo_data
+		SELECT s.* FROM public.aqo_data_snapshot s
+			JOIN public.aqo_queries q ON q.query_hash = s.fspace_hash
+		ON CONFLICT (fspace_hash, fsspace_hash) DO NOTHING;
+	INSERT INTO public.aqo_query_stat
+		SELECT s.* FROM public.aqo_query_stat_snapshot s
+			JOIN public.aqo_queries q ON q.query_hash = s.query_hash
+		ON CONFLICT (query_hash) DO NOTHING;
+	INSERT INTO public.aqo_snapshot_marker VALUES (true);
+
+	RETURN true;
+END
+$$ LANGUAGE plpgsql;
+
+-- Copies the unlogged knowledge base into the snapshot.
+CREATE FUNCTION aqo_snapshot() RETURNS void AS $$
+BEGIN
+	IF (SELECT relpersistence FROM pg_catalog.pg_class
+		WHERE oid = 'public.aqo_data'::regclass) <> 'u' THEN
+		RETURN;
+	END IF;
+
+	-- Never overwrite the snapshot with the knowledge base emptied by a crash
+	PERFORM aqo_restore_snapshot();
+
+	-- Only the rows changed since the previous snapshot are written
+	DELETE FROM public.aqo_data_snapshot s
+		WHERE NOT EXISTS (SELECT 1 FROM public.aqo_data d
+						  WHERE d.fspace_hash = s.fspace_hash AND
+								d.fsspace_hash = s.fsspace_hash);
+	INSERT INTO public.aqo_data_snapshot AS s SELECT * FROM public.aqo_data
+		ON CONFLICT (fspace_hash, fsspace_hash) DO UPDATE
+			SET nfeatures = excluded.nfeatures, model = excluded.model
+			WHERE (s.nfeatures, s.model) IS DISTINCT FROM
+				  (excluded.nfeatures, excluded.model);
+
+	DELETE FROM public.aqo_query_stat_snapshot s
+		WHERE NOT EXISTS (SELECT 1 FROM public.aqo_query_stat q
+						  WHERE q.query_hash = s.query_hash);
+	INSERT INTO public.aqo_query_stat_snapshot AS s
+		SELECT * FROM public.aqo_query_stat
+		ON CONFLICT (query_hash) DO UPDATE SET stat = excluded.stat
+			WHERE s.stat IS DISTINCT FROM excluded.stat;
+END
+$$ LANGUAGE plpgsql;
+
+-- Switches aqo_data and aqo_query_stat between logged and unlogged mode.
+CREATE FUNCTION aqo_set_unlogged(unlogged boolean) RETURNS void AS $$
+BEGIN
+	IF unlogged THEN
+		ALTER TABLE public.aqo_data SET UNLOGGED;
+		ALTER TABLE public.aqo_query_stat SET UNLOGGED;
+		TRUNCATE public.aqo_snapshot_marker;
+		INSERT INTO public.aqo_snapshot_marker VALUES (true);
+		PERFORM aqo_snapshot();
+	ELSE
+		ALTER TABLE public.aqo_data SET LOGGED;
+		ALTER TABLE public.aqo_query_stat SET LOGGED;
+		TRUNCATE public.aqo_data_snapshot, public.aqo_query_stat_snapshot,
+				 public.aqo_snapshot_marker;
+	END IF;
+END
+$$ LANGUAGE plpgsql;
+
+-- Binary export and import of the knowledge base for warm starts.
+CREATE FUNCTION aqo_export(filename text) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION aqo_import(filename text) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE;
+
+REVOKE EXECUTE ON FUNCTION aqo_export(text) FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION aqo_import(text) FROM PUBLIC;
+
+-- Last usage of query types and models, written by the background worker.
+CREATE TABLE public.aqo_query_usage (
+	query_hash		int PRIMARY KEY,
+	last_used		timestamptz NOT NULL
+);
+
+CREATE TABLE public.aqo_data_usage (
+	fspace_hash		int NOT NULL,
+	fsspace_hash	int NOT NULL,
+	last_used		timestamptz NOT NULL,
+	PRIMARY KEY (fspace_hash, fsspace_hash)
+);
+
+-- Removes the models of feature spaces which no query type uses and the
+-- least recently used models above max_models (zero means no limit). A model
+-- which has not been used since the usage is tracked is as old as the last
+-- usage of its feature space. Returns the number of removed models.
+CREATE FUNCTION aqo_gc(max_models int) RETURNS bigint AS $$
+DECLARE
+	nremoved	bigint := 0;
+	n			bigint;
+BEGIN
+	IF EXISTS (SELECT 1 FROM public.aqo_data d
+			   WHERE NOT EXISTS (SELECT 1 FROM public.aqo_queries q
+								 WHERE q.fspace_hash = d.fspace_hash)) THEN
+		DELETE FROM public.aqo_data d
+			WHERE NOT EXISTS (SELECT 1 FROM public.aqo_queries q
+							  WHERE q.fspace_hash = d.fspace_hash);
+		GET DIAGNOSTICS nremoved = ROW_COUNT;
+	END IF;
+
+	IF max_models > 0 THEN
+		n := (SELECT count(*) FROM public.aqo_data) - max_models;
+		IF n > 0 THEN
+			-- Rows locked by learning are left for the next time
+			DELETE FROM public.aqo_data WHERE ctid IN (
+				SELECT d.ctid FROM public.aqo_data d
+					LEFT JOIN public.aqo_data_usage u
+						USING (fspace_hash, fsspace_hash)
+					LEFT JOIN (SELECT q.fspace_hash, max(qu.last_used) AS last_used
+							   FROM public.aqo_queries q
+								   JOIN public.aqo_query_usage qu USING (query_hash)
+							   GROUP BY q.fspace_hash) f
+						ON f.fspace_hash = d.fspace_hash
+				ORDER BY COALESCE(u.last_used, f.last_used, '-infinity')
+				LIMIT n
+				FOR UPDATE OF d SKIP LOCKED);
+			GET DIAGNOSTICS n = ROW_COUNT;
+			nremoved := nremoved + n;
+		END IF;
+	END IF;
+
+	DELETE FROM public.aqo_data_usage u
+		WHERE NOT EXISTS (SELECT 1 FROM public.aqo_data d
+						  WHERE d.fspace_hash = u.fspace_hash AND
+								d.fsspace_hash = u.fsspace_hash);
+	DELETE FROM public.aqo_query_usage u
+		WHERE NOT EXISTS (SELECT 1 FROM public.aqo_queries q
+						  WHERE q.query_hash = u.query_hash);
+
+	RETURN nremoved;
+END
+$$ LANGUAGE plpgsql;
+
+-- Numbers of concurrent updates of AQO rows which were merged or lost.
+CREATE FUNCTION aqo_update_conflicts(OUT merged bigint, OUT dropped bigint)
+	RETURNS record
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE;
+
+-- Models of feature spaces. A feature space without a row uses the
+-- built-in model "knn".
+CREATE TABLE public.aqo_fspace_settings (
+	fspace_hash		int PRIMARY KEY REFERENCES public.aqo_queries ON DELETE CASCADE,
+	model			text NOT NULL
+);
+ALTER INDEX public.aqo_fspace_settings_pkey RENAME TO aqo_fspace_settings_idx;
+
+CREATE FUNCTION invalidate_fspace_settings() RETURNS trigger
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE TRIGGER aqo_fspace_settings_invalidate AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE
+	ON public.aqo_fspace_settings FOR EACH STATEMENT
+	EXECUTE PROCEDURE invalidate_fspace_settings();
+
+-- Names of the models registered in the server.
+CREATE FUNCTION aqo_models() RETURNS text[]
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE;
+
+-- Sets the model of the feature space. The models learned by the previous
+-- model are removed, because their format may differ.
+CREATE FUNCTION aqo_set_model(fspace int, model_name text) RETURNS void AS $$
+BEGIN
+	IF NOT model_name = ANY (aqo_models()) THEN
+		RAISE EXCEPTION 'AQO model "%" is not registered', model_name;
+	END IF;
+
+	IF COALESCE((SELECT s.model FROM public.aqo_fspace_settings s
+				 WHERE s.fspace_hash = fspace), 'knn') = model_name THEN
+		RETURN;
+	END IF;
+
+	DELETE FROM public.aqo_data d WHERE d.fspace_hash = fspace;
+	IF model_name = 'knn' THEN
+		DELETE FROM public.aqo_fspace_settings s WHERE s.fspace_hash = fspace;
+	ELSE
+		INSERT INTO public.aqo_fspace_settings VALUES (fspace, model_name)
+			ON CONFLICT (fspace_hash) DO UPDATE SET model = EXCLUDED.model;
+	END IF;
+END
+$$ LANGUAGE plpgsql;
@@ -1,5 +1,7 @@
 #include "aqo.h"
 
+#include "commands/trigger.h"
+
 PG_MODULE_MAGIC;
 
 void _PG_init(void);
@@ -19,6 +21,13 @@ static const struct config_enum_entry format_options[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry learn_lock_options[] = {
+	{"wait", AQO_LEARN_LOCK_WAIT, false},
+	{"skip", AQO_LEARN_LOCK_SKIP, false},
+	{"defer", AQO_LEARN_LOCK_DEFER, false},
+	{NULL, 0, false}
+};
+
 /* Parameters of autotuning */
 int			aqo_stat_size = 20;
 int			auto_tuning_window_size = 5;
@@ -31,9 +40,11 @@ int			auto_tuning_infinite_loop = 8;
 /* Machine learning parameters */
 
 /*
- * Defines where we do not perform learning procedure
+ * Defines where we do not perform learning procedure: a node whose
+ * cardinality was predicted by AQO with the error of logarithms below this
+ * value is not learned. Zero means that every node is learned.
  */
-const double	object_selection_prediction_threshold = 0.3;
+double		object_selection_prediction_threshold = 0;
 
 /*
  * This parameter tell us that the new learning sample object has very small
@@ -47,8 +58,37 @@ const double	learning_rate = 1e-1;
 
 /* The number of nearest neighbors which will be chosen for ML-operations */
 int			aqo_k = 3;
+
+/* The maximum number of objects remembered by a model */
+int			aqo_model_capacity = AQO_DEFAULT_MODEL_CAPACITY;
+
+/* Models of at least this number of rows are indexed for prediction */
+int			aqo_knn_index_threshold = 256;
 double		log_selectivity_lower_bound = -30;
 
+/* Planning parameters */
+bool		aqo_prefetch_fspace = false;
+
+/* Learning parameters */
+bool		aqo_learn_async = false;
+double		aqo_model_change_threshold = 0;
+bool		aqo_model_single_precision = false;
+double		aqo_learn_sample_rate = 1;
+int			aqo_learn_lock = AQO_LEARN_LOCK_WAIT;
+
+/* Shared memory parameters */
+int			aqo_fss_cache_size = 512;
+int			aqo_fss_cache_max_features = 64;
+int			aqo_query_cache_size = 1024;
+int			aqo_learn_queue_size = 1024;
+int			aqo_max_workers = 2;
+int			aqo_stat_cache_size = 1024;
+int			aqo_stat_flush_interval = 10000;
+int			aqo_snapshot_interval = 300000;
+int			aqo_usage_cache_size = 4096;
+int			aqo_gc_interval = 600000;
+int			aqo_max_models = 0;
+
 /*
  * Currently we use it only to store query_text string which is initialized
  * after a query parsing and is used during the query planning.
@@ -93,6 +133,259 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomBoolVariable("aqo.prefetch_fspace",
+							 "Loads all models of the feature space at the start of planning.",
+							 NULL,
+							 &aqo_prefetch_fspace,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("aqo.learn_async",
+							 "Applies learning results in a background worker.",
+							 "Requires loading AQO through shared_preload_libraries.",
+							 &aqo_learn_async,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("aqo.learn_error_threshold",
+							 "Minimum error of a prediction which is learned.",
+							 "The error is the absolute difference of the logarithms of the predicted and the true cardinalities. Zero learns every prediction.",
+							 &object_selection_prediction_threshold,
+							 0,
+							 0,
+							 DBL_MAX,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("aqo.model_capacity",
+							"Maximum number of objects remembered by a model.",
+							"Models which already have more objects keep them.",
+							&aqo_model_capacity,
+							AQO_DEFAULT_MODEL_CAPACITY,
+							1,
+							AQO_MAX_MODEL_CAPACITY,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.knn_index_threshold",
+							"Minimum number of objects of a model for which the nearest neighbors are searched with an index.",
+							"Zero disables the index.",
+							&aqo_knn_index_threshold,
+							256,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("aqo.model_single_precision",
+							 "Stores new versions of models in aqo_data in single precision.",
+							 "Halves the size of models. Models in both precisions can be read.",
+							 &aqo_model_single_precision,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("aqo.learn_sample_rate",
+							 "Fraction of executions of a query type which are learned from.",
+							 "Query types whose cardinality error has not converged yet are learned from on every execution.",
+							 &aqo_learn_sample_rate,
+							 1,
+							 0,
+							 1,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("aqo.learn_lock",
+							 "What a query does if its model is being learned by another backend.",
+							 "\"wait\" waits for the model, \"skip\" does not learn it, \"defer\" passes the samples to the background worker.",
+							 &aqo_learn_lock,
+							 AQO_LEARN_LOCK_WAIT,
+							 learn_lock_options,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("aqo.model_change_threshold",
+							 "Minimum change of a model which is written to aqo_data.",
+							 "Smaller changes are accumulated in memory. Zero writes every change.",
+							 &aqo_model_change_threshold,
+							 0,
+							 0,
+							 DBL_MAX,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("aqo.fss_cache_size",
+							"Maximum number of models kept in the shared model cache.",
+							"Zero disables the cache.",
+							&aqo_fss_cache_size,
+							512,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.fss_cache_max_features",
+							"Maximum number of features of a model kept in the shared model cache.",
+							NULL,
+							&aqo_fss_cache_max_features,
+							64,
+							0,
+							1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.query_cache_size",
+							"Maximum number of query types kept in the shared directory of query settings.",
+							"Zero disables the directory.",
+							&aqo_query_cache_size,
+							1024,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.learn_queue_size",
+							"Size of the queue of learning results of one database.",
+							"Zero disables asynchronous learning.",
+							&aqo_learn_queue_size,
+							1024,
+							0,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.max_workers",
+							"Maximum number of AQO background workers.",
+							"Each worker serves one database.",
+							&aqo_max_workers,
+							2,
+							0,
+							1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.stat_cache_size",
+							"Maximum number of query types whose execution statistics is accumulated in shared memory.",
+							"Zero disables accumulation and sampled learning.",
+							&aqo_stat_cache_size,
+							1024,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.stat_flush_interval",
+							"Interval between writes of the accumulated execution statistics to aqo_query_stat.",
+							NULL,
+							&aqo_stat_flush_interval,
+							10000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.snapshot_interval",
+							"Interval between snapshots of the unlogged knowledge base.",
+							"Zero disables snapshots.",
+							&aqo_snapshot_interval,
+							300000,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.usage_cache_size",
+							"Maximum number of usage marks of models and query types kept in shared memory.",
+							"Zero disables tracking of the usage.",
+							&aqo_usage_cache_size,
+							4096,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.gc_interval",
+							"Interval between garbage collections of the knowledge base.",
+							"Zero disables garbage collection and tracking of the usage.",
+							&aqo_gc_interval,
+							600000,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.max_models",
+							"Maximum number of models kept in aqo_data of a database.",
+							"The least recently used models above this number are removed by the garbage collection. Zero means no limit.",
+							&aqo_max_models,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
 	prev_planner_hook							= planner_hook;
 	planner_hook								= aqo_planner;
 	prev_post_parse_analyze_hook				= post_parse_analyze_hook;
@@ -116,19 +409,106 @@ _PG_init(void)
 	parampathinfo_postinit_hook					= ppi_hook;
 
 	init_deactivated_queries_storage();
+	init_aqo_relids_cache();
+	aqo_init_shmem();
 	AQOMemoryContext = AllocSetContextCreate(TopMemoryContext, "AQOMemoryContext", ALLOCSET_DEFAULT_SIZES);
 }
 
 PG_FUNCTION_INFO_V1(invalidate_deactivated_queries_cache);
 
 /*
- * Clears the cache of deactivated queries if the user changed aqo_queries
- * manually.
+ * Clears the cache of deactivated queries and the shared directory of query
+ * settings if the user changed aqo_queries manually. Removal of a query type
+ * also removes its models, so the shared model cache is cleared too. Its
+ * statistics is removed from shared memory by the trigger on the cascaded
+ * deletion from aqo_query_stat.
  */
 Datum
 invalidate_deactivated_queries_cache(PG_FUNCTION_ARGS)
 {
 	fini_deactivated_queries_storage();
 	init_deactivated_queries_storage();
+	query_cache_reset();
+	fss_cache_reset();
 	PG_RETURN_POINTER(NULL);
 }
+
+PG_FUNCTION_INFO_V1(invalidate_fss_cache);
+
+/*
+ * Clears the shared model cache if the user changed aqo_data manually.
+ */
+Datum
+invalidate_fss_cache(PG_FUNCTION_ARGS)
+{
+	fss_cache_reset();
+	learn_worker_note_change();
+	PG_RETURN_POINTER(NULL);
+}
+
+PG_FUNCTION_INFO_V1(invalidate_stat_cache);
+
+/*
+ * Discards the statistics accumulated in shared memory if the user changed
+ * aqo_query_stat manually.
+ */
+Datum
+invalidate_stat_cache(PG_FUNCTION_ARGS)
+{
+	stat_cache_reset();
+	learn_worker_note_change();
+	PG_RETURN_POINTER(NULL);
+}
+
+PG_FUNCTION_INFO_V1(forget_query_stat);
+
+/*
+ * Discards the statistics accumulated in shared memory for the row deleted
+ * from aqo_query_stat.
+ */
+Datum
+forget_query_stat(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	Datum		query_hash;
+	bool		isnull;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "forget_query_stat: not called by trigger manager");
+
+	query_hash = heap_getattr(trigdata->tg_trigtuple, 1,
+							  RelationGetDescr(trigdata->tg_relation),
+							  &isnull);
+	if (!isnull)
+		stat_cache_forget(DatumGetInt32(query_hash));
+	learn_worker_note_change();
+	PG_RETURN_POINTER(trigdata->tg_trigtuple);
+}
+
+PG_FUNCTION_INFO_V1(forget_fss);
+
+/*
+ * Removes the model of the row deleted from aqo_data from the shared model
+ * cache. Other models of the database stay cached.
+ */
+Datum
+forget_fss(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	TupleDesc	tupDesc;
+	Datum		fspace_hash;
+	Datum		fss_hash;
+	bool		isnull[2];
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "forget_fss: not called by trigger manager");
+
+	tupDesc = RelationGetDescr(trigdata->tg_relation);
+	fspace_hash = heap_getattr(trigdata->tg_trigtuple, 1, tupDesc, &isnull[0]);
+	fss_hash = heap_getattr(trigdata->tg_trigtuple, 2, tupDesc, &isnull[1]);
+	if (!isnull[0] && !isnull[1])
+		fss_cache_invalidate(DatumGetInt32(fspace_hash),
+							 DatumGetInt32(fss_hash));
+	learn_worker_note_change();
+	PG_RETURN_POINTER(trigdata->tg_trigtuple);
+}
@@ -113,6 +113,7 @@
 #ifndef __ML_CARD_H__
 #define __ML_CARD_H__
 
+#include <float.h>
 #include <math.h>
 
 #include "postgres.h"
@@ -139,6 +140,7 @@
 #include "optimizer/cost.h"
 #include "parser/analyze.h"
 #include "parser/parsetree.h"
+#include "storage/lwlock.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
@@ -172,32 +174,64 @@ typedef enum
 }	AQO_MODE;
 extern int	aqo_mode;
 
+/* Behavior of the learning when the model is learned by another backend */
+typedef enum
+{
+	/* Waits until the model is learned */
+	AQO_LEARN_LOCK_WAIT,
+	/* Does not learn the model from the query */
+	AQO_LEARN_LOCK_SKIP,
+	/* Sends the samples of the model to the background worker */
+	AQO_LEARN_LOCK_DEFER,
+}	AQO_LEARN_LOCK;
+
 /*
  * It is mostly needed for auto tuning of query. with auto tuning mode aqo
  * checks stability of last executions of the query, bad influence of strong
  * cardinality estimation on query execution (planner bug?) and so on.
  * It can induce aqo to suppress machine learning for this query.
+ *
+ * The statistics is stored in aqo_query_stat.stat as is. Each series is a
+ * ring buffer of 'capacity' values, so adding an execution overwrites the
+ * oldest value instead of shifting the series, and the size of the record
+ * never changes.
  */
+#define AQO_STAT_VERSION	(1)
+
+typedef enum
+{
+	STAT_EXECUTION_TIME_WITH_AQO = 0,
+	STAT_EXECUTION_TIME_WITHOUT_AQO,
+	STAT_PLANNING_TIME_WITH_AQO,
+	STAT_PLANNING_TIME_WITHOUT_AQO,
+	STAT_CARDINALITY_ERROR_WITH_AQO,
+	STAT_CARDINALITY_ERROR_WITHOUT_AQO,
+	STAT_NSERIES
+}	QueryStatSeries;
+
 typedef struct
 {
-	double	   *execution_time_with_aqo;
-	double	   *execution_time_without_aqo;
-	double	   *planning_time_with_aqo;
-	double	   *planning_time_without_aqo;
-	double	   *cardinality_error_with_aqo;
-	double	   *cardinality_error_without_aqo;
-
-	int			execution_time_with_aqo_size;
-	int			execution_time_without_aqo_size;
-	int			planning_time_with_aqo_size;
-	int			planning_time_without_aqo_size;
-	int			cardinality_error_with_aqo_size;
-	int			cardinality_error_without_aqo_size;
+	int32		head;			/* position of the oldest value */
+	int32		size;			/* number of values */
+} QueryStatRing;
 
+typedef struct
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	uint16		version;
+	uint16		flags;
+	int32		nseries;
+	int32		capacity;
+	QueryStatRing rings[STAT_NSERIES];
 	int64		executions_with_aqo;
 	int64		executions_without_aqo;
+	/* STAT_NSERIES ring buffers of capacity values each */
+	double		data[FLEXIBLE_ARRAY_MEMBER];
 }	QueryStat;
 
+#define QueryStatSize(capacity) \
+	(offsetof(QueryStat, data) + sizeof(double) * STAT_NSERIES * (capacity))
+
 /* Parameters for current query */
 typedef struct QueryContextData
 {
@@ -215,6 +249,97 @@ typedef struct QueryContextData
 	double		query_planning_time;
 } QueryContextData;
 
+/* Learning sample collected after the query execution */
+typedef struct
+{
+	int			fss_hash;
+	int			ncols;
+	double	   *features;
+	double		target;
+} AQOLearnSample;
+
+/*
+ * Packed kNN model of a feature subspace, stored in aqo_data.model. The data
+ * field contains the nrows x ncols feature matrix in row-major order
+ * followed by nrows targets. The values are doubles, or float4 if the
+ * AQO_MODEL_FLOAT4 flag is set.
+ */
+#define AQO_MODEL_VERSION	(1)
+
+#define AQO_MODEL_FLOAT4	(0x0001)
+
+typedef struct
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	uint16		version;
+	uint16		flags;
+	int32		nrows;
+	int32		ncols;
+	double		data[FLEXIBLE_ARRAY_MEMBER];
+} AQOPackedModel;
+
+#define AQOPackedModelValueSize(flags) \
+	(((flags) & AQO_MODEL_FLOAT4) ? sizeof(float4) : sizeof(double))
+
+#define AQOPackedModelSize(nrows, ncols, flags) \
+	(offsetof(AQOPackedModel, data) + \
+	 AQOPackedModelValueSize(flags) * (nrows) * ((ncols) + 1))
+
+/* Vantage-point tree over the rows of a model, see machine_learning.c */
+typedef struct VPTree VPTree;
+
+/*
+ * Methods of a model of feature subspaces. The feature space selects its
+ * model by name in aqo_fspace_settings, the built-in "knn" is used by
+ * default. Other extensions can add models with register_aqo_model() in
+ * their _PG_init().
+ *
+ * The state of a model in memory is opaque to AQO. It must be one flat chunk
+ * of memory allocated with palloc() and without pointers: AQO copies it with
+ * memcpy() into and out of the shared model cache and the pending models of
+ * learning, and frees it with pfree(). 'ncols' is the number of features of
+ * the feature subspace; it is not kept in the state.
+ *
+ * deserialize builds the state from the value of aqo_data.model and throws
+ * an error if the value is malformed; serialize returns the value for
+ * aqo_data.model.
+ * memory_size returns the size of the state in bytes. The state is copied
+ * into the shared model cache only if it fits a slot of the cache.
+ * predict returns the logarithm of cardinality or -1 if it has no estimate.
+ * 'prepared' is the result of prepare for this state or NULL.
+ * learn adds the object to the state, which is NULL for a new model, and
+ * returns the new state. It may free the given state. 'capacity' is
+ * aqo.model_capacity, the maximum number of objects of the model.
+ * prepare is optional. It is called once per planning cycle for the loaded
+ * state in the memory of the planning memo and returns the data which the
+ * model needs for fast predictions or NULL; kNN builds its vantage-point
+ * tree here.
+ * change is optional. It returns how much the state has changed by learning
+ * compared with the stored one, in the units of aqo.model_change_threshold,
+ * or infinity if they are not comparable. Without it every change is written.
+ */
+typedef struct AQOModelMethods
+{
+	const char *name;
+	void	   *(*deserialize) (Datum datum, int ncols);
+	bytea	   *(*serialize) (const void *state, int ncols);
+	Size		(*memory_size) (const void *state, int ncols);
+	double		(*predict) (const void *state, int ncols,
+							const double *features, const void *prepared);
+	void	   *(*learn) (void *state, int ncols, int capacity,
+						  const double *features, double target);
+	void	   *(*prepare) (const void *state, int ncols);
+	double		(*change) (const void *old_state, const void *new_state,
+						   int ncols);
+} AQOModelMethods;
+
+/* Learning samples of one feature subspace */
+typedef struct
+{
+	int			fss_hash;
+	List	   *samples;
+} AQOLearnGroup;
+
 extern double predicted_ppi_rows;
 extern double fss_ppi_hash;
 
@@ -227,15 +352,55 @@ extern int	auto_tuning_infinite_loop;
 
 /* Machine learning parameters */
 
-/* Max number of matrix rows - max number of possible neighbors. */
-#define	aqo_K	(30)
+/* Default and maximum number of matrix rows of a model (its capacity) */
+#define AQO_DEFAULT_MODEL_CAPACITY	(30)
+#define AQO_MAX_MODEL_CAPACITY		(10000)
 
-extern const double object_selection_prediction_threshold;
+/* Max number of nearest neighbors, aqo_k must not exceed it */
+#define AQO_MAX_NEIGHBORS	(30)
+
+extern double object_selection_prediction_threshold;
 extern const double object_selection_threshold;
 extern const double learning_rate;
 extern int	aqo_k;
+extern int	aqo_model_capacity;
+extern int	aqo_knn_index_threshold;
 extern double log_selectivity_lower_bound;
 
+/* Planning parameters */
+extern bool aqo_prefetch_fspace;
+
+/* Learning parameters */
+extern bool aqo_learn_async;
+extern double aqo_model_change_threshold;
+extern bool aqo_model_single_precision;
+extern double aqo_learn_sample_rate;
+extern int	aqo_learn_lock;
+
+/* Shared memory parameters */
+extern int	aqo_fss_cache_size;
+extern int	aqo_fss_cache_max_features;
+extern int	aqo_query_cache_size;
+extern int	aqo_learn_queue_size;
+extern int	aqo_max_workers;
+extern int	aqo_stat_cache_size;
+extern int	aqo_stat_flush_interval;
+extern int	aqo_snapshot_interval;
+extern int	aqo_usage_cache_size;
+extern int	aqo_gc_interval;
+extern int	aqo_max_models;
+
+/* LWLocks of the "aqo" tranche */
+#define AQO_FSS_CACHE_LOCK	(0)
+#define AQO_QUERY_CACHE_LOCK	(1)
+#define AQO_LEARN_QUEUE_LOCK	(2)
+#define AQO_USAGE_CACHE_LOCK	(3)
+#define AQO_STAT_CACHE_LOCKS	(4)
+#define AQO_NUM_STAT_CACHE_LOCKS	(16)	/* must be a power of 2 */
+#define AQO_LEARN_LOCKS		(AQO_STAT_CACHE_LOCKS + AQO_NUM_STAT_CACHE_LOCKS)
+#define AQO_NUM_LEARN_LOCKS	(64)
+#define AQO_NUM_LWLOCKS		(AQO_LEARN_LOCKS + AQO_NUM_LEARN_LOCKS)
+
 /* Parameters for current query */
 extern QueryContextData query_context;
 extern int njoins;
@@ -271,7 +436,29 @@ void		get_eclasses(List *clauselist, int *nargs, int **args_hash, int **eclass_h
 int			get_clause_hash(Expr *clause, int nargs, int *args_hash, int *eclass_hash);
 
 
+/* How many times a concurrently updated row is read and updated again */
+#define AQO_UPDATE_RETRIES	(3)
+
+/* AQO service relations */
+typedef enum
+{
+	AQO_QUERIES = 0,
+	AQO_QUERY_TEXTS,
+	AQO_QUERY_STAT,
+	AQO_FSPACE_SETTINGS,
+	AQO_DATA,
+	AQO_NUM_RELATIONS
+} AQORelation;
+
 /* Storage interaction */
+extern void init_aqo_relids_cache(void);
+extern Oid	get_aqo_relid(AQORelation rel);
+extern bool open_aqo_relation(AQORelation rel, LOCKMODE lockmode,
+							  Relation *heap, Relation *index);
+extern bool aqo_extension_exists(void);
+extern Size storage_shmem_size(void);
+extern void storage_shmem_init(LWLockPadded *locks);
+extern void count_update_conflict(bool merged);
 bool find_query(int query_hash,
 		   Datum *search_values,
 		   bool *search_nulls);
@@ -280,16 +467,112 @@ bool add_query(int query_hash, bool learn_aqo, bool use_aqo,
 bool update_query(int query_hash, bool learn_aqo, bool use_aqo,
 			 int fspace_hash, bool auto_tuning);
 bool		add_query_text(int query_hash, const char *query_text);
-bool load_fss(int fss_hash, int ncols,
-		 double **matrix, double *targets, int *rows);
-extern bool update_fss(int fss_hash, int nrows, int ncols,
-					   double **matrix, double *targets);
+bool load_fss(int fss_hash, int ncols, const AQOModelMethods *methods,
+		 void **state, MemoryContext mcxt);
+extern bool load_fspace(int fspace_hash, MemoryContext mcxt);
+extern bool learn_fss_batch(List *groups);
+extern bytea *form_model(double *matrix, double *targets, int nrows, int ncols);
+extern double *alloc_model(int nrows, int ncols, double **targets);
+extern void deform_model(Datum datum, int ncols, int capacity,
+						 double **matrix, double **targets, int *nrows);
+extern AQOPackedModel *get_packed_model(Datum datum);
+extern void unpack_model(AQOPackedModel *model, double *matrix,
+						 double *targets);
+extern bool knowledge_base_is_unlogged(void);
 QueryStat  *get_aqo_stat(int query_hash);
-void		update_aqo_stat(int query_hash, QueryStat * stat);
+bool		update_aqo_stat(int query_hash, QueryStat * stat);
 void		init_deactivated_queries_storage(void);
 void		fini_deactivated_queries_storage(void);
 bool		query_is_deactivated(int query_hash);
-void		add_deactivated_query(int query_hash);
+void		add_deactivated_query(int query_hash, uint64 generation);
+
+/* Shared memory */
+extern void aqo_init_shmem(void);
+
+/* Shared cache of fss models */
+extern Size fss_cache_shmem_size(void);
+extern void fss_cache_shmem_init(LWLock *lock);
+extern uint64 fss_cache_generation(void);
+extern bool fss_cache_lookup(int fspace_hash, int fss_hash, int ncols,
+							 const AQOModelMethods *methods, void **state);
+extern void fss_cache_store(int fspace_hash, int fss_hash, int ncols,
+							const AQOModelMethods *methods, const void *state,
+							uint64 generation);
+extern void fss_cache_invalidate(int fspace_hash, int fss_hash);
+extern void fss_cache_reset(void);
+extern void fss_cache_at_xact_end(void);
+
+/* Shared directory of query settings */
+extern Size query_cache_shmem_size(void);
+extern void query_cache_shmem_init(LWLock *lock);
+extern uint64 query_cache_generation(void);
+extern bool query_cache_lookup(int query_hash, bool *learn_aqo, bool *use_aqo,
+							   int *fspace_hash, bool *auto_tuning);
+extern void query_cache_store(int query_hash, bool learn_aqo, bool use_aqo,
+							  int fspace_hash, bool auto_tuning,
+							  uint64 generation);
+extern bool query_cache_enabled(void);
+extern bool query_cache_is_deactivated(int query_hash);
+extern void query_cache_deactivate(int query_hash, uint64 generation);
+extern void query_cache_invalidate(int query_hash);
+extern void query_cache_reset(void);
+extern void query_cache_at_xact_end(void);
+
+/* Shared query statistics */
+extern Size stat_cache_shmem_size(void);
+extern void stat_cache_shmem_init(LWLockPadded *locks);
+extern QueryStat *stat_cache_update(int query_hash, bool use_aqo,
+									double planning_time,
+									double execution_time,
+									double cardinality_error,
+									bool load);
+extern void stat_cache_add_error(int query_hash, double cardinality_error);
+extern bool stat_cache_converged(int query_hash, bool *converged);
+extern bool stat_cache_has_dirty(Oid dbid);
+extern void stat_cache_flush(void);
+extern void stat_cache_forget(int query_hash);
+extern void stat_cache_reset(void);
+extern void stat_cache_at_subxact_end(bool commit, SubTransactionId mySubid,
+									  SubTransactionId parentSubid);
+extern void stat_cache_at_xact_end(bool commit);
+
+/* Usage marks of the knowledge base */
+extern Size usage_cache_shmem_size(void);
+extern void usage_cache_shmem_init(LWLock *lock);
+extern void usage_touch_query(int query_hash);
+extern void usage_touch_fss(int fspace_hash, int fss_hash);
+extern bool usage_cache_push(void);
+extern bool usage_cache_has_entries(Oid dbid);
+extern void usage_cache_flush(void);
+extern bool usage_gc_is_due(void);
+extern void usage_gc_done(void);
+
+/* Asynchronous learning */
+extern Size learn_queue_shmem_size(void);
+extern void learn_queue_shmem_init(LWLock *lock);
+extern bool learn_queue_send(List *samples, bool collect_stat,
+							 double planning_time, double execution_time,
+							 double cardinality_error);
+extern bool learn_worker_ensure(void);
+extern void learn_worker_note_change(void);
+extern void learn_worker_at_xact_end(bool commit);
+extern PGDLLEXPORT void aqo_worker_main(Datum main_arg);
+
+/* Models of feature spaces */
+extern PGDLLEXPORT void register_aqo_model(const AQOModelMethods *methods);
+extern const AQOModelMethods *get_fspace_model(int fspace_hash);
+extern Size knn_state_size(int capacity, int ncols);
+extern void fspace_model_cache_reset(void);
+
+/* Planning memo of fss lookups */
+extern void fss_memo_init(void);
+extern void fss_memo_prefetch(void);
+extern void fss_memo_store(int fss_hash, int ncols,
+						   const AQOModelMethods *methods, void *state);
+extern bool fss_memo_get(int fss_hash, int ncols,
+						 const AQOModelMethods **methods, void **state,
+						 void **prepared);
+extern void fss_memo_get_stat(int *lookups, int *hits);
 
 /* Query preprocessing hooks */
 void		get_query_text(ParseState *pstate, Query *query);
@@ -339,17 +622,31 @@ double predict_for_relation(List *restrict_clauses, List *selectivities,
 void		aqo_ExecutorStart(QueryDesc *queryDesc, int eflags);
 void		aqo_copy_generic_path_info(PlannerInfo *root, Plan *dest, Path *src);
 void		aqo_ExecutorEnd(QueryDesc *queryDesc);
+extern void learn_apply_samples(List *samples);
+extern void learn_apply_stat(double planning_time, double execution_time,
+							 double cardinality_error);
+extern void update_query_stat_row(QueryStat *stat, bool use_aqo,
+								  double planning_time,
+								  double execution_time,
+								  double cardinality_error);
 
 /* Machine learning techniques */
 extern double OkNNr_predict(int nrows, int ncols,
-							double **matrix, const double *targets,
-							double *features);
-extern int OkNNr_learn(int matrix_rows, int matrix_cols,
-			double **matrix, double *targets,
-			double *features, double target);
+							const double *matrix, int stride,
+							const double *targets, const double *features,
+							const VPTree *index);
+extern int OkNNr_learn(int matrix_rows, int matrix_cols, int capacity,
+			double *matrix, int stride, double *targets,
+			const double *features, double target);
+extern VPTree *vp_tree_build(const double *matrix, int nrows, int ncols,
+							 int stride);
+extern void fs_distances(const double *matrix, int nrows, int stride,
+						 const double *features, int ncols,
+						 double *distances);
 
 /* Automatic query tuning */
 void		automatical_query_tuning(int query_hash, QueryStat * stat);
+extern bool query_stat_converged(QueryStat *stat);
 
 /* Utilities */
 int			int_cmp(const void *a, const void *b);
@@ -359,6 +656,10 @@ int *argsort(void *a, int n, size_t es,
 int		   *inverse_permutation(int *a, int n);
 QueryStat  *palloc_query_stat(void);
 void		pfree_query_stat(QueryStat *stat);
+void		query_stat_append(QueryStat *stat, QueryStatSeries series,
+							  double value);
+double		query_stat_get(QueryStat *stat, QueryStatSeries series, int i);
+int			query_stat_nelems(QueryStat *stat, QueryStatSeries series);
 
 /* Selectivity cache for parametrized baserels */
 void cache_selectivity(int clause_hash,
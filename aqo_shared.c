@@ -0,0 +1,131 @@
+#include "aqo.h"
+
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/shmem.h"
+
+/*****************************************************************************
+ *
+ *	SHARED MEMORY
+ *
+ * This module reserves the shared memory segments used by AQO and hands
+ * them out to the modules which keep cluster-wide state. Shared memory is
+ * only available if the library is loaded through shared_preload_libraries;
+ * otherwise every shared structure stays NULL and the modules fall back to
+ * their backend-local behaviour.
+ *
+ *****************************************************************************/
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size aqo_memsize(void);
+static void aqo_shmem_startup(void);
+static void aqo_xact_callback(XactEvent event, void *arg);
+static void aqo_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+								 SubTransactionId parentSubid, void *arg);
+
+
+/*
+ * Returns the total amount of shared memory needed by AQO.
+ */
+static Size
+aqo_memsize(void)
+{
+	Size		size = 0;
+
+	size = add_size(size, fss_cache_shmem_size());
+	size = add_size(size, query_cache_shmem_size());
+	size = add_size(size, learn_queue_shmem_size());
+	size = add_size(size, stat_cache_shmem_size());
+	size = add_size(size, usage_cache_shmem_size());
+	size = add_size(size, storage_shmem_size());
+
+	return size;
+}
+
+/*
+ * Requests shared memory and LWLocks for AQO. Must be called from _PG_init
+ * after the GUCs controlling the sizes of shared structures are defined.
+ */
+void
+aqo_init_shmem(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	RequestAddinShmemSpace(aqo_memsize());
+	RequestNamedLWLockTranche("aqo", AQO_NUM_LWLOCKS);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = aqo_shmem_startup;
+
+	RegisterXactCallback(aqo_xact_callback, NULL);
+	RegisterSubXactCallback(aqo_subxact_callback, NULL);
+}
+
+/*
+ * Allocates or attaches to the AQO shared memory structures.
+ */
+static void
+aqo_shmem_startup(void)
+{
+	LWLockPadded *locks;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	locks = GetNamedLWLockTranche("aqo");
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	fss_cache_shmem_init(&locks[AQO_FSS_CACHE_LOCK].lock);
+	query_cache_shmem_init(&locks[AQO_QUERY_CACHE_LOCK].lock);
+	learn_queue_shmem_init(&locks[AQO_LEARN_QUEUE_LOCK].lock);
+	usage_cache_shmem_init(&locks[AQO_USAGE_CACHE_LOCK].lock);
+	stat_cache_shmem_init(&locks[AQO_STAT_CACHE_LOCKS]);
+	storage_shmem_init(&locks[AQO_LEARN_LOCKS]);
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Finishes the work of shared caches at the end of a transaction.
+ */
+static void
+aqo_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			fss_cache_at_xact_end();
+			query_cache_at_xact_end();
+			stat_cache_at_xact_end(event == XACT_EVENT_COMMIT ||
+								   event == XACT_EVENT_PARALLEL_COMMIT);
+			learn_worker_at_xact_end(event != XACT_EVENT_ABORT &&
+									 event != XACT_EVENT_PARALLEL_ABORT);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Finishes the work of shared caches at the end of a subtransaction.
+ */
+static void
+aqo_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					 SubTransactionId parentSubid, void *arg)
+{
+	switch (event)
+	{
+		case SUBXACT_EVENT_COMMIT_SUB:
+		case SUBXACT_EVENT_ABORT_SUB:
+			stat_cache_at_subxact_end(event == SUBXACT_EVENT_COMMIT_SUB,
+									  mySubid, parentSubid);
+			break;
+		default:
+			break;
+	}
+}
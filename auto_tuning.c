@@ -9,26 +9,30 @@
  *
  *****************************************************************************/
 
-static double get_mean(double *elems, int nelems);
-static double get_estimation(double *elems, int nelems);
-static bool is_stable(double *elems, int nelems);
-static bool converged_cq(double *elems, int nelems);
-static bool is_in_infinite_loop_cq(double *elems, int nelems);
+static double get_mean(QueryStat *stat, QueryStatSeries series,
+					   int start, int nelems);
+static double get_estimation(QueryStat *stat, QueryStatSeries series);
+static bool is_stable(QueryStat *stat, QueryStatSeries series,
+					  int start, int nelems);
+static bool converged_cq(QueryStat *stat, QueryStatSeries series, int nelems);
+static bool is_in_infinite_loop_cq(QueryStat *stat, QueryStatSeries series,
+								   int nelems);
 
 
 /*
- * Returns mean value of the array of doubles.
+ * Returns mean value of nelems values of the series starting from start-th
+ * oldest one.
  */
 double
-get_mean(double *elems, int nelems)
+get_mean(QueryStat *stat, QueryStatSeries series, int start, int nelems)
 {
 	double	sum = 0;
 	int		i;
 
 	AssertArg(nelems > 0);
 
-	for (i = 0; i < nelems; ++i)
-		sum += elems[i];
+	for (i = start; i < start + nelems; ++i)
+		sum += query_stat_get(stat, series, i);
 	return sum / nelems;
 }
 
@@ -37,8 +41,9 @@ get_mean(double *elems, int nelems)
  * Now it do simple window averaging.
  */
 double
-get_estimation(double *elems, int nelems)
+get_estimation(QueryStat *stat, QueryStatSeries series)
 {
+	int nelems = query_stat_nelems(stat, series);
 	int start;
 
 	AssertArg(nelems > 0);
@@ -48,22 +53,23 @@ get_estimation(double *elems, int nelems)
 	else
 		start = 0;
 
-	return get_mean(&elems[start], nelems - start);
+	return get_mean(stat, series, start, nelems - start);
 }
 
 /*
- * Checks whether the series is stable with absolute or relative error 0.1.
+ * Checks whether the part of the series is stable with absolute or relative
+ * error 0.1.
  */
 bool
-is_stable(double *elems, int nelems)
+is_stable(QueryStat *stat, QueryStatSeries series, int start, int nelems)
 {
 	double	est,
 			last;
 
 	AssertArg(nelems > 1);
 
-	est = get_mean(elems, nelems - 1);
-	last = elems[nelems - 1];
+	est = get_mean(stat, series, start, nelems - 1);
+	last = query_stat_get(stat, series, start + nelems - 1);
 
 	return (est * 1.1 > last || est + 0.1 > last) &&
 		   (est * 0.9 < last || est - 0.1 < last);
@@ -71,17 +77,18 @@ is_stable(double *elems, int nelems)
 
 /*
  * Tests whether cardinality qualities series is converged, i. e. learning
- * process may be considered as finished.
+ * process may be considered as finished. Only nelems oldest values of the
+ * series are considered.
  * Now it checks whether the cardinality quality stopped decreasing with
  * absolute or relative error 0.1.
  */
 bool
-converged_cq(double *elems, int nelems)
+converged_cq(QueryStat *stat, QueryStatSeries series, int nelems)
 {
 	if (nelems < auto_tuning_window_size + 2)
 		return false;
 
-	return is_stable(&elems[nelems - auto_tuning_window_size - 1],
+	return is_stable(stat, series, nelems - auto_tuning_window_size - 1,
 					 auto_tuning_window_size + 1);
 }
 
@@ -92,13 +99,25 @@ converged_cq(double *elems, int nelems)
  * absolute or relative error 0.1.
  */
 bool
-is_in_infinite_loop_cq(double *elems, int nelems)
+is_in_infinite_loop_cq(QueryStat *stat, QueryStatSeries series, int nelems)
 {
 	if (nelems - auto_tuning_infinite_loop < auto_tuning_window_size + 2)
 		return false;
 
-	return !converged_cq(elems, nelems) &&
-		   !converged_cq(elems, nelems - auto_tuning_window_size);
+	return !converged_cq(stat, series, nelems) &&
+		   !converged_cq(stat, series, nelems - auto_tuning_window_size);
+}
+
+/*
+ * Checks whether the cardinality error of the query type with AQO has
+ * converged, i. e. the learning of its models may be considered as finished.
+ */
+bool
+query_stat_converged(QueryStat *stat)
+{
+	return converged_cq(stat, STAT_CARDINALITY_ERROR_WITH_AQO,
+						query_stat_nelems(stat,
+										  STAT_CARDINALITY_ERROR_WITH_AQO));
 }
 
 /*
@@ -140,22 +159,20 @@ automatical_query_tuning(int query_hash, QueryStat * stat)
 	query_context.learn_aqo = true;
 	if (stat->executions_without_aqo < auto_tuning_window_size + 1)
 		query_context.use_aqo = false;
-	else if (!converged_cq(stat->cardinality_error_with_aqo,
-						   stat->cardinality_error_with_aqo_size) &&
-			 !is_in_infinite_loop_cq(stat->cardinality_error_with_aqo,
-									 stat->cardinality_error_with_aqo_size))
+	else if (!converged_cq(stat, STAT_CARDINALITY_ERROR_WITH_AQO,
+						   query_stat_nelems(stat,
+											 STAT_CARDINALITY_ERROR_WITH_AQO)) &&
+			 !is_in_infinite_loop_cq(stat, STAT_CARDINALITY_ERROR_WITH_AQO,
+									 query_stat_nelems(stat,
+													   STAT_CARDINALITY_ERROR_WITH_AQO)))
 		query_context.use_aqo = true;
 	else
 	{
-		t_aqo = get_estimation(stat->execution_time_with_aqo,
-							   stat->execution_time_with_aqo_size) +
-			get_estimation(stat->planning_time_with_aqo,
-						   stat->planning_time_with_aqo_size);
-
-		t_not_aqo = get_estimation(stat->execution_time_without_aqo,
-								   stat->execution_time_without_aqo_size) +
-			get_estimation(stat->planning_time_without_aqo,
-						   stat->planning_time_without_aqo_size);
+		t_aqo = get_estimation(stat, STAT_EXECUTION_TIME_WITH_AQO) +
+			get_estimation(stat, STAT_PLANNING_TIME_WITH_AQO);
+
+		t_not_aqo = get_estimation(stat, STAT_EXECUTION_TIME_WITHOUT_AQO) +
+			get_estimation(stat, STAT_PLANNING_TIME_WITHOUT_AQO);
 
 		p_use = t_not_aqo / (t_not_aqo + t_aqo);
 		p_use = 1 / (1 + exp((p_use - 0.5) / unstability));
@@ -16,23 +16,22 @@
 double
 predict_for_relation(List *restrict_clauses, List *selectivities, List *relids, int *fss_hash)
 {
+	const AQOModelMethods *methods;
 	int		nfeatures;
-	double	*matrix[aqo_K];
-	double	targets[aqo_K];
+	void	*state;
+	void	*prepared;
 	double	*features;
 	double	result;
-	int		rows;
-	int		i;
 
 	*fss_hash = get_fss_for_object(restrict_clauses, selectivities, relids,
 														&nfeatures, &features);
 
-	if (nfeatures > 0)
-		for (i = 0; i < aqo_K; ++i)
-			matrix[i] = palloc0(sizeof(**matrix) * nfeatures);
-
-	if (load_fss(*fss_hash, nfeatures, matrix, targets, &rows))
-		result = OkNNr_predict(rows, nfeatures, matrix, targets, features);
+	/* The model is not copied: the state points into the memo */
+	if (fss_memo_get(*fss_hash, nfeatures, &methods, &state, &prepared))
+	{
+		result = methods->predict(state, nfeatures, features, prepared);
+		usage_touch_fss(query_context.fspace_hash, *fss_hash);
+	}
 	else
 	{
 		/*
@@ -45,11 +44,6 @@ predict_for_relation(List *restrict_clauses, List *selectivities, List *relids,
 	}
 
 	pfree(features);
-	if (nfeatures > 0)
-	{
-		for (i = 0; i < aqo_K; ++i)
-			pfree(matrix[i]);
-	}
 
 	if (result < 0)
 		return -1;
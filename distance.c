@@ -0,0 +1,280 @@
+#include "aqo.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define USE_X86_DISTANCE_KERNELS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/*****************************************************************************
+ *
+ *	DISTANCE KERNELS
+ *
+ * Computes the distances between one object and all rows of a model in one
+ * pass. On x86-64 the kernel is vectorized with SSE2, which is always
+ * available there, or with AVX2 or AVX-512 if CPUID reports them and the OS
+ * saves their registers. The kernel is chosen on the first call.
+ *
+ * All kernels sum the squared differences in the same order: element j goes
+ * to lane j % AQO_DISTANCE_LANES, and the lanes are added up in a fixed
+ * order at the end. Multiplications and additions are never fused (see
+ * Makefile), so every kernel returns bit-identical distances and the same
+ * neighbors are selected on any CPU.
+ *
+ *****************************************************************************/
+
+#define AQO_DISTANCE_LANES	(8)
+
+typedef void (*fs_distances_function) (const double *matrix, int nrows,
+									   int stride, const double *features,
+									   int ncols, double *distances);
+
+static void fs_distances_choose(const double *matrix, int nrows, int stride,
+								const double *features, int ncols,
+								double *distances);
+static void fs_distances_scalar(const double *matrix, int nrows, int stride,
+								const double *features, int ncols,
+								double *distances);
+static double fs_distance_finish(double *lanes, const double *a,
+								 const double *b, int from, int len);
+
+#ifdef USE_X86_DISTANCE_KERNELS
+static bool x86_os_saves_registers(uint64 mask);
+static void fs_distances_sse2(const double *matrix, int nrows, int stride,
+							  const double *features, int ncols,
+							  double *distances);
+static void fs_distances_avx2(const double *matrix, int nrows, int stride,
+							  const double *features, int ncols,
+							  double *distances);
+static void fs_distances_avx512(const double *matrix, int nrows, int stride,
+								const double *features, int ncols,
+								double *distances);
+#endif
+
+static fs_distances_function fs_distances_impl = fs_distances_choose;
+
+
+/*
+ * Computes L2-distances between 'features' and each of 'nrows' rows of the
+ * row-major 'matrix' and stores them into 'distances'.
+ */
+void
+fs_distances(const double *matrix, int nrows, int stride,
+			 const double *features, int ncols, double *distances)
+{
+	fs_distances_impl(matrix, nrows, stride, features, ncols, distances);
+}
+
+/*
+ * Selects the best kernel supported by the CPU and calls it.
+ */
+static void
+fs_distances_choose(const double *matrix, int nrows, int stride,
+					const double *features, int ncols, double *distances)
+{
+	fs_distances_impl = fs_distances_scalar;
+
+#ifdef USE_X86_DISTANCE_KERNELS
+	{
+		unsigned int eax,
+					ebx,
+					ecx,
+					edx;
+
+		fs_distances_impl = fs_distances_sse2;
+
+		/* AVX needs OSXSAVE, and the OS must save YMM (and ZMM) state */
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+			(ecx & bit_OSXSAVE) != 0 &&
+			__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		{
+			if ((ebx & bit_AVX512F) != 0 && x86_os_saves_registers(0xE6))
+				fs_distances_impl = fs_distances_avx512;
+			else if ((ebx & bit_AVX2) != 0 && x86_os_saves_registers(0x06))
+				fs_distances_impl = fs_distances_avx2;
+		}
+	}
+#endif
+
+	fs_distances_impl(matrix, nrows, stride, features, ncols, distances);
+}
+
+/*
+ * Adds the squared differences of elements [from, len) to the lanes and
+ * returns the distance. Shared by all kernels to keep the order of
+ * additions the same.
+ */
+static double
+fs_distance_finish(double *lanes, const double *a, const double *b,
+				   int from, int len)
+{
+	double		res;
+	double		d;
+	int			j;
+
+	for (j = from; j < len; ++j)
+	{
+		d = a[j] - b[j];
+		lanes[j % AQO_DISTANCE_LANES] += d * d;
+	}
+
+	res = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+		((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+
+	if (len != 0)
+		res = sqrt(res / len);
+	return res;
+}
+
+/*
+ * Portable kernel, also the reference for the vectorized ones.
+ */
+static void
+fs_distances_scalar(const double *matrix, int nrows, int stride,
+					const double *features, int ncols, double *distances)
+{
+	double		lanes[AQO_DISTANCE_LANES];
+	const double *row;
+	double		d;
+	int			i,
+				j,
+				k;
+
+	for (i = 0; i < nrows; ++i)
+	{
+		row = &matrix[i * stride];
+		memset(lanes, 0, sizeof(lanes));
+
+		for (j = 0; j + AQO_DISTANCE_LANES <= ncols; j += AQO_DISTANCE_LANES)
+			for (k = 0; k < AQO_DISTANCE_LANES; ++k)
+			{
+				d = row[j + k] - features[j + k];
+				lanes[k] += d * d;
+			}
+
+		distances[i] = fs_distance_finish(lanes, row, features, j, ncols);
+	}
+}
+
+#ifdef USE_X86_DISTANCE_KERNELS
+
+/*
+ * Checks with XGETBV that the OS saves the register state given by 'mask'.
+ * Must be called only if CPUID reports OSXSAVE.
+ */
+static bool
+x86_os_saves_registers(uint64 mask)
+{
+	uint32		lo,
+				hi;
+
+	__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((((uint64) hi << 32) | lo) & mask) == mask;
+}
+
+static void
+fs_distances_sse2(const double *matrix, int nrows, int stride,
+				  const double *features, int ncols, double *distances)
+{
+	double		lanes[AQO_DISTANCE_LANES];
+	const double *row;
+	__m128d		acc0,
+				acc1,
+				acc2,
+				acc3,
+				d;
+	int			i,
+				j;
+
+	for (i = 0; i < nrows; ++i)
+	{
+		row = &matrix[i * stride];
+		acc0 = acc1 = acc2 = acc3 = _mm_setzero_pd();
+
+		for (j = 0; j + AQO_DISTANCE_LANES <= ncols; j += AQO_DISTANCE_LANES)
+		{
+			d = _mm_sub_pd(_mm_loadu_pd(&row[j]), _mm_loadu_pd(&features[j]));
+			acc0 = _mm_add_pd(acc0, _mm_mul_pd(d, d));
+			d = _mm_sub_pd(_mm_loadu_pd(&row[j + 2]),
+						   _mm_loadu_pd(&features[j + 2]));
+			acc1 = _mm_add_pd(acc1, _mm_mul_pd(d, d));
+			d = _mm_sub_pd(_mm_loadu_pd(&row[j + 4]),
+						   _mm_loadu_pd(&features[j + 4]));
+			acc2 = _mm_add_pd(acc2, _mm_mul_pd(d, d));
+			d = _mm_sub_pd(_mm_loadu_pd(&row[j + 6]),
+						   _mm_loadu_pd(&features[j + 6]));
+			acc3 = _mm_add_pd(acc3, _mm_mul_pd(d, d));
+		}
+
+		_mm_storeu_pd(&lanes[0], acc0);
+		_mm_storeu_pd(&lanes[2], acc1);
+		_mm_storeu_pd(&lanes[4], acc2);
+		_mm_storeu_pd(&lanes[6], acc3);
+		distances[i] = fs_distance_finish(lanes, row, features, j, ncols);
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+fs_distances_avx2(const double *matrix, int nrows, int stride,
+				  const double *features, int ncols, double *distances)
+{
+	double		lanes[AQO_DISTANCE_LANES];
+	const double *row;
+	__m256d		acc0,
+				acc1,
+				d;
+	int			i,
+				j;
+
+	for (i = 0; i < nrows; ++i)
+	{
+		row = &matrix[i * stride];
+		acc0 = acc1 = _mm256_setzero_pd();
+
+		for (j = 0; j + AQO_DISTANCE_LANES <= ncols; j += AQO_DISTANCE_LANES)
+		{
+			d = _mm256_sub_pd(_mm256_loadu_pd(&row[j]),
+							  _mm256_loadu_pd(&features[j]));
+			acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(d, d));
+			d = _mm256_sub_pd(_mm256_loadu_pd(&row[j + 4]),
+							  _mm256_loadu_pd(&features[j + 4]));
+			acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(d, d));
+		}
+
+		_mm256_storeu_pd(&lanes[0], acc0);
+		_mm256_storeu_pd(&lanes[4], acc1);
+		distances[i] = fs_distance_finish(lanes, row, features, j, ncols);
+	}
+}
+
+__attribute__((target("avx512f")))
+static void
+fs_distances_avx512(const double *matrix, int nrows, int stride,
+					const double *features, int ncols, double *distances)
+{
+	double		lanes[AQO_DISTANCE_LANES];
+	const double *row;
+	__m512d		acc,
+				d;
+	int			i,
+				j;
+
+	for (i = 0; i < nrows; ++i)
+	{
+		row = &matrix[i * stride];
+		acc = _mm512_setzero_pd();
+
+		for (j = 0; j + AQO_DISTANCE_LANES <= ncols; j += AQO_DISTANCE_LANES)
+		{
+			d = _mm512_sub_pd(_mm512_loadu_pd(&row[j]),
+							  _mm512_loadu_pd(&features[j]));
+			acc = _mm512_add_pd(acc, _mm512_mul_pd(d, d));
+		}
+
+		_mm512_storeu_pd(lanes, acc);
+		distances[i] = fs_distance_finish(lanes, row, features, j, ncols);
+	}
+}
+
+#endif							/* USE_X86_DISTANCE_KERNELS */
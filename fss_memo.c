@@ -0,0 +1,238 @@
+#include "aqo.h"
+
+/*****************************************************************************
+ *
+ *	PLANNING MEMO OF FSS LOOKUPS
+ *
+ * During one planning cycle the same feature subspace is requested many
+ * times: once per candidate join path and once per parameterization. This
+ * backend-local memo remembers the results of load_fss() for the current
+ * aqo_planner() invocation, including the absence of a model, so each fss
+ * is read from storage at most once per plan.
+ *
+ * If aqo.prefetch_fspace is on, the memo is filled at the start of planning
+ * with all models of the feature space of the query, which are read by one
+ * range scan over aqo_fss_access_idx. After that a missing entry means that
+ * there is no model at all, and the storage is not touched during planning.
+ *
+ * The state of the model is deserialized from the tuple (or copied from the
+ * shared model cache) directly into the memory of the memo, and the memo
+ * entry keeps that block, so the model is copied once. Predictions read it
+ * in place: fss_memo_get() returns the pointer into the memo instead of
+ * copying the state for the caller. The memo memory is properly aligned and
+ * lives until the next planning cycle, which is not true for the tuple, so
+ * the prediction can not use the tuple payload directly.
+ *
+ * The entry remembers the model which has built the state, and the
+ * predictions use that model even if the model of the feature space is
+ * changed during planning. If the model has the prepare method, the data
+ * which it prepares for the loaded state is kept in the memo too. The kNN
+ * model builds a vantage-point tree for models of at least
+ * aqo.knn_index_threshold rows, so the predictions with the model visit only
+ * a part of its rows.
+ *
+ *****************************************************************************/
+
+typedef struct
+{
+	int			fspace_hash;
+	int			fss_hash;
+} FssMemoKey;
+
+typedef struct
+{
+	FssMemoKey	key;
+	bool		found;
+	int			ncols;
+	const AQOModelMethods *methods;
+	void	   *state;			/* state of the model, see AQOModelMethods */
+	void	   *prepared;		/* result of the prepare method or NULL */
+} FssMemoEntry;
+
+static MemoryContext fss_memo_context = NULL;
+static HTAB *fss_memo = NULL;
+
+/* True if the memo contains all models of the current feature space */
+static bool fss_memo_complete = false;
+
+/* Statistics of the last planning cycle */
+static int	fss_memo_lookups = 0;
+static int	fss_memo_hits = 0;
+
+static FssMemoEntry *fss_memo_enter(int fss_hash, bool *found);
+static void fss_memo_fill(FssMemoEntry *entry, int ncols,
+						  const AQOModelMethods *methods, void *state);
+static void fss_memo_set_missing(FssMemoEntry *entry, int ncols);
+
+
+/*
+ * Creates an empty memo for a new planning cycle. Memory of the previous
+ * cycle is released.
+ */
+void
+fss_memo_init(void)
+{
+	HASHCTL		hash_ctl;
+
+	if (fss_memo_context == NULL)
+		fss_memo_context = AllocSetContextCreate(AQOMemoryContext,
+												 "AQO fss memo",
+												 ALLOCSET_DEFAULT_SIZES);
+	else
+		MemoryContextReset(fss_memo_context);
+
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(FssMemoKey);
+	hash_ctl.entrysize = sizeof(FssMemoEntry);
+	hash_ctl.hcxt = fss_memo_context;
+	fss_memo = hash_create("aqo_fss_memo",
+						   64,		/* start small and extend */
+						   &hash_ctl,
+						   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	fss_memo_complete = false;
+	fss_memo_lookups = 0;
+	fss_memo_hits = 0;
+}
+
+/*
+ * Loads all models of the current feature space into the memo.
+ */
+void
+fss_memo_prefetch(void)
+{
+	if (fss_memo == NULL)
+		return;
+
+	fss_memo_complete = load_fspace(query_context.fspace_hash,
+									fss_memo_context);
+}
+
+/*
+ * Finds or creates the memo entry for given fss of the current feature
+ * space.
+ */
+static FssMemoEntry *
+fss_memo_enter(int fss_hash, bool *found)
+{
+	FssMemoKey	key;
+
+	MemSet(&key, 0, sizeof(key));
+	key.fspace_hash = query_context.fspace_hash;
+	key.fss_hash = fss_hash;
+
+	return (FssMemoEntry *) hash_search(fss_memo, &key, HASH_ENTER, found);
+}
+
+/*
+ * Makes the memo entry own the model, which must be allocated in the memory
+ * of the memo.
+ */
+static void
+fss_memo_fill(FssMemoEntry *entry, int ncols,
+			  const AQOModelMethods *methods, void *state)
+{
+	entry->found = true;
+	entry->ncols = ncols;
+	entry->methods = methods;
+	entry->state = state;
+	entry->prepared = NULL;
+
+	if (methods->prepare != NULL)
+	{
+		MemoryContext oldCxt = MemoryContextSwitchTo(fss_memo_context);
+
+		entry->prepared = methods->prepare(state, ncols);
+		MemoryContextSwitchTo(oldCxt);
+	}
+}
+
+/*
+ * Remembers that there is no model for the entry.
+ */
+static void
+fss_memo_set_missing(FssMemoEntry *entry, int ncols)
+{
+	entry->found = false;
+	entry->ncols = ncols;
+	entry->methods = NULL;
+	entry->state = NULL;
+	entry->prepared = NULL;
+}
+
+/*
+ * Stores the model of given fss of the current feature space into the memo.
+ * The state must be allocated in the memory of the memo. Used by
+ * load_fspace().
+ */
+void
+fss_memo_store(int fss_hash, int ncols, const AQOModelMethods *methods,
+			   void *state)
+{
+	FssMemoEntry *entry;
+	bool		found;
+
+	entry = fss_memo_enter(fss_hash, &found);
+	fss_memo_fill(entry, ncols, methods, state);
+}
+
+/*
+ * Finds the model of given fss of the current feature space. Reads the
+ * storage only for the first request of the fss in the current planning
+ * cycle. On success sets 'methods' to the model, and 'state' and 'prepared'
+ * to point into the memo, and returns true. The state must not be modified
+ * by the caller.
+ */
+bool
+fss_memo_get(int fss_hash, int ncols, const AQOModelMethods **methods,
+			 void **state, void **prepared)
+{
+	FssMemoEntry *entry;
+	const AQOModelMethods *load_methods;
+	bool		found;
+	void	   *load_state;
+
+	if (fss_memo == NULL)
+		fss_memo_init();
+
+	fss_memo_lookups++;
+	entry = fss_memo_enter(fss_hash, &found);
+
+	if (found && entry->ncols == ncols)
+		fss_memo_hits++;
+	else if (!found && fss_memo_complete)
+	{
+		/* The whole feature space is loaded, so there is no such model */
+		fss_memo_hits++;
+		fss_memo_set_missing(entry, ncols);
+	}
+	else
+	{
+		/* A feature space whose model is not registered does not predict */
+		load_methods = get_fspace_model(query_context.fspace_hash);
+		if (load_methods != NULL &&
+			load_fss(fss_hash, ncols, load_methods, &load_state,
+					 fss_memo_context))
+			fss_memo_fill(entry, ncols, load_methods, load_state);
+		else
+			fss_memo_set_missing(entry, ncols);
+	}
+
+	if (!entry->found)
+		return false;
+
+	*methods = entry->methods;
+	*state = entry->state;
+	*prepared = entry->prepared;
+	return true;
+}
+
+/*
+ * Returns the number of lookups and memo hits of the last planning cycle.
+ */
+void
+fss_memo_get_stat(int *lookups, int *hits)
+{
+	*lookups = fss_memo_lookups;
+	*hits = fss_memo_hits;
+}
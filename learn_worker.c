@@ -0,0 +1,1145 @@
+#include "aqo.h"
+
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/resowner.h"
+#include "utils/timestamp.h"
+
+/*****************************************************************************
+ *
+ *	ASYNCHRONOUS LEARNING
+ *
+ * If aqo.learn_async is on, aqo_ExecutorEnd() does not update the AQO
+ * service relations itself. It serializes the learning samples and the
+ * execution statistics of the query into a shared-memory queue, and a
+ * background worker applies them later in its own transactions.
+ *
+ * Each worker serves one database and owns one channel: a ring buffer of
+ * aqo.learn_queue_size kilobytes in shared memory. The first backend which
+ * needs a channel for its database launches the worker; the worker exits
+ * after it has been idle for AQO_WORKER_IDLE_TIMEOUT and releases the
+ * channel. At most aqo.max_workers databases are served at the same time.
+ *
+ * The records of one query are put into the queue at once or not at all.
+ * If the queue is full or no channel is free, the backend learns
+ * synchronously as before, so learning is never lost because of the queue.
+ * The learning results are applied independently of the transaction of
+ * the query, though.
+ *
+ * The worker also writes the execution statistics accumulated in shared
+ * memory to aqo_query_stat every aqo.stat_flush_interval milliseconds and
+ * before it exits. It does not exit while the database has statistics to
+ * be written.
+ *
+ * If aqo_data and aqo_query_stat are unlogged (see aqo_set_unlogged()), the
+ * worker copies them into their logged snapshots every
+ * aqo.snapshot_interval milliseconds and before it exits, and restores them
+ * from the snapshots when it starts after a crash. A backend which learns
+ * synchronously launches the worker for that purpose too. The snapshot is
+ * taken only if a transaction which has changed the knowledge base has
+ * committed since the previous one (see learn_worker_note_change()), and
+ * aqo_snapshot() writes only the changed rows.
+ *
+ * Every aqo.gc_interval milliseconds the worker writes the usage marks of
+ * the knowledge base (see usage_cache.c) and collects its garbage with
+ * aqo_gc(): models of feature spaces which no query type uses, and the
+ * least recently used models above aqo.max_models. Only the removed models
+ * leave the shared model cache (see forget_fss()). The worker does not exit
+ * while the database has usage marks to be written either.
+ *
+ *****************************************************************************/
+
+/* How long the worker sleeps between the checks of an empty queue, ms */
+#define AQO_WORKER_NAPTIME			(1000)
+
+/* How long the worker waits for new records before it exits, ms */
+#define AQO_WORKER_IDLE_TIMEOUT		(60000)
+
+/* How long a launched worker may take to attach to its channel, ms */
+#define AQO_WORKER_LAUNCH_TIMEOUT	(10000)
+
+typedef enum
+{
+	LEARN_CHANNEL_FREE = 0,
+	LEARN_CHANNEL_STARTING,
+	LEARN_CHANNEL_RUNNING
+} LearnChannelState;
+
+/*
+ * One channel. 'head' and 'tail' are byte positions which only grow; the
+ * position in the ring buffer is their remainder modulo the buffer size.
+ */
+typedef struct
+{
+	LearnChannelState state;
+	Oid			dbid;
+	Latch	   *latch;
+	TimestampTz launch_time;
+	uint64		head;
+	uint64		tail;
+	pg_atomic_uint32 kb_changed;	/* the knowledge base needs a snapshot */
+} LearnChannel;
+
+typedef struct
+{
+	LWLock	   *lock;
+	int			nchannels;
+	Size		queue_size;
+	LearnChannel channels[FLEXIBLE_ARRAY_MEMBER];
+} LearnQueueState;
+
+typedef enum
+{
+	LEARN_RECORD_SAMPLE = 0,
+	LEARN_RECORD_STAT
+} LearnRecordType;
+
+/* Every record starts with this header. Sizes are MAXALIGN'ed. */
+typedef struct
+{
+	uint32		size;
+	LearnRecordType type;
+} LearnRecordHeader;
+
+/*
+ * Learning settings of the backend which has sent the samples. The worker
+ * learns with them instead of its own ones, so that the settings of the
+ * session and the role apply to asynchronous learning too.
+ */
+typedef struct
+{
+	int			model_capacity;
+	bool		model_single_precision;
+	double		model_change_threshold;
+} LearnSettings;
+
+typedef struct
+{
+	LearnRecordHeader hdr;
+	int			fspace_hash;
+	int			fss_hash;
+	int			ncols;
+	LearnSettings settings;
+	double		target;
+	double		features[FLEXIBLE_ARRAY_MEMBER];
+} LearnSampleRecord;
+
+typedef struct
+{
+	LearnRecordHeader hdr;
+	int			query_hash;
+	int			fspace_hash;
+	bool		learn_aqo;
+	bool		use_aqo;
+	bool		auto_tuning;
+	bool		adding_query;
+	double		planning_time;
+	double		execution_time;
+	double		cardinality_error;
+} LearnStatRecord;
+
+static LearnQueueState *learn_queue = NULL;
+static char *learn_queue_data = NULL;
+
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+/* Channel of the current worker */
+static int	worker_channel = -1;
+static bool worker_attached = false;
+
+/* Whether the current transaction changes the knowledge base */
+static bool kb_changed = false;
+
+static Size learn_queue_channel_size(void);
+static char *learn_queue_get_buffer(int channel);
+static void learn_queue_write(int channel, const char *data, Size len);
+static void learn_queue_read(int channel, char *data, Size len);
+static int	learn_queue_find_channel(void);
+static int	learn_queue_get_channel(bool *launch);
+static bool learn_queue_launch_worker(int channel);
+static int	learn_queue_attach(void);
+static void aqo_worker_sighup(SIGNAL_ARGS);
+static void aqo_worker_sigterm(SIGNAL_ARGS);
+static void aqo_worker_detach(int code, Datum arg);
+static Size aqo_worker_fetch(char *buf);
+static bool aqo_worker_run(void (*task) (void *arg), void *arg,
+						   const char *message);
+static void aqo_worker_learn_task(void *arg);
+static void aqo_worker_stat_task(void *arg);
+static void aqo_worker_flush_stat_task(void *arg);
+static void aqo_worker_flush_usage_task(void *arg);
+static void aqo_worker_call_task(void *arg);
+static void aqo_worker_flush_samples(List *samples, int fspace_hash,
+									 LearnSettings *settings);
+static void aqo_worker_apply_one(List *samples, LearnStatRecord *rec);
+static void aqo_worker_apply(char *buf, Size len);
+static void aqo_worker_flush_stat(void);
+static void aqo_worker_flush_usage(void);
+static bool aqo_worker_call(const char *call, const char *activity);
+static void aqo_worker_snapshot(LearnChannel *ch);
+
+
+/*
+ * Returns the size of the ring buffer of one channel.
+ */
+static Size
+learn_queue_channel_size(void)
+{
+	return MAXALIGN(mul_size(aqo_learn_queue_size, 1024));
+}
+
+/*
+ * Returns the amount of shared memory needed by the learning queue.
+ */
+Size
+learn_queue_shmem_size(void)
+{
+	Size		size;
+
+	if (aqo_learn_queue_size <= 0 || aqo_max_workers <= 0)
+		return 0;
+
+	size = MAXALIGN(add_size(offsetof(LearnQueueState, channels),
+							 mul_size(aqo_max_workers, sizeof(LearnChannel))));
+	size = add_size(size, mul_size(aqo_max_workers,
+								   learn_queue_channel_size()));
+
+	return size;
+}
+
+/*
+ * Allocates or attaches to the learning queue. The caller must hold
+ * AddinShmemInitLock.
+ */
+void
+learn_queue_shmem_init(LWLock *lock)
+{
+	bool		found;
+	Size		size = learn_queue_shmem_size();
+	int			i;
+
+	if (size == 0)
+		return;
+
+	learn_queue = ShmemInitStruct("aqo learn queue", size, &found);
+	learn_queue_data = (char *) learn_queue +
+		MAXALIGN(add_size(offsetof(LearnQueueState, channels),
+						  mul_size(aqo_max_workers, sizeof(LearnChannel))));
+
+	if (found)
+		return;
+
+	learn_queue->lock = lock;
+	learn_queue->nchannels = aqo_max_workers;
+	learn_queue->queue_size = learn_queue_channel_size();
+	for (i = 0; i < learn_queue->nchannels; ++i)
+	{
+		LearnChannel *ch = &learn_queue->channels[i];
+
+		ch->state = LEARN_CHANNEL_FREE;
+		ch->dbid = InvalidOid;
+		ch->latch = NULL;
+		ch->launch_time = 0;
+		ch->head = 0;
+		ch->tail = 0;
+		pg_atomic_init_u32(&ch->kb_changed, 0);
+	}
+}
+
+static char *
+learn_queue_get_buffer(int channel)
+{
+	return learn_queue_data + channel * learn_queue->queue_size;
+}
+
+/*
+ * Copies data to the head of the ring buffer of the channel. The caller
+ * must hold the queue lock in exclusive mode and check the free space.
+ */
+static void
+learn_queue_write(int channel, const char *data, Size len)
+{
+	LearnChannel *ch = &learn_queue->channels[channel];
+	char	   *buf = learn_queue_get_buffer(channel);
+	Size		pos = ch->head % learn_queue->queue_size;
+	Size		part = Min(len, learn_queue->queue_size - pos);
+
+	memcpy(buf + pos, data, part);
+	if (part < len)
+		memcpy(buf, data + part, len - part);
+	ch->head += len;
+}
+
+/*
+ * Copies data from the tail of the ring buffer of the channel without
+ * moving the tail. The caller must hold the queue lock.
+ */
+static void
+learn_queue_read(int channel, char *data, Size len)
+{
+	LearnChannel *ch = &learn_queue->channels[channel];
+	char	   *buf = learn_queue_get_buffer(channel);
+	Size		pos = ch->tail % learn_queue->queue_size;
+	Size		part = Min(len, learn_queue->queue_size - pos);
+
+	memcpy(data, buf + pos, part);
+	if (part < len)
+		memcpy(data + part, buf, len - part);
+}
+
+/*
+ * Returns the channel of the current database which does not need a worker
+ * to be launched, or -1. The caller must hold the queue lock.
+ */
+static int
+learn_queue_find_channel(void)
+{
+	int			i;
+
+	for (i = 0; i < learn_queue->nchannels; ++i)
+	{
+		LearnChannel *ch = &learn_queue->channels[i];
+
+		if (ch->state == LEARN_CHANNEL_FREE || ch->dbid != MyDatabaseId)
+			continue;
+
+		if (ch->state == LEARN_CHANNEL_STARTING &&
+			TimestampDifferenceExceeds(ch->launch_time, GetCurrentTimestamp(),
+									   AQO_WORKER_LAUNCH_TIMEOUT))
+			return -1;
+		return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the channel of the current database or takes a free one. Sets
+ * 'launch' if a worker for the channel must be launched. Returns -1 if all
+ * channels are busy. The caller must hold the queue lock in exclusive mode.
+ */
+static int
+learn_queue_get_channel(bool *launch)
+{
+	int			free_channel = -1;
+	int			i;
+
+	*launch = false;
+
+	for (i = 0; i < learn_queue->nchannels; ++i)
+	{
+		LearnChannel *ch = &learn_queue->channels[i];
+
+		if (ch->state == LEARN_CHANNEL_FREE)
+		{
+			if (free_channel < 0)
+				free_channel = i;
+			continue;
+		}
+
+		if (ch->dbid != MyDatabaseId)
+			continue;
+
+		/* The worker might have failed to start, launch it again */
+		if (ch->state == LEARN_CHANNEL_STARTING &&
+			TimestampDifferenceExceeds(ch->launch_time, GetCurrentTimestamp(),
+									   AQO_WORKER_LAUNCH_TIMEOUT))
+		{
+			ch->launch_time = GetCurrentTimestamp();
+			*launch = true;
+		}
+		return i;
+	}
+
+	if (free_channel >= 0)
+	{
+		LearnChannel *ch = &learn_queue->channels[free_channel];
+
+		ch->state = LEARN_CHANNEL_STARTING;
+		ch->dbid = MyDatabaseId;
+		ch->latch = NULL;
+		ch->launch_time = GetCurrentTimestamp();
+		ch->head = 0;
+		ch->tail = 0;
+		/* The previous worker could leave the changes without a snapshot */
+		pg_atomic_write_u32(&ch->kb_changed, 1);
+		*launch = true;
+	}
+
+	return free_channel;
+}
+
+/*
+ * Registers the dynamic background worker which serves the channel.
+ */
+static bool
+learn_queue_launch_worker(int channel)
+{
+	BackgroundWorker worker;
+
+	MemSet(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "aqo");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "aqo_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "aqo worker for database %u",
+			 MyDatabaseId);
+	snprintf(worker.bgw_type, BGW_MAXLEN, "aqo worker");
+	worker.bgw_main_arg = Int32GetDatum(channel);
+	worker.bgw_notify_pid = 0;
+
+	return RegisterDynamicBackgroundWorker(&worker, NULL);
+}
+
+/*
+ * Returns the channel of the current database and launches its worker if
+ * needed. Returns -1 if there is no free channel or the worker can not be
+ * launched. The exclusive lock is taken only if the database has no
+ * running worker, so the backends of a served database do not serialize
+ * on it.
+ */
+static int
+learn_queue_attach(void)
+{
+	LearnChannel *ch;
+	int			channel;
+	bool		launch;
+
+	LWLockAcquire(learn_queue->lock, LW_SHARED);
+	channel = learn_queue_find_channel();
+	LWLockRelease(learn_queue->lock);
+	if (channel >= 0)
+		return channel;
+
+	LWLockAcquire(learn_queue->lock, LW_EXCLUSIVE);
+	channel = learn_queue_get_channel(&launch);
+	LWLockRelease(learn_queue->lock);
+
+	if (channel < 0 || !launch || learn_queue_launch_worker(channel))
+		return channel;
+
+	/* No free background worker slots, give the channel back */
+	elog(DEBUG1, "AQO could not launch a background worker");
+
+	ch = &learn_queue->channels[channel];
+	LWLockAcquire(learn_queue->lock, LW_EXCLUSIVE);
+	if (ch->state == LEARN_CHANNEL_STARTING && ch->dbid == MyDatabaseId)
+	{
+		ch->state = LEARN_CHANNEL_FREE;
+		ch->dbid = InvalidOid;
+	}
+	LWLockRelease(learn_queue->lock);
+
+	return -1;
+}
+
+/*
+ * Makes sure that the worker of the current database is running, so that
+ * the statistics accumulated in shared memory will be written. Returns
+ * false if there is no worker.
+ */
+bool
+learn_worker_ensure(void)
+{
+	return learn_queue != NULL && learn_queue_attach() >= 0;
+}
+
+/*
+ * Notes that the current transaction changes aqo_data or aqo_query_stat.
+ */
+void
+learn_worker_note_change(void)
+{
+	kb_changed = true;
+}
+
+/*
+ * Tells the worker of the current database that the knowledge base needs a
+ * snapshot if the transaction which has changed it commits. If the database
+ * has no worker, the next one takes the snapshot anyway.
+ */
+void
+learn_worker_at_xact_end(bool commit)
+{
+	int			i;
+
+	if (commit && kb_changed && learn_queue != NULL &&
+		aqo_snapshot_interval > 0)
+	{
+		LWLockAcquire(learn_queue->lock, LW_SHARED);
+		for (i = 0; i < learn_queue->nchannels; ++i)
+		{
+			LearnChannel *ch = &learn_queue->channels[i];
+
+			if (ch->state != LEARN_CHANNEL_FREE && ch->dbid == MyDatabaseId)
+				pg_atomic_write_u32(&ch->kb_changed, 1);
+		}
+		LWLockRelease(learn_queue->lock);
+	}
+
+	kb_changed = false;
+}
+
+/*
+ * Puts the learning samples and the execution statistics of the current
+ * query into the queue of the current database. The fields of the records
+ * are taken from query_context. Returns false if the records were not
+ * queued; then the caller must learn synchronously.
+ */
+bool
+learn_queue_send(List *samples, bool collect_stat, double planning_time,
+				 double execution_time, double cardinality_error)
+{
+	StringInfoData buf;
+	ListCell   *l;
+	LearnChannel *ch;
+	Latch	   *latch = NULL;
+	int			channel;
+	bool		sent = false;
+
+	if (learn_queue == NULL || (samples == NIL && !collect_stat))
+		return false;
+
+	initStringInfo(&buf);
+
+	foreach(l, samples)
+	{
+		AQOLearnSample *sample = (AQOLearnSample *) lfirst(l);
+		LearnSampleRecord *rec;
+		Size		size;
+
+		size = MAXALIGN(offsetof(LearnSampleRecord, features) +
+						sizeof(double) * sample->ncols);
+		enlargeStringInfo(&buf, size);
+		rec = (LearnSampleRecord *) (buf.data + buf.len);
+		MemSet(rec, 0, size);
+		rec->hdr.size = size;
+		rec->hdr.type = LEARN_RECORD_SAMPLE;
+		rec->fspace_hash = query_context.fspace_hash;
+		rec->fss_hash = sample->fss_hash;
+		rec->ncols = sample->ncols;
+		rec->settings.model_capacity = aqo_model_capacity;
+		rec->settings.model_single_precision = aqo_model_single_precision;
+		rec->settings.model_change_threshold = aqo_model_change_threshold;
+		rec->target = sample->target;
+		if (sample->ncols > 0)
+			memcpy(rec->features, sample->features,
+				   sizeof(double) * sample->ncols);
+		buf.len += size;
+	}
+
+	if (collect_stat)
+	{
+		LearnStatRecord *rec;
+		Size		size = MAXALIGN(sizeof(LearnStatRecord));
+
+		enlargeStringInfo(&buf, size);
+		rec = (LearnStatRecord *) (buf.data + buf.len);
+		MemSet(rec, 0, size);
+		rec->hdr.size = size;
+		rec->hdr.type = LEARN_RECORD_STAT;
+		rec->query_hash = query_context.query_hash;
+		rec->fspace_hash = query_context.fspace_hash;
+		rec->learn_aqo = query_context.learn_aqo;
+		rec->use_aqo = query_context.use_aqo;
+		rec->auto_tuning = query_context.auto_tuning;
+		rec->adding_query = query_context.adding_query;
+		rec->planning_time = planning_time;
+		rec->execution_time = execution_time;
+		rec->cardinality_error = cardinality_error;
+		buf.len += size;
+	}
+
+	channel = learn_queue_attach();
+	if (channel < 0)
+	{
+		pfree(buf.data);
+		return false;
+	}
+	ch = &learn_queue->channels[channel];
+
+	/* The channel could be released by its worker meanwhile */
+	LWLockAcquire(learn_queue->lock, LW_EXCLUSIVE);
+	if (ch->state != LEARN_CHANNEL_FREE && ch->dbid == MyDatabaseId &&
+		ch->head - ch->tail + buf.len <= learn_queue->queue_size)
+	{
+		learn_queue_write(channel, buf.data, buf.len);
+		latch = ch->latch;
+		sent = true;
+	}
+	LWLockRelease(learn_queue->lock);
+
+	if (latch != NULL)
+		SetLatch(latch);
+
+	pfree(buf.data);
+	return sent;
+}
+
+static void
+aqo_worker_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+aqo_worker_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Releases the channel of the exiting worker unless it was released
+ * already. Records left in the queue are discarded.
+ */
+static void
+aqo_worker_detach(int code, Datum arg)
+{
+	LearnChannel *ch = &learn_queue->channels[DatumGetInt32(arg)];
+
+	if (!worker_attached)
+		return;
+
+	LWLockAcquire(learn_queue->lock, LW_EXCLUSIVE);
+	ch->state = LEARN_CHANNEL_FREE;
+	ch->dbid = InvalidOid;
+	ch->latch = NULL;
+	ch->head = 0;
+	ch->tail = 0;
+	LWLockRelease(learn_queue->lock);
+}
+
+/*
+ * Moves all queued records of the worker's channel into 'buf', which must
+ * be able to hold the whole ring buffer. Returns the number of bytes moved.
+ */
+static Size
+aqo_worker_fetch(char *buf)
+{
+	LearnChannel *ch = &learn_queue->channels[worker_channel];
+	Size		len;
+
+	LWLockAcquire(learn_queue->lock, LW_EXCLUSIVE);
+	len = ch->head - ch->tail;
+	if (len > 0)
+	{
+		learn_queue_read(worker_channel, buf, len);
+		ch->tail += len;
+	}
+	LWLockRelease(learn_queue->lock);
+
+	return len;
+}
+
+/*
+ * Runs the task in a subtransaction of the current transaction. If it fails,
+ * its changes are rolled back, the error is logged as a WARNING with given
+ * message, and the worker goes on, so the queued records are not lost.
+ * Returns false if the task has failed.
+ */
+static bool
+aqo_worker_run(void (*task) (void *arg), void *arg, const char *message)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	bool		done = true;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_TRY();
+	{
+		task(arg);
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+
+		ereport(WARNING,
+				(errmsg("%s", message),
+				 errdetail("%s", edata->message)));
+		FreeErrorData(edata);
+		done = false;
+	}
+	PG_END_TRY();
+
+	return done;
+}
+
+static void
+aqo_worker_learn_task(void *arg)
+{
+	learn_apply_samples((List *) arg);
+}
+
+static void
+aqo_worker_stat_task(void *arg)
+{
+	LearnStatRecord *rec = (LearnStatRecord *) arg;
+
+	learn_apply_stat(rec->planning_time, rec->execution_time,
+					 rec->cardinality_error);
+}
+
+/*
+ * Applies the learning samples of one feature space or the statistics
+ * record in a subtransaction. If it fails, the error is logged and only
+ * this part of the fetched records is lost.
+ */
+static void
+aqo_worker_apply_one(List *samples, LearnStatRecord *rec)
+{
+	char	   *message;
+
+	message = psprintf("could not apply AQO learning results of feature space %d",
+					   query_context.fspace_hash);
+	if (rec == NULL)
+		aqo_worker_run(aqo_worker_learn_task, samples, message);
+	else
+		aqo_worker_run(aqo_worker_stat_task, rec, message);
+	pfree(message);
+}
+
+/*
+ * Applies the learning samples of one feature space collected by
+ * aqo_worker_apply() with the learning settings of their sender.
+ */
+static void
+aqo_worker_flush_samples(List *samples, int fspace_hash,
+						 LearnSettings *settings)
+{
+	int			model_capacity = aqo_model_capacity;
+	bool		model_single_precision = aqo_model_single_precision;
+	double		model_change_threshold = aqo_model_change_threshold;
+
+	if (samples == NIL)
+		return;
+
+	aqo_model_capacity = settings->model_capacity;
+	aqo_model_single_precision = settings->model_single_precision;
+	aqo_model_change_threshold = settings->model_change_threshold;
+
+	query_context.fspace_hash = fspace_hash;
+	aqo_worker_apply_one(samples, NULL);
+	list_free_deep(samples);
+
+	aqo_model_capacity = model_capacity;
+	aqo_model_single_precision = model_single_precision;
+	aqo_model_change_threshold = model_change_threshold;
+}
+
+/*
+ * Applies the fetched records in one transaction. Consecutive samples of
+ * one feature space sent with the same learning settings are applied
+ * together. Each group of samples and each statistics record is applied in
+ * its own subtransaction.
+ */
+static void
+aqo_worker_apply(char *buf, Size len)
+{
+	Size		pos = 0;
+	List	   *samples = NIL;
+	int			samples_fspace = 0;
+	LearnSettings samples_settings;
+
+	MemSet(&samples_settings, 0, sizeof(samples_settings));
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "applying AQO learning results");
+
+	if (aqo_extension_exists())
+	{
+		while (pos < len)
+		{
+			LearnRecordHeader *hdr = (LearnRecordHeader *) (buf + pos);
+
+			if (hdr->type == LEARN_RECORD_SAMPLE)
+			{
+				LearnSampleRecord *rec = (LearnSampleRecord *) hdr;
+				AQOLearnSample *sample;
+
+				if (samples != NIL &&
+					(rec->fspace_hash != samples_fspace ||
+					 rec->settings.model_capacity !=
+					 samples_settings.model_capacity ||
+					 rec->settings.model_single_precision !=
+					 samples_settings.model_single_precision ||
+					 rec->settings.model_change_threshold !=
+					 samples_settings.model_change_threshold))
+				{
+					aqo_worker_flush_samples(samples, samples_fspace,
+											 &samples_settings);
+					samples = NIL;
+				}
+
+				sample = palloc(sizeof(AQOLearnSample));
+				sample->fss_hash = rec->fss_hash;
+				sample->ncols = rec->ncols;
+				sample->features = rec->features;
+				sample->target = rec->target;
+				samples = lappend(samples, sample);
+				samples_fspace = rec->fspace_hash;
+				samples_settings = rec->settings;
+			}
+			else
+			{
+				LearnStatRecord *rec = (LearnStatRecord *) hdr;
+
+				aqo_worker_flush_samples(samples, samples_fspace,
+										 &samples_settings);
+				samples = NIL;
+
+				query_context.query_hash = rec->query_hash;
+				query_context.fspace_hash = rec->fspace_hash;
+				query_context.learn_aqo = rec->learn_aqo;
+				query_context.use_aqo = rec->use_aqo;
+				query_context.auto_tuning = rec->auto_tuning;
+				query_context.adding_query = rec->adding_query;
+				query_context.collect_stat = true;
+				aqo_worker_apply_one(NIL, rec);
+			}
+
+			pos += hdr->size;
+		}
+
+		aqo_worker_flush_samples(samples, samples_fspace,
+								 &samples_settings);
+	}
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+static void
+aqo_worker_flush_stat_task(void *arg)
+{
+	stat_cache_flush();
+}
+
+/*
+ * Writes the statistics accumulated in shared memory to aqo_query_stat. If
+ * it fails, the statistics stay in shared memory until the next flush.
+ */
+static void
+aqo_worker_flush_stat(void)
+{
+	if (!stat_cache_has_dirty(MyDatabaseId))
+		return;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "writing AQO query statistics");
+
+	if (aqo_extension_exists())
+		aqo_worker_run(aqo_worker_flush_stat_task, NULL,
+					   "could not write AQO query statistics");
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+static void
+aqo_worker_flush_usage_task(void *arg)
+{
+	usage_cache_flush();
+}
+
+/*
+ * Writes the usage marks accumulated in shared memory to aqo_query_usage and
+ * aqo_data_usage. If it fails, the marks are lost, and the garbage collector
+ * sees older usage times.
+ */
+static void
+aqo_worker_flush_usage(void)
+{
+	if (!usage_cache_has_entries(MyDatabaseId))
+		return;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "writing AQO usage marks");
+
+	if (aqo_extension_exists())
+		aqo_worker_run(aqo_worker_flush_usage_task, NULL,
+					   "could not write AQO usage marks");
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/*
+ * Executes the SQL function of the extension. 'arg' is the name of the
+ * function with its arguments.
+ */
+static void
+aqo_worker_call_task(void *arg)
+{
+	const char *call = (const char *) arg;
+	StringInfoData query;
+
+	SPI_connect();
+
+	/* The functions live in the schema of the extension */
+	if (SPI_execute("SELECT pg_catalog.quote_ident(n.nspname) "
+					"FROM pg_catalog.pg_extension e "
+					"JOIN pg_catalog.pg_namespace n ON n.oid = e.extnamespace "
+					"WHERE e.extname = 'aqo'", true, 1) == SPI_OK_SELECT &&
+		SPI_processed == 1)
+	{
+		initStringInfo(&query);
+		appendStringInfo(&query, "SELECT %s.%s",
+						 SPI_getvalue(SPI_tuptable->vals[0],
+									  SPI_tuptable->tupdesc, 1),
+						 call);
+		SPI_execute(query.data, false, 0);
+	}
+
+	SPI_finish();
+}
+
+/*
+ * Calls the SQL function of the extension, such as aqo_snapshot(), in its
+ * own transaction. 'call' is the name of the function with its arguments.
+ * A failure, e.g. a deadlock of aqo_gc() with a learning backend, is logged,
+ * and the call is repeated when it is due next time. Returns false if the
+ * call has failed.
+ */
+static bool
+aqo_worker_call(const char *call, const char *activity)
+{
+	char	   *message;
+	bool		done = true;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, activity);
+
+	if (aqo_extension_exists())
+	{
+		message = psprintf("could not call AQO function %s", call);
+		done = aqo_worker_run(aqo_worker_call_task, (void *) call, message);
+		pfree(message);
+	}
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return done;
+}
+
+/*
+ * Copies the unlogged knowledge base into its snapshot if it has changed
+ * since the previous snapshot. The flag is cleared before the snapshot
+ * reads the knowledge base, so a change committed meanwhile is not missed.
+ */
+static void
+aqo_worker_snapshot(LearnChannel *ch)
+{
+	if (pg_atomic_exchange_u32(&ch->kb_changed, 0) == 0)
+		return;
+
+	if (!aqo_worker_call("aqo_snapshot()",
+						 "saving AQO knowledge base snapshot"))
+		pg_atomic_write_u32(&ch->kb_changed, 1);
+}
+
+/*
+ * Entry point of the background worker which applies the queued learning
+ * results of one database.
+ */
+void
+aqo_worker_main(Datum main_arg)
+{
+	LearnChannel *ch;
+	Oid			dbid;
+	char	   *buf;
+	TimestampTz last_activity;
+	TimestampTz last_flush;
+	TimestampTz last_snapshot;
+	TimestampTz last_gc = 0;
+	bool		exit_snapshot = false;
+	char		gc_call[64];
+
+	pqsignal(SIGHUP, aqo_worker_sighup);
+	pqsignal(SIGTERM, aqo_worker_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	worker_channel = DatumGetInt32(main_arg);
+	if (learn_queue == NULL || worker_channel >= learn_queue->nchannels)
+		proc_exit(0);
+	ch = &learn_queue->channels[worker_channel];
+
+	LWLockAcquire(learn_queue->lock, LW_EXCLUSIVE);
+	if (ch->state != LEARN_CHANNEL_STARTING)
+	{
+		/* Another worker has been launched for this channel */
+		LWLockRelease(learn_queue->lock);
+		proc_exit(0);
+	}
+	ch->state = LEARN_CHANNEL_RUNNING;
+	ch->latch = MyLatch;
+	dbid = ch->dbid;
+	worker_attached = true;
+	LWLockRelease(learn_queue->lock);
+
+	before_shmem_exit(aqo_worker_detach, Int32GetDatum(worker_channel));
+
+	BackgroundWorkerInitializeConnectionByOid(dbid, InvalidOid, 0);
+
+	if (aqo_snapshot_interval > 0)
+		aqo_worker_call("aqo_restore_snapshot()",
+						"restoring AQO knowledge base snapshot");
+
+	buf = MemoryContextAlloc(TopMemoryContext, learn_queue->queue_size);
+	last_activity = GetCurrentTimestamp();
+	last_flush = last_activity;
+	last_snapshot = last_activity;
+
+	while (!got_sigterm)
+	{
+		Size		len;
+		int			rc;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (TimestampDifferenceExceeds(last_flush, GetCurrentTimestamp(),
+									   aqo_stat_flush_interval))
+		{
+			aqo_worker_flush_stat();
+			aqo_worker_flush_usage();
+			last_flush = GetCurrentTimestamp();
+		}
+
+		if (aqo_snapshot_interval > 0 &&
+			TimestampDifferenceExceeds(last_snapshot, GetCurrentTimestamp(),
+									   aqo_snapshot_interval))
+		{
+			aqo_worker_snapshot(ch);
+			last_snapshot = GetCurrentTimestamp();
+		}
+
+		/* A previous worker of the database could collect garbage recently */
+		if (aqo_gc_interval > 0 &&
+			TimestampDifferenceExceeds(last_gc, GetCurrentTimestamp(),
+									   aqo_gc_interval) &&
+			usage_gc_is_due())
+		{
+			aqo_worker_flush_usage();
+			snprintf(gc_call, sizeof(gc_call), "aqo_gc(%d)", aqo_max_models);
+			aqo_worker_call(gc_call, "collecting AQO knowledge base garbage");
+			usage_gc_done();
+			last_gc = GetCurrentTimestamp();
+		}
+
+		len = aqo_worker_fetch(buf);
+		if (len > 0)
+		{
+			aqo_worker_apply(buf, len);
+			last_activity = GetCurrentTimestamp();
+			continue;
+		}
+
+		if (TimestampDifferenceExceeds(last_activity, GetCurrentTimestamp(),
+									   AQO_WORKER_IDLE_TIMEOUT))
+		{
+			bool		idle;
+
+			aqo_worker_flush_stat();
+			aqo_worker_flush_usage();
+			last_flush = GetCurrentTimestamp();
+
+			/*
+			 * Release the channel only if nothing has been queued or
+			 * accumulated meanwhile.
+			 */
+			LWLockAcquire(learn_queue->lock, LW_EXCLUSIVE);
+			idle = (ch->head == ch->tail) && !stat_cache_has_dirty(dbid) &&
+				!usage_cache_has_entries(dbid);
+			if (idle)
+			{
+				/* The channel may be taken by another database right away */
+				exit_snapshot = pg_atomic_exchange_u32(&ch->kb_changed, 0) != 0;
+				ch->state = LEARN_CHANNEL_FREE;
+				ch->dbid = InvalidOid;
+				ch->latch = NULL;
+				worker_attached = false;
+			}
+			LWLockRelease(learn_queue->lock);
+
+			if (idle)
+				break;
+		}
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+					   AQO_WORKER_NAPTIME,
+					   PG_WAIT_EXTENSION);
+		if (rc & WL_LATCH_SET)
+			ResetLatch(MyLatch);
+	}
+
+	/* Do not lose the statistics at shutdown */
+	if (got_sigterm)
+	{
+		aqo_worker_flush_stat();
+		aqo_worker_flush_usage();
+	}
+
+	if (aqo_snapshot_interval > 0)
+	{
+		if (worker_attached)
+			aqo_worker_snapshot(ch);
+		else if (exit_snapshot)
+			aqo_worker_call("aqo_snapshot()",
+							"saving AQO knowledge base snapshot");
+	}
+
+	proc_exit(0);
+}
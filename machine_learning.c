@@ -7,40 +7,199 @@
  * This module does not know anything about DBMS, cardinalities and all other
  * stuff. It learns matrices, predicts values and is quite happy.
  * The proposed method is designed for working with limited number of objects.
- * It is guaranteed that number of rows in the matrix will not exceed aqo_K
- * setting after learning procedure. This property also allows to adapt to
- * workloads which properties are slowly changed.
+ * It is guaranteed that learning does not add rows to the matrix beyond the
+ * capacity of the model. This property also allows to adapt to workloads
+ * which properties are slowly changed.
+ *
+ * The matrix of objects is one contiguous row-major block: the features of
+ * the i-th object start at matrix[i * stride], and 'stride' is at least the
+ * number of features.
+ *
+ * The nearest neighbors are selected with a bounded max-heap. For models
+ * with many rows the prediction can use a vantage-point tree built over the
+ * rows, which finds the same neighbors as the full scan by visiting only a
+ * part of the rows.
  *
  *****************************************************************************/
 
-static double fs_distance(double *a, double *b, int len);
+/*
+ * Neighbors of an object ordered by distance and then by row, so the order
+ * is the same whichever way they are found. The heap keeps the farthest of
+ * the nearest neighbors on top.
+ */
+typedef struct
+{
+	int			size;
+	int		   *idx;
+	double	   *dist;
+} NeighborHeap;
+
+/* Vantage-point tree over the rows of a model */
+typedef struct
+{
+	int			point;			/* row of the vantage point */
+	double		radius;			/* median distance to the vantage point */
+	int			inside;			/* node of rows not farther than radius */
+	int			outside;		/* node of rows not closer than radius */
+} VPTreeNode;
+
+struct VPTree
+{
+	int			nnodes;
+	VPTreeNode	nodes[FLEXIBLE_ARRAY_MEMBER];
+};
+
+typedef struct
+{
+	int			row;
+	double		dist;
+} VPTreeItem;
+
+/*
+ * The distances are rounded, so the triangle inequality is checked with
+ * this relative slack to never skip a neighbor the full scan would find.
+ */
+#define VP_TREE_SLACK	(1e-9)
+
 static double fs_similarity(double dist);
+static bool neighbor_before(double d1, int i1, double d2, int i2);
+static void neighbor_heap_sift_down(NeighborHeap *heap, int pos);
+static void neighbor_heap_add(NeighborHeap *heap, int row, double dist);
+static int	neighbor_heap_sort(NeighborHeap *heap);
+static int	select_neighbors(const double *distances, int nrows, int *idx);
 static double compute_weights(double *distances, int nrows, double *w, int *idx);
+static int	vp_tree_item_cmp(const void *a, const void *b);
+static int	vp_tree_build_node(VPTree *tree, const double *matrix, int ncols,
+							   int stride, VPTreeItem *items, int lo, int hi);
+static void vp_tree_search_node(const VPTree *tree, int node,
+								const double *matrix, int stride, int ncols,
+								const double *features, NeighborHeap *heap);
+static int	vp_tree_search(const VPTree *tree, const double *matrix,
+						   int stride, int ncols, const double *features,
+						   int *idx, double *dist);
 
 
 /*
- * Computes L2-distance between two given vectors.
+ * Returns similarity between objects based on distance between them.
  */
 double
-fs_distance(double *a, double *b, int len)
+fs_similarity(double dist)
 {
-	double		res = 0;
-	int			i;
+	return 1.0 / (0.001 + dist);
+}
 
-	for (i = 0; i < len; ++i)
-		res += (a[i] - b[i]) * (a[i] - b[i]);
-	if (len != 0)
-		res = sqrt(res / len);
-	return res;
+static bool
+neighbor_before(double d1, int i1, double d2, int i2)
+{
+	return d1 < d2 || (d1 == d2 && i1 < i2);
+}
+
+static void
+neighbor_heap_sift_down(NeighborHeap *heap, int pos)
+{
+	int			row = heap->idx[pos];
+	double		dist = heap->dist[pos];
+	int			child;
+
+	while ((child = 2 * pos + 1) < heap->size)
+	{
+		if (child + 1 < heap->size &&
+			neighbor_before(heap->dist[child], heap->idx[child],
+							heap->dist[child + 1], heap->idx[child + 1]))
+			child++;
+		if (!neighbor_before(dist, row, heap->dist[child], heap->idx[child]))
+			break;
+		heap->idx[pos] = heap->idx[child];
+		heap->dist[pos] = heap->dist[child];
+		pos = child;
+	}
+	heap->idx[pos] = row;
+	heap->dist[pos] = dist;
 }
 
 /*
- * Returns similarity between objects based on distance between them.
+ * Adds the row to the aqo_k nearest neighbors if it is nearer than the
+ * farthest of them.
  */
-double
-fs_similarity(double dist)
+static void
+neighbor_heap_add(NeighborHeap *heap, int row, double dist)
 {
-	return 1.0 / (0.001 + dist);
+	int			pos;
+	int			parent;
+
+	if (heap->size < aqo_k)
+	{
+		pos = heap->size++;
+		while (pos > 0)
+		{
+			parent = (pos - 1) / 2;
+			if (!neighbor_before(heap->dist[parent], heap->idx[parent],
+								 dist, row))
+				break;
+			heap->idx[pos] = heap->idx[parent];
+			heap->dist[pos] = heap->dist[parent];
+			pos = parent;
+		}
+		heap->idx[pos] = row;
+		heap->dist[pos] = dist;
+	}
+	else if (aqo_k > 0 &&
+			 neighbor_before(dist, row, heap->dist[0], heap->idx[0]))
+	{
+		heap->idx[0] = row;
+		heap->dist[0] = dist;
+		neighbor_heap_sift_down(heap, 0);
+	}
+}
+
+/*
+ * Sorts the neighbors from the nearest one and returns their number.
+ */
+static int
+neighbor_heap_sort(NeighborHeap *heap)
+{
+	int			n = heap->size;
+	int			row;
+	double		dist;
+
+	while (heap->size > 1)
+	{
+		row = heap->idx[0];
+		dist = heap->dist[0];
+		heap->size--;
+		heap->idx[0] = heap->idx[heap->size];
+		heap->dist[0] = heap->dist[heap->size];
+		neighbor_heap_sift_down(heap, 0);
+		heap->idx[heap->size] = row;
+		heap->dist[heap->size] = dist;
+	}
+	heap->size = n;
+	return n;
+}
+
+/*
+ * Chooses the aqo_k nearest rows by their distances. Stores their indexes
+ * into idx from the nearest one, fills the rest of idx with -1 and returns
+ * the number of neighbors.
+ */
+static int
+select_neighbors(const double *distances, int nrows, int *idx)
+{
+	NeighborHeap heap;
+	double		dist[AQO_MAX_NEIGHBORS];
+	int			n;
+	int			i;
+
+	heap.size = 0;
+	heap.idx = idx;
+	heap.dist = dist;
+	for (i = 0; i < nrows; ++i)
+		neighbor_heap_add(&heap, i, distances[i]);
+	n = neighbor_heap_sort(&heap);
+
+	for (i = n; i < aqo_k; ++i)
+		idx[i] = -1;
+	return n;
 }
 
 /*
@@ -53,29 +212,11 @@ fs_similarity(double dist)
 double
 compute_weights(double *distances, int nrows, double *w, int *idx)
 {
-	int		i,
-			j;
-	int		to_insert,
-			tmp;
+	int		j;
 	double	w_sum = 0;
 
-	for (i = 0; i < aqo_k; ++i)
-		idx[i] = -1;
-
 	/* Choose from all neighbors only several nearest objects */
-	for (i = 0; i < nrows; ++i)
-		for (j = 0; j < aqo_k; ++j)
-			if (idx[j] == -1 || distances[i] < distances[idx[j]])
-			{
-				to_insert = i;
-				for (; j < aqo_k; ++j)
-				{
-					tmp = idx[j];
-					idx[j] = to_insert;
-					to_insert = tmp;
-				}
-				break;
-			}
+	select_neighbors(distances, nrows, idx);
 
 	/* Compute weights by the nearest neighbors distances */
 	for (j = 0; j < aqo_k && idx[j] != -1; ++j)
@@ -86,37 +227,188 @@ compute_weights(double *distances, int nrows, double *w, int *idx)
 	return w_sum;
 }
 
+static int
+vp_tree_item_cmp(const void *a, const void *b)
+{
+	const VPTreeItem *ia = (const VPTreeItem *) a;
+	const VPTreeItem *ib = (const VPTreeItem *) b;
+
+	if (neighbor_before(ia->dist, ia->row, ib->dist, ib->row))
+		return -1;
+	if (neighbor_before(ib->dist, ib->row, ia->dist, ia->row))
+		return 1;
+	return 0;
+}
+
+/*
+ * Builds the subtree of items[lo, hi) and returns its root node or -1 if
+ * it is empty. The first item is the vantage point, the nearer half of the
+ * others goes inside and the farther half goes outside.
+ */
+static int
+vp_tree_build_node(VPTree *tree, const double *matrix, int ncols, int stride,
+				   VPTreeItem *items, int lo, int hi)
+{
+	VPTreeNode *node;
+	int			n;
+	int			mid;
+	int			i;
+
+	if (lo >= hi)
+		return -1;
+
+	n = tree->nnodes++;
+	node = &tree->nodes[n];
+	node->point = items[lo].row;
+	node->radius = 0;
+	node->inside = -1;
+	node->outside = -1;
+
+	if (hi - lo == 1)
+		return n;
+
+	for (i = lo + 1; i < hi; ++i)
+		fs_distances(&matrix[items[i].row * stride], 1, stride,
+					 &matrix[node->point * stride], ncols, &items[i].dist);
+	qsort(&items[lo + 1], hi - lo - 1, sizeof(VPTreeItem), vp_tree_item_cmp);
+
+	mid = (lo + 1 + hi) / 2;
+	node->radius = items[mid].dist;
+	node->inside = vp_tree_build_node(tree, matrix, ncols, stride,
+									  items, lo + 1, mid);
+	node->outside = vp_tree_build_node(tree, matrix, ncols, stride,
+									   items, mid, hi);
+	return n;
+}
+
+/*
+ * Builds the vantage-point tree over the rows of the matrix. The tree does
+ * not copy the matrix, so it is valid while the matrix is not changed.
+ */
+VPTree *
+vp_tree_build(const double *matrix, int nrows, int ncols, int stride)
+{
+	VPTree	   *tree = palloc(offsetof(VPTree, nodes) +
+							  sizeof(VPTreeNode) * nrows);
+	VPTreeItem *items = palloc(sizeof(VPTreeItem) * nrows);
+	int			i;
+
+	for (i = 0; i < nrows; ++i)
+		items[i].row = i;
+	tree->nnodes = 0;
+	vp_tree_build_node(tree, matrix, ncols, stride, items, 0, nrows);
+
+	pfree(items);
+	return tree;
+}
+
+static void
+vp_tree_search_node(const VPTree *tree, int node, const double *matrix,
+					int stride, int ncols, const double *features,
+					NeighborHeap *heap)
+{
+	const VPTreeNode *n;
+	double		d;
+	double		slack;
+
+	if (node < 0)
+		return;
+
+	n = &tree->nodes[node];
+	fs_distances(&matrix[n->point * stride], 1, stride, features, ncols, &d);
+	neighbor_heap_add(heap, n->point, d);
+	slack = VP_TREE_SLACK * (1 + d + n->radius);
+
+	/*
+	 * By the triangle inequality the rows inside are not nearer than
+	 * d - radius, and the rows outside are not nearer than radius - d.
+	 */
+	if (d < n->radius)
+	{
+		vp_tree_search_node(tree, n->inside, matrix, stride, ncols,
+							features, heap);
+		if (heap->size < aqo_k || n->radius - d <= heap->dist[0] + slack)
+			vp_tree_search_node(tree, n->outside, matrix, stride, ncols,
+								features, heap);
+	}
+	else
+	{
+		vp_tree_search_node(tree, n->outside, matrix, stride, ncols,
+							features, heap);
+		if (heap->size < aqo_k || d - n->radius <= heap->dist[0] + slack)
+			vp_tree_search_node(tree, n->inside, matrix, stride, ncols,
+								features, heap);
+	}
+}
+
+/*
+ * Finds the aqo_k nearest rows with the tree. Stores their indexes and
+ * distances from the nearest one and returns their number.
+ */
+static int
+vp_tree_search(const VPTree *tree, const double *matrix, int stride,
+			   int ncols, const double *features, int *idx, double *dist)
+{
+	NeighborHeap heap;
+
+	heap.size = 0;
+	heap.idx = idx;
+	heap.dist = dist;
+	if (tree->nnodes > 0)
+		vp_tree_search_node(tree, 0, matrix, stride, ncols, features, &heap);
+	return neighbor_heap_sort(&heap);
+}
+
 /*
  * With given matrix, targets and features makes prediction for current object.
+ * 'index' is the tree built over the matrix by vp_tree_build() or NULL.
  *
  * Returns negative value in the case of refusal to make a prediction, because
  * positive targets are assumed.
  */
 double
-OkNNr_predict(int nrows, int ncols, double **matrix, const double *targets,
-			  double *features)
+OkNNr_predict(int nrows, int ncols, const double *matrix, int stride,
+			  const double *targets, const double *features,
+			  const VPTree *index)
 {
-	double	   distances[aqo_K];
+	double		distances_buf[AQO_DEFAULT_MODEL_CAPACITY];
+	double	   *distances;
 	int			i;
-	int		   idx[aqo_K]; /* indexes of nearest neighbors */
-	double	   w[aqo_K];
-	double		w_sum;
+	int		   idx[AQO_MAX_NEIGHBORS]; /* indexes of nearest neighbors */
+	double	   dist[AQO_MAX_NEIGHBORS];
+	double	   w[AQO_MAX_NEIGHBORS];
+	int			n;
+	double		w_sum = 0;
 	double		result = 0;
 
-	for (i = 0; i < nrows; ++i)
-		distances[i] = fs_distance(matrix[i], features, ncols);
+	if (index != NULL)
+		n = vp_tree_search(index, matrix, stride, ncols, features, idx, dist);
+	else
+	{
+		distances = (nrows <= AQO_DEFAULT_MODEL_CAPACITY) ?
+			distances_buf : palloc(sizeof(double) * nrows);
+		fs_distances(matrix, nrows, stride, features, ncols, distances);
+		n = select_neighbors(distances, nrows, idx);
+		for (i = 0; i < n; ++i)
+			dist[i] = distances[idx[i]];
+		if (distances != distances_buf)
+			pfree(distances);
+	}
 
-	w_sum = compute_weights(distances, nrows, w, idx);
+	for (i = 0; i < n; ++i)
+	{
+		w[i] = fs_similarity(dist[i]);
+		w_sum += w[i];
+	}
 
-	for (i = 0; i < aqo_k; ++i)
-		if (idx[i] != -1)
-			result += targets[idx[i]] * w[i] / w_sum;
+	for (i = 0; i < n; ++i)
+		result += targets[idx[i]] * w[i] / w_sum;
 
 	if (result < 0)
 		result = 0;
 
 	/* this should never happen */
-	if (idx[0] == -1)
+	if (n == 0)
 		result = -1;
 
 	return result;
@@ -129,26 +421,32 @@ OkNNr_predict(int nrows, int ncols, double **matrix, const double *targets,
  * updates this line in database, otherwise adds new line with given index.
  * It is supposed that indexes of new lines are consequent numbers
  * starting from matrix_rows.
+ * A new line is added only while there are less than 'capacity' lines, and
+ * the matrix must have room for it.
  */
 int
-OkNNr_learn(int nrows, int nfeatures, double **matrix, double *targets,
-			double *features, double target)
+OkNNr_learn(int nrows, int nfeatures, int capacity, double *matrix,
+			int stride, double *targets, const double *features,
+			double target)
 {
-	double	   distances[aqo_K];
+	double		distances_buf[AQO_DEFAULT_MODEL_CAPACITY];
+	double	   *distances;
 	int			i,
 				j;
 	int			mid = 0; /* index of row with minimum distance value */
-	int		   idx[aqo_K];
+	int		   idx[AQO_MAX_NEIGHBORS];
+	double	   *feature;
+
+	distances = (nrows <= AQO_DEFAULT_MODEL_CAPACITY) ?
+		distances_buf : palloc(sizeof(double) * nrows);
 
 	/*
 	 * For each neighbor compute distance and search for nearest object.
 	 */
+	fs_distances(matrix, nrows, stride, features, nfeatures, distances);
 	for (i = 0; i < nrows; ++i)
-	{
-		distances[i] = fs_distance(matrix[i], features, nfeatures);
 		if (distances[i] < distances[mid])
 			mid = i;
-	}
 
 	/*
 	 * We do not want to add new very similar neighbor. And we can't
@@ -157,34 +455,31 @@ OkNNr_learn(int nrows, int nfeatures, double **matrix, double *targets,
 	 */
 	if (nrows != 0 && distances[mid] < object_selection_threshold)
 	{
+		feature = &matrix[mid * stride];
 		for (j = 0; j < nfeatures; ++j)
-			matrix[mid][j] += learning_rate * (features[j] - matrix[mid][j]);
+			feature[j] += learning_rate * (features[j] - feature[j]);
 		targets[mid] += learning_rate * (target - targets[mid]);
-
-		return nrows;
 	}
-
-	if (nrows < aqo_K)
+	else if (nrows < capacity)
 	{
 		/* We can't reached limit of stored neighbors */
 
 		/*
 		 * Add new line into the matrix. We can do this because matrix_rows
-		 * is not the boundary of matrix. Matrix has aqo_K free lines
+		 * is not the boundary of matrix. Matrix has capacity free lines
 		 */
+		feature = &matrix[nrows * stride];
 		for (j = 0; j < nfeatures; ++j)
-			matrix[nrows][j] = features[j];
+			feature[j] = features[j];
 		targets[nrows] = target;
-
-		return nrows+1;
+		nrows++;
 	}
 	else
 	{
-		double	*feature;
 		double	avg_target = 0;
 		double	tc_coef; /* Target correction coefficient */
 		double	fc_coef; /* Feature correction coefficient */
-		double	w[aqo_K];
+		double	w[AQO_MAX_NEIGHBORS];
 		double	w_sum;
 
 		/*
@@ -218,14 +513,15 @@ OkNNr_learn(int nrows, int nfeatures, double **matrix, double *targets,
 				sqrt(nfeatures) / w_sum;
 
 			targets[idx[i]] -= tc_coef * w[i] / w_sum;
+			feature = &matrix[idx[i] * stride];
 			for (j = 0; j < nfeatures; ++j)
-			{
-				feature = matrix[idx[i]];
 				feature[j] -= fc_coef * (features[j] - feature[j]) /
 					distances[idx[i]];
-			}
 		}
 	}
 
+	if (distances != distances_buf)
+		pfree(distances);
+
 	return nrows;
 }
@@ -0,0 +1,472 @@
+#include "aqo.h"
+
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+/*****************************************************************************
+ *
+ *	SHARED MODEL CACHE
+ *
+ * Keeps deserialized models of feature subspaces in shared memory, so that
+ * the prediction for an already known fss does not require an index scan
+ * over aqo_data and the deserialization of its value.
+ *
+ * The cache consists of a fixed number of slots (aqo.fss_cache_size), each
+ * of which can hold a kNN model of up to AQO_DEFAULT_MODEL_CAPACITY rows and
+ * aqo.fss_cache_max_features columns, or the state of any model whose
+ * memory size (see AQOModelMethods) is not larger. Larger models are never
+ * cached. The state is opaque to the cache: it is copied in and out with
+ * memcpy() together with the name of its model, and is returned only to a
+ * backend which uses the same model for the feature space. Slots
+ * are reused with the clock-sweep algorithm. A shared hash table maps
+ * (database, aqo_data, fspace_hash, fss_hash) to the slot index.
+ *
+ * The cache contains only committed models. The backend which changes
+ * aqo_data removes the corresponding entries immediately and once again at
+ * the end of its transaction; until then it bypasses the cache, because
+ * load_fss() sees its own uncommitted changes. To prevent a concurrent
+ * reader from putting the older version of a model back, every invalidation
+ * increments the generation counter, and the model read from the heap is
+ * stored only if the counter has not changed during the read.
+ *
+ *****************************************************************************/
+
+/* Upper bound of the usage count of a slot for the clock-sweep */
+#define FSS_CACHE_MAX_USAGE	(5)
+
+/*
+ * The OID of aqo_data is a part of the key, so models of a dropped extension
+ * are never found after it is created again.
+ */
+typedef struct
+{
+	Oid			dbid;
+	Oid			relid;
+	int			fspace_hash;
+	int			fss_hash;
+} FssCacheKey;
+
+typedef struct
+{
+	FssCacheKey key;
+	int			slot;
+} FssCacheEntry;
+
+/*
+ * One cached model. The data field contains the state of the model of
+ * 'size' bytes.
+ */
+typedef struct
+{
+	FssCacheKey key;
+	bool		used;
+	pg_atomic_uint32 usage;
+	NameData	model;
+	int			ncols;
+	Size		size;
+	double		data[FLEXIBLE_ARRAY_MEMBER];
+} FssCacheSlot;
+
+typedef struct
+{
+	LWLock	   *lock;
+	pg_atomic_uint64 generation;
+	int			nslots;
+	int			max_features;
+	Size		slot_size;
+	int			clock_hand;
+} FssCacheState;
+
+static FssCacheState *fss_cache = NULL;
+static HTAB *fss_cache_htab = NULL;
+static char *fss_cache_slots = NULL;
+
+/*
+ * Keys of the models changed by the current transaction. They are
+ * invalidated once again at the end of the transaction.
+ */
+static List *pending_keys = NIL;
+static bool pending_reset = false;
+
+static Size fss_cache_slot_size(int max_features);
+static FssCacheSlot *fss_cache_get_slot(int slot);
+static bool fss_cache_is_usable(void);
+static bool fss_cache_set_key(FssCacheKey *key, int fspace_hash, int fss_hash);
+static int	fss_cache_get_victim(void);
+static void fss_cache_remove(FssCacheKey *key);
+static void fss_cache_remove_database(Oid dbid);
+
+
+/*
+ * Returns the size of one cache slot for the given maximum number of
+ * features.
+ */
+static Size
+fss_cache_slot_size(int max_features)
+{
+	return MAXALIGN(add_size(offsetof(FssCacheSlot, data),
+							 knn_state_size(AQO_DEFAULT_MODEL_CAPACITY,
+											max_features)));
+}
+
+static FssCacheSlot *
+fss_cache_get_slot(int slot)
+{
+	return (FssCacheSlot *) (fss_cache_slots + slot * fss_cache->slot_size);
+}
+
+/*
+ * Returns the amount of shared memory needed by the model cache.
+ */
+Size
+fss_cache_shmem_size(void)
+{
+	Size		size = MAXALIGN(sizeof(FssCacheState));
+
+	if (aqo_fss_cache_size > 0)
+	{
+		size = add_size(size, hash_estimate_size(aqo_fss_cache_size,
+												 sizeof(FssCacheEntry)));
+		size = add_size(size,
+						mul_size(aqo_fss_cache_size,
+								 fss_cache_slot_size(aqo_fss_cache_max_features)));
+	}
+
+	return size;
+}
+
+/*
+ * Allocates or attaches to the model cache. The caller must hold
+ * AddinShmemInitLock.
+ */
+void
+fss_cache_shmem_init(LWLock *lock)
+{
+	bool		found;
+	HASHCTL		info;
+	int			i;
+
+	fss_cache = ShmemInitStruct("aqo fss cache",
+								sizeof(FssCacheState),
+								&found);
+	if (!found)
+	{
+		fss_cache->lock = lock;
+		pg_atomic_init_u64(&fss_cache->generation, 0);
+		fss_cache->nslots = aqo_fss_cache_size;
+		fss_cache->max_features = aqo_fss_cache_max_features;
+		fss_cache->slot_size = fss_cache_slot_size(aqo_fss_cache_max_features);
+		fss_cache->clock_hand = 0;
+	}
+
+	if (fss_cache->nslots <= 0)
+		return;
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(FssCacheKey);
+	info.entrysize = sizeof(FssCacheEntry);
+	fss_cache_htab = ShmemInitHash("aqo fss cache hash",
+								   fss_cache->nslots, fss_cache->nslots,
+								   &info,
+								   HASH_ELEM | HASH_BLOBS);
+
+	fss_cache_slots = ShmemInitStruct("aqo fss cache slots",
+									  mul_size(fss_cache->nslots,
+											   fss_cache->slot_size),
+									  &found);
+	if (!found)
+	{
+		for (i = 0; i < fss_cache->nslots; ++i)
+		{
+			FssCacheSlot *slot = fss_cache_get_slot(i);
+
+			slot->used = false;
+			pg_atomic_init_u32(&slot->usage, 0);
+		}
+	}
+}
+
+/*
+ * Checks whether the cache may be used by the current backend.
+ */
+static bool
+fss_cache_is_usable(void)
+{
+	return fss_cache != NULL && fss_cache->nslots > 0 &&
+		   pending_keys == NIL && !pending_reset;
+}
+
+/*
+ * Fills the cache key. Returns false if aqo_data does not exist.
+ */
+static bool
+fss_cache_set_key(FssCacheKey *key, int fspace_hash, int fss_hash)
+{
+	MemSet(key, 0, sizeof(*key));
+	key->dbid = MyDatabaseId;
+	key->relid = get_aqo_relid(AQO_DATA);
+	key->fspace_hash = fspace_hash;
+	key->fss_hash = fss_hash;
+
+	return OidIsValid(key->relid);
+}
+
+/*
+ * Returns the current generation of the cache. The caller passes it to
+ * fss_cache_store() after reading the model from the heap.
+ */
+uint64
+fss_cache_generation(void)
+{
+	if (fss_cache == NULL)
+		return 0;
+
+	return pg_atomic_read_u64(&fss_cache->generation);
+}
+
+/*
+ * Looks for the model of given feature subspace in the cache.
+ * Returns true if the state of the model was found and copied into 'state',
+ * which is allocated in the current memory context.
+ */
+bool
+fss_cache_lookup(int fspace_hash, int fss_hash, int ncols,
+				 const AQOModelMethods *methods, void **state)
+{
+	FssCacheKey key;
+	FssCacheEntry *entry;
+	FssCacheSlot *slot;
+	bool		found = false;
+
+	if (!fss_cache_is_usable() ||
+		!fss_cache_set_key(&key, fspace_hash, fss_hash))
+		return false;
+
+	LWLockAcquire(fss_cache->lock, LW_SHARED);
+	entry = (FssCacheEntry *) hash_search(fss_cache_htab, &key,
+										  HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		slot = fss_cache_get_slot(entry->slot);
+
+		if (slot->ncols == ncols &&
+			strcmp(NameStr(slot->model), methods->name) == 0)
+		{
+			*state = palloc(slot->size);
+			memcpy(*state, slot->data, slot->size);
+
+			if (pg_atomic_read_u32(&slot->usage) < FSS_CACHE_MAX_USAGE)
+				pg_atomic_fetch_add_u32(&slot->usage, 1);
+			found = true;
+		}
+	}
+	LWLockRelease(fss_cache->lock);
+
+	return found;
+}
+
+/*
+ * Selects the slot for a new model with the clock-sweep algorithm and
+ * removes its previous content from the hash table. The caller must hold
+ * the cache lock in exclusive mode.
+ */
+static int
+fss_cache_get_victim(void)
+{
+	for (;;)
+	{
+		int			victim = fss_cache->clock_hand;
+		FssCacheSlot *slot = fss_cache_get_slot(victim);
+		uint32		usage;
+
+		fss_cache->clock_hand = (victim + 1) % fss_cache->nslots;
+
+		if (!slot->used)
+			return victim;
+
+		usage = pg_atomic_read_u32(&slot->usage);
+		if (usage == 0)
+		{
+			hash_search(fss_cache_htab, &slot->key, HASH_REMOVE, NULL);
+			slot->used = false;
+			return victim;
+		}
+		pg_atomic_write_u32(&slot->usage, usage - 1);
+	}
+}
+
+/*
+ * Stores the state of the model read from the heap into the cache, if it
+ * fits a slot.
+ * 'generation' is the value returned by fss_cache_generation() before the
+ * model was read; the model is not stored if the cache has been invalidated
+ * since then.
+ */
+void
+fss_cache_store(int fspace_hash, int fss_hash, int ncols,
+				const AQOModelMethods *methods, const void *state,
+				uint64 generation)
+{
+	FssCacheKey key;
+	FssCacheEntry *entry;
+	FssCacheSlot *slot;
+	Size		size;
+	bool		found;
+
+	if (!fss_cache_is_usable())
+		return;
+
+	size = methods->memory_size(state, ncols);
+	if (size > fss_cache->slot_size - offsetof(FssCacheSlot, data) ||
+		!fss_cache_set_key(&key, fspace_hash, fss_hash))
+		return;
+
+	LWLockAcquire(fss_cache->lock, LW_EXCLUSIVE);
+
+	if (pg_atomic_read_u64(&fss_cache->generation) != generation)
+	{
+		LWLockRelease(fss_cache->lock);
+		return;
+	}
+
+	entry = (FssCacheEntry *) hash_search(fss_cache_htab, &key,
+										  HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		int			victim = fss_cache_get_victim();
+
+		entry = (FssCacheEntry *) hash_search(fss_cache_htab, &key,
+											  HASH_ENTER, &found);
+		Assert(!found);
+		entry->slot = victim;
+	}
+
+	slot = fss_cache_get_slot(entry->slot);
+	slot->key = key;
+	slot->used = true;
+	namestrcpy(&slot->model, methods->name);
+	slot->ncols = ncols;
+	slot->size = size;
+	memcpy(slot->data, state, size);
+	pg_atomic_write_u32(&slot->usage, 1);
+
+	LWLockRelease(fss_cache->lock);
+}
+
+/*
+ * Removes the model with given key from the cache and increments the
+ * generation counter.
+ */
+static void
+fss_cache_remove(FssCacheKey *key)
+{
+	FssCacheEntry *entry;
+
+	LWLockAcquire(fss_cache->lock, LW_EXCLUSIVE);
+	pg_atomic_fetch_add_u64(&fss_cache->generation, 1);
+
+	entry = (FssCacheEntry *) hash_search(fss_cache_htab, key,
+										  HASH_REMOVE, NULL);
+	if (entry != NULL)
+	{
+		FssCacheSlot *slot = fss_cache_get_slot(entry->slot);
+
+		slot->used = false;
+		pg_atomic_write_u32(&slot->usage, 0);
+	}
+
+	LWLockRelease(fss_cache->lock);
+}
+
+/*
+ * Removes all models of the given database from the cache.
+ */
+static void
+fss_cache_remove_database(Oid dbid)
+{
+	int			i;
+
+	LWLockAcquire(fss_cache->lock, LW_EXCLUSIVE);
+	pg_atomic_fetch_add_u64(&fss_cache->generation, 1);
+
+	for (i = 0; i < fss_cache->nslots; ++i)
+	{
+		FssCacheSlot *slot = fss_cache_get_slot(i);
+
+		if (!slot->used || slot->key.dbid != dbid)
+			continue;
+
+		hash_search(fss_cache_htab, &slot->key, HASH_REMOVE, NULL);
+		slot->used = false;
+		pg_atomic_write_u32(&slot->usage, 0);
+	}
+
+	LWLockRelease(fss_cache->lock);
+}
+
+/*
+ * Invalidates the cached model of the given feature subspace. Must be
+ * called by each writer of aqo_data.
+ */
+void
+fss_cache_invalidate(int fspace_hash, int fss_hash)
+{
+	FssCacheKey *key;
+	MemoryContext oldCxt;
+
+	if (fss_cache == NULL || fss_cache->nslots <= 0)
+		return;
+
+	oldCxt = MemoryContextSwitchTo(TopMemoryContext);
+	key = palloc(sizeof(*key));
+	if (!fss_cache_set_key(key, fspace_hash, fss_hash))
+	{
+		pfree(key);
+		MemoryContextSwitchTo(oldCxt);
+		return;
+	}
+	pending_keys = lappend(pending_keys, key);
+	MemoryContextSwitchTo(oldCxt);
+
+	fss_cache_remove(key);
+}
+
+/*
+ * Invalidates all cached models of the current database. Used if aqo_data
+ * was changed by the user.
+ */
+void
+fss_cache_reset(void)
+{
+	if (fss_cache == NULL || fss_cache->nslots <= 0)
+		return;
+
+	pending_reset = true;
+	fss_cache_remove_database(MyDatabaseId);
+}
+
+/*
+ * Repeats the invalidations made by the finished transaction, because
+ * concurrent backends could cache the older versions of the models before
+ * our changes became visible.
+ */
+void
+fss_cache_at_xact_end(void)
+{
+	ListCell   *l;
+
+	if (pending_keys == NIL && !pending_reset)
+		return;
+
+	if (pending_reset)
+		fss_cache_remove_database(MyDatabaseId);
+	else
+		foreach(l, pending_keys)
+			fss_cache_remove((FssCacheKey *) lfirst(l));
+
+	list_free_deep(pending_keys);
+	pending_keys = NIL;
+	pending_reset = false;
+}
@@ -0,0 +1,437 @@
+#include "aqo.h"
+
+#include "access/heapam.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "commands/trigger.h"
+#include "miscadmin.h"
+#include "utils/float.h"
+#include "utils/inval.h"
+
+/*****************************************************************************
+ *
+ *	MODELS OF FEATURE SPACES
+ *
+ * Each feature space predicts and learns with one model, which is chosen by
+ * the name in aqo_fspace_settings (see aqo_set_model()). The feature spaces
+ * without a setting use the built-in kNN model of machine_learning.c.
+ *
+ * Models are registered by name in the process-local registry. The built-in
+ * model is always there; other extensions add their models while they are
+ * loaded by shared_preload_libraries after AQO, so every backend and the
+ * background workers know the same models.
+ *
+ * The model of a feature space is looked up once per backend and remembered
+ * in a local hash table, which is reset by relcache invalidation of
+ * aqo_fspace_settings (see aqo_relcache_callback()). If the setting names a
+ * model which is not registered, the feature space neither predicts nor
+ * learns, because its stored models have the format of another model.
+ *
+ * The state of the kNN model keeps the matrix of its objects with room for
+ * more rows, so learning adds an object in place. The state loaded for
+ * prediction has no spare room, so it takes less space in the caches.
+ *
+ *****************************************************************************/
+
+#define AQO_MAX_MODELS		(16)
+
+typedef struct
+{
+	int			fspace_hash;
+	const AQOModelMethods *methods;		/* NULL if the model is unknown */
+} FspaceModelEntry;
+
+/*
+ * State of the kNN model: the matrix of 'capacity' rows of ncols features in
+ * row-major order followed by 'capacity' targets. The first nrows rows and
+ * targets are used.
+ */
+typedef struct
+{
+	int32		nrows;
+	int32		capacity;
+	double		data[FLEXIBLE_ARRAY_MEMBER];
+} KnnState;
+
+#define KnnStateTargets(state, ncols) \
+	(&(state)->data[(state)->capacity * (ncols)])
+
+static KnnState *knn_alloc(int capacity, int ncols);
+static void *knn_deserialize(Datum datum, int ncols);
+static bytea *knn_serialize(const void *state, int ncols);
+static Size knn_memory_size(const void *state, int ncols);
+static double knn_predict(const void *state, int ncols,
+						  const double *features, const void *prepared);
+static void *knn_learn(void *state, int ncols, int capacity,
+					   const double *features, double target);
+static void *knn_prepare(const void *state, int ncols);
+static double knn_change(const void *old_state, const void *new_state,
+						 int ncols);
+
+static const AQOModelMethods knn_model = {
+	"knn",
+	knn_deserialize,
+	knn_serialize,
+	knn_memory_size,
+	knn_predict,
+	knn_learn,
+	knn_prepare,
+	knn_change
+};
+
+static const AQOModelMethods *registered_models[AQO_MAX_MODELS] = {&knn_model};
+static int	nregistered_models = 1;
+
+static HTAB *fspace_models = NULL;
+
+static const AQOModelMethods *find_aqo_model(const char *name);
+static bool load_fspace_model(int fspace_hash,
+							  const AQOModelMethods **methods);
+
+
+/*
+ * Returns the size of the kNN state with room for 'capacity' rows.
+ */
+Size
+knn_state_size(int capacity, int ncols)
+{
+	return offsetof(KnnState, data) +
+		sizeof(double) * Max(capacity, 1) * (ncols + 1);
+}
+
+static KnnState *
+knn_alloc(int capacity, int ncols)
+{
+	KnnState   *state = palloc(knn_state_size(capacity, ncols));
+
+	state->nrows = 0;
+	state->capacity = capacity;
+	return state;
+}
+
+/*
+ * Expands the packed model of aqo_data into the state without spare room.
+ */
+static void *
+knn_deserialize(Datum datum, int ncols)
+{
+	AQOPackedModel *model = get_packed_model(datum);
+	KnnState   *state;
+
+	if (model->ncols != ncols)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid AQO model format"),
+				 errdetail("Model has %d features, expected %d.",
+						   model->ncols, ncols)));
+
+	state = knn_alloc(model->nrows, ncols);
+	state->nrows = model->nrows;
+	unpack_model(model, state->data, KnnStateTargets(state, ncols));
+
+	if ((Pointer) model != DatumGetPointer(datum))
+		pfree(model);
+	return state;
+}
+
+static bytea *
+knn_serialize(const void *state, int ncols)
+{
+	KnnState   *knn = (KnnState *) state;
+
+	return form_model(knn->data, KnnStateTargets(knn, ncols),
+					  knn->nrows, ncols);
+}
+
+static Size
+knn_memory_size(const void *state, int ncols)
+{
+	return knn_state_size(((const KnnState *) state)->capacity, ncols);
+}
+
+/*
+ * Predicts with the vantage-point tree built by knn_prepare(), if any.
+ */
+static double
+knn_predict(const void *state, int ncols, const double *features,
+			const void *prepared)
+{
+	KnnState   *knn = (KnnState *) state;
+
+	return OkNNr_predict(knn->nrows, ncols, knn->data, ncols,
+						 KnnStateTargets(knn, ncols), features,
+						 (const VPTree *) prepared);
+}
+
+/*
+ * Adds the object with OkNNr_learn(). The state is enlarged up to the
+ * capacity first; a state of more rows, learned with a larger capacity,
+ * keeps them.
+ */
+static void *
+knn_learn(void *state, int ncols, int capacity, const double *features,
+		  double target)
+{
+	KnnState   *knn = (KnnState *) state;
+	int			nrows = (knn != NULL) ? knn->nrows : 0;
+
+	if (knn == NULL || knn->capacity < Max(capacity, nrows))
+	{
+		KnnState   *room = knn_alloc(Max(capacity, nrows), ncols);
+
+		if (knn != NULL)
+		{
+			room->nrows = nrows;
+			memcpy(room->data, knn->data, sizeof(double) * nrows * ncols);
+			memcpy(KnnStateTargets(room, ncols), KnnStateTargets(knn, ncols),
+				   sizeof(double) * nrows);
+			pfree(knn);
+		}
+		knn = room;
+	}
+
+	knn->nrows = OkNNr_learn(nrows, ncols, capacity, knn->data, ncols,
+							 KnnStateTargets(knn, ncols), features, target);
+	return knn;
+}
+
+/*
+ * Builds the vantage-point tree over the rows of a model of at least
+ * aqo.knn_index_threshold rows. Smaller models are scanned in full.
+ */
+static void *
+knn_prepare(const void *state, int ncols)
+{
+	KnnState   *knn = (KnnState *) state;
+
+	if (aqo_knn_index_threshold <= 0 || knn->nrows < aqo_knn_index_threshold)
+		return NULL;
+
+	return vp_tree_build(knn->data, knn->nrows, ncols, ncols);
+}
+
+/*
+ * Returns the maximum absolute difference between the features and the
+ * targets of two models of the same number of rows.
+ */
+static double
+knn_change(const void *old_state, const void *new_state, int ncols)
+{
+	KnnState   *knn1 = (KnnState *) old_state;
+	KnnState   *knn2 = (KnnState *) new_state;
+	double	   *targets1 = KnnStateTargets(knn1, ncols);
+	double	   *targets2 = KnnStateTargets(knn2, ncols);
+	double		change = 0;
+	int			i;
+
+	if (knn1->nrows != knn2->nrows)
+		return get_float8_infinity();
+
+	for (i = 0; i < knn1->nrows * ncols; ++i)
+		change = Max(change, fabs(knn1->data[i] - knn2->data[i]));
+	for (i = 0; i < knn1->nrows; ++i)
+		change = Max(change, fabs(targets1[i] - targets2[i]));
+
+	return change;
+}
+
+/*
+ * Adds the model to the registry. Must be called from _PG_init() of a
+ * library loaded by shared_preload_libraries. The methods must live as long
+ * as the process.
+ */
+void
+register_aqo_model(const AQOModelMethods *methods)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("AQO models can be registered only by libraries in shared_preload_libraries")));
+
+	if (methods->name == NULL || strlen(methods->name) >= NAMEDATALEN ||
+		methods->deserialize == NULL || methods->serialize == NULL ||
+		methods->memory_size == NULL || methods->predict == NULL ||
+		methods->learn == NULL)
+		elog(ERROR, "invalid AQO model methods");
+
+	if (find_aqo_model(methods->name) != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_DUPLICATE_OBJECT),
+				 errmsg("AQO model \"%s\" is already registered",
+						methods->name)));
+
+	if (nregistered_models >= AQO_MAX_MODELS)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many AQO models"),
+				 errdetail("At most %d models can be registered.",
+						   AQO_MAX_MODELS)));
+
+	registered_models[nregistered_models++] = methods;
+}
+
+/*
+ * Returns the registered model with given name or NULL.
+ */
+static const AQOModelMethods *
+find_aqo_model(const char *name)
+{
+	int			i;
+
+	for (i = 0; i < nregistered_models; ++i)
+		if (strcmp(registered_models[i]->name, name) == 0)
+			return registered_models[i];
+
+	return NULL;
+}
+
+/*
+ * Reads the model of the feature space from aqo_fspace_settings into
+ * 'methods'. Returns false if the relation can not be read.
+ */
+static bool
+load_fspace_model(int fspace_hash, const AQOModelMethods **methods)
+{
+	Relation	heap;
+	Relation	index;
+	IndexScanDesc scan;
+	ScanKeyData key;
+	TupleTableSlot *slot;
+	HeapTuple	tuple;
+	bool		shouldFree;
+	Datum		values[2];
+	bool		isnull[2];
+	char	   *name;
+
+	LOCKMODE	lockmode = AccessShareLock;
+
+	if (!open_aqo_relation(AQO_FSPACE_SETTINGS, lockmode, &heap, &index))
+		return false;
+
+	scan = index_beginscan(heap, index, SnapshotSelf, 1, 0);
+	ScanKeyInit(&key,
+				1,
+				BTEqualStrategyNumber,
+				F_INT4EQ,
+				Int32GetDatum(fspace_hash));
+	index_rescan(scan, &key, 1, NULL, 0);
+
+	slot = MakeSingleTupleTableSlot(RelationGetDescr(heap),
+									&TTSOpsBufferHeapTuple);
+
+	*methods = &knn_model;
+	if (index_getnext_slot(scan, ForwardScanDirection, slot))
+	{
+		tuple = ExecFetchSlotHeapTuple(slot, true, &shouldFree);
+		Assert(shouldFree != true);
+		heap_deform_tuple(tuple, RelationGetDescr(heap), values, isnull);
+
+		name = TextDatumGetCString(values[1]);
+		*methods = find_aqo_model(name);
+		if (*methods == NULL)
+			elog(WARNING, "AQO model \"%s\" of feature space %d is not registered",
+				 name, fspace_hash);
+		pfree(name);
+	}
+
+	ExecDropSingleTupleTableSlot(slot);
+	index_endscan(scan);
+	index_close(index, lockmode);
+	heap_close(heap, lockmode);
+
+	return true;
+}
+
+/*
+ * Returns the model of the feature space or NULL if the feature space uses a
+ * model which is not registered.
+ */
+const AQOModelMethods *
+get_fspace_model(int fspace_hash)
+{
+	FspaceModelEntry *entry;
+	const AQOModelMethods *methods;
+	bool		found;
+
+	if (fspace_models != NULL)
+	{
+		entry = (FspaceModelEntry *) hash_search(fspace_models, &fspace_hash,
+												 HASH_FIND, NULL);
+		if (entry != NULL)
+			return entry->methods;
+	}
+
+	/* Opening the relation may process invalidations, which reset the table */
+	if (!load_fspace_model(fspace_hash, &methods))
+		return &knn_model;
+
+	if (fspace_models == NULL)
+	{
+		HASHCTL		hash_ctl;
+
+		MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(int);
+		hash_ctl.entrysize = sizeof(FspaceModelEntry);
+		hash_ctl.hcxt = AQOMemoryContext;
+		fspace_models = hash_create("aqo_fspace_models",
+									64,
+									&hash_ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = (FspaceModelEntry *) hash_search(fspace_models, &fspace_hash,
+											 HASH_ENTER, &found);
+	entry->methods = methods;
+	return methods;
+}
+
+/*
+ * Forgets the models of all feature spaces.
+ */
+void
+fspace_model_cache_reset(void)
+{
+	if (fspace_models == NULL)
+		return;
+
+	hash_destroy(fspace_models);
+	fspace_models = NULL;
+}
+
+PG_FUNCTION_INFO_V1(aqo_models);
+
+/*
+ * Returns the names of the registered models.
+ */
+Datum
+aqo_models(PG_FUNCTION_ARGS)
+{
+	Datum	   *names = palloc(sizeof(Datum) * nregistered_models);
+	int			i;
+
+	for (i = 0; i < nregistered_models; ++i)
+		names[i] = CStringGetTextDatum(registered_models[i]->name);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(names, nregistered_models, TEXTOID,
+										  -1, false, 'i'));
+}
+
+PG_FUNCTION_INFO_V1(invalidate_fspace_settings);
+
+/*
+ * Makes all backends forget the models of feature spaces if the user changed
+ * aqo_fspace_settings. The stored models of a feature space which changes its
+ * model are removed by aqo_set_model(), so the model cache is cleared too.
+ */
+Datum
+invalidate_fspace_settings(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "invalidate_fspace_settings: not called by trigger manager");
+
+	CacheInvalidateRelcache(trigdata->tg_relation);
+	fss_cache_reset();
+	PG_RETURN_POINTER(NULL);
+}
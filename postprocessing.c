@@ -23,6 +23,9 @@ typedef struct
 static double cardinality_sum_errors;
 static int	cardinality_num_objects;
 
+/* Learning samples of the current query */
+static List *learn_samples = NIL;
+
 /* It is needed to recognize stored Query-related aqo data in the query
  * environment field.
  */
@@ -31,94 +34,103 @@ static char *PlanStateInfo = "PlanStateInfo";
 
 
 /* Query execution statistics collecting utilities */
-static void atomic_fss_learn_step(int fss_hash, int ncols,
-					  double **matrix, double *targets,
-					  double *features, double target);
 static void learn_sample(List *clauselist,
 			 List *selectivities,
 			 List *relidslist,
 			 double true_cardinality,
-			 double predicted_cardinality);
+			 double predicted_cardinality,
+			 bool predicted_by_aqo);
 static List *restore_selectivities(List *clauselist,
 					  List *relidslist,
 					  JoinType join_type,
 					  bool was_parametrized);
-static void update_query_stat_row(double *et, int *et_size,
-					  double *pt, int *pt_size,
-					  double *ce, int *ce_size,
-					  double planning_time,
-					  double execution_time,
-					  double cardinality_error,
-					  int64 *n_exec);
 static void StoreToQueryContext(QueryDesc *queryDesc);
 static void StorePlanInternals(QueryDesc *queryDesc);
 static bool ExtractFromQueryContext(QueryDesc *queryDesc);
 static void RemoveFromQueryContext(QueryDesc *queryDesc);
 
 /*
- * This is the critical section: only one runner is allowed to be inside this
- * function for one feature subspace.
- * matrix and targets are just preallocated memory for computations.
+ * Updates the models of the current feature space with the given list of
+ * AQOLearnSample. Several plan nodes often share one feature subspace, so
+ * the samples are grouped by fss_hash, and each model is read and written
+ * only once.
  */
-static void
-atomic_fss_learn_step(int fss_hash, int ncols,
-					  double **matrix, double *targets,
-					  double *features, double target)
+void
+learn_apply_samples(List *samples)
 {
-	int	nrows;
+	List	   *groups = NIL;
+	ListCell   *ls;
+	ListCell   *lg;
 
-	if (!load_fss(fss_hash, ncols, matrix, targets, &nrows))
-		nrows = 0;
+	foreach(ls, samples)
+	{
+		AQOLearnSample *sample = (AQOLearnSample *) lfirst(ls);
+		AQOLearnGroup *group = NULL;
 
-	nrows = OkNNr_learn(nrows, ncols, matrix, targets, features, target);
-	update_fss(fss_hash, nrows, ncols, matrix, targets);
+		foreach(lg, groups)
+		{
+			if (((AQOLearnGroup *) lfirst(lg))->fss_hash == sample->fss_hash)
+			{
+				group = (AQOLearnGroup *) lfirst(lg);
+				break;
+			}
+		}
+
+		if (group == NULL)
+		{
+			group = palloc(sizeof(AQOLearnGroup));
+			group->fss_hash = sample->fss_hash;
+			group->samples = NIL;
+			groups = lappend(groups, group);
+		}
+		group->samples = lappend(group->samples, sample);
+	}
+
+	learn_fss_batch(groups);
+
+	foreach(lg, groups)
+		list_free(((AQOLearnGroup *) lfirst(lg))->samples);
+	list_free_deep(groups);
 }
 
 /*
  * For given object (i. e. clauselist, selectivities, relidslist, predicted and
- * true cardinalities) performs learning procedure.
+ * true cardinalities) collects the learning sample. The samples are applied
+ * at the end of aqo_ExecutorEnd().
+ * The sample is not collected if AQO has already predicted the cardinality
+ * accurately enough, but its error is still counted.
  */
 static void
 learn_sample(List *clauselist, List *selectivities, List *relidslist,
-			 double true_cardinality, double predicted_cardinality)
+			 double true_cardinality, double predicted_cardinality,
+			 bool predicted_by_aqo)
 {
+	AQOLearnSample *sample;
 	int			fss_hash;
 	int			nfeatures;
-	double	  *matrix[aqo_K];
-	double	   targets[aqo_K];
 	double	   *features;
 	double		target;
-	int			i;
 
 	cardinality_sum_errors += fabs(log(predicted_cardinality) -
 								   log(true_cardinality));
 	cardinality_num_objects += 1;
-/*
- * Suppress the optimization for debug purposes.
-	if (fabs(log(predicted_cardinality) - log(true_cardinality)) <
+
+	if (predicted_by_aqo &&
+		fabs(log(predicted_cardinality) - log(true_cardinality)) <
 		object_selection_prediction_threshold)
-	{
 		return;
-	}
-*/
+
 	target = log(true_cardinality);
 
 	fss_hash = get_fss_for_object(clauselist, selectivities, relidslist,
 					   &nfeatures, &features);
 
-	if (nfeatures > 0)
-		for (i = 0; i < aqo_K; ++i)
-			matrix[i] = palloc(sizeof(double) * nfeatures);
-
-	/* Here should be critical section */
-	atomic_fss_learn_step(fss_hash, nfeatures, matrix, targets, features, target);
-	/* Here should be the end of critical section */
-
-	if (nfeatures > 0)
-		for (i = 0; i < aqo_K; ++i)
-			pfree(matrix[i]);
-
-	pfree(features);
+	sample = palloc(sizeof(AQOLearnSample));
+	sample->fss_hash = fss_hash;
+	sample->ncols = nfeatures;
+	sample->features = features;
+	sample->target = target;
+	learn_samples = lappend(learn_samples, sample);
 }
 
 /*
@@ -301,7 +313,8 @@ learnOnPlanState(PlanState *p, void *context)
 			 */
 			if (p->instrument->nloops >= 1)
 				learn_sample(SubplanCtx.clauselist, SubplanCtx.selectivities,
-								p->plan->path_relids, learn_rows, predicted);
+								p->plan->path_relids, learn_rows, predicted,
+								p->plan->predicted_cardinality > 0.);
 		}
 	}
 
@@ -312,42 +325,108 @@ learnOnPlanState(PlanState *p, void *context)
 }
 
 /*
- * Updates given row of query statistics.
+ * Adds the execution to the statistics with or without AQO.
  */
 void
-update_query_stat_row(double *et, int *et_size,
-					  double *pt, int *pt_size,
-					  double *ce, int *ce_size,
+update_query_stat_row(QueryStat *stat, bool use_aqo,
 					  double planning_time,
 					  double execution_time,
-					  double cardinality_error,
-					  int64 *n_exec)
+					  double cardinality_error)
 {
-	int			i;
+	if (use_aqo)
+	{
+		if (cardinality_error >= 0)
+			query_stat_append(stat, STAT_CARDINALITY_ERROR_WITH_AQO,
+							  cardinality_error);
+		query_stat_append(stat, STAT_EXECUTION_TIME_WITH_AQO, execution_time);
+		query_stat_append(stat, STAT_PLANNING_TIME_WITH_AQO, planning_time);
+		stat->executions_with_aqo++;
+	}
+	else
+	{
+		if (cardinality_error >= 0)
+			query_stat_append(stat, STAT_CARDINALITY_ERROR_WITHOUT_AQO,
+							  cardinality_error);
+		query_stat_append(stat, STAT_EXECUTION_TIME_WITHOUT_AQO,
+						  execution_time);
+		query_stat_append(stat, STAT_PLANNING_TIME_WITHOUT_AQO, planning_time);
+		stat->executions_without_aqo++;
+	}
+}
 
-	if (cardinality_error >= 0)
+/*
+ * Adds the execution of the current query to its statistics and runs the
+ * auto tuning. The statistics is accumulated in shared memory if a worker
+ * writes it, otherwise the row of the current query type in aqo_query_stat
+ * is updated at once.
+ */
+void
+learn_apply_stat(double planning_time, double execution_time,
+				 double cardinality_error)
+{
+	QueryStat  *stat;
+	bool		cached;
+	int			attempt;
+
+	/*
+	 * Without a worker the shared entry of the query type, if there is one,
+	 * is kept up to date, but only the row of the query type is written.
+	 */
+	cached = learn_worker_ensure();
+	stat = stat_cache_update(query_context.query_hash, query_context.use_aqo,
+							 planning_time, execution_time,
+							 cardinality_error, cached);
+
+	/*
+	 * The worker could find no dirty entries and exit after the first check.
+	 * Then another worker is launched, or the row is written directly: the
+	 * entry keeps the whole statistics, so writing it later does no harm.
+	 */
+	cached = cached && (stat != NULL) && learn_worker_ensure();
+
+	if (stat == NULL)
 	{
-		if (*ce_size >= aqo_stat_size)
-			for (i = 1; i < aqo_stat_size; ++i)
-				ce[i - 1] = ce[i];
-		*ce_size = (*ce_size >= aqo_stat_size) ? aqo_stat_size : (*ce_size + 1);
-		ce[*ce_size - 1] = cardinality_error;
+		stat = get_aqo_stat(query_context.query_hash);
+		if (stat == NULL)
+			return;
+
+		update_query_stat_row(stat, query_context.use_aqo,
+							  planning_time, execution_time,
+							  cardinality_error);
 	}
 
-	if (*et_size >= aqo_stat_size)
-		for (i = 1; i < aqo_stat_size; ++i)
-			et[i - 1] = et[i];
+	if (!query_context.adding_query && query_context.auto_tuning)
+		automatical_query_tuning(query_context.query_hash, stat);
 
-	*et_size = (*et_size >= aqo_stat_size) ? aqo_stat_size : (*et_size + 1);
-	et[*et_size - 1] = execution_time;
+	if (cached)
+	{
+		pfree_query_stat(stat);
+		return;
+	}
 
-	if (*pt_size >= aqo_stat_size)
-		for (i = 1; i < aqo_stat_size; ++i)
-			pt[i - 1] = pt[i];
+	/* Add the execution to the new version of concurrently updated row */
+	for (attempt = 0;
+		 !update_aqo_stat(query_context.query_hash, stat);
+		 ++attempt)
+	{
+		pfree_query_stat(stat);
+		if (attempt >= AQO_UPDATE_RETRIES)
+		{
+			count_update_conflict(false);
+			return;
+		}
 
-	*pt_size = (*pt_size >= aqo_stat_size) ? aqo_stat_size : (*pt_size + 1);
-	pt[*pt_size - 1] = planning_time;
-	(*n_exec)++;
+		stat = get_aqo_stat(query_context.query_hash);
+		if (stat == NULL)
+			return;
+		update_query_stat_row(stat, query_context.use_aqo,
+							  planning_time, execution_time,
+							  cardinality_error);
+	}
+	if (attempt > 0)
+		count_update_conflict(true);
+
+	pfree_query_stat(stat);
 }
 
 /*****************************************************************************
@@ -397,10 +476,10 @@ aqo_ExecutorStart(QueryDesc *queryDesc, int eflags)
 void
 aqo_ExecutorEnd(QueryDesc *queryDesc)
 {
-	double		totaltime;
-	double		cardinality_error;
-	QueryStat  *stat = NULL;
+	double		totaltime = 0.;
+	double		cardinality_error = -1;
 	instr_time	endtime;
+	ListCell   *l;
 	EphemeralNamedRelation enr = get_ENR(queryDesc->queryEnv, PlanStateInfo);
 
 	if (!ExtractFromQueryContext(queryDesc))
@@ -423,6 +502,8 @@ aqo_ExecutorEnd(QueryDesc *queryDesc)
 		query_context.collect_stat = false;
 	}
 
+	learn_samples = NIL;
+
 	if (query_context.learn_aqo)
 	{
 		aqo_obj_stat ctx = {NIL, NIL, NIL};
@@ -436,57 +517,55 @@ aqo_ExecutorEnd(QueryDesc *queryDesc)
 		list_free(ctx.selectivities);
 	}
 
+	if (query_context.learn_aqo && cardinality_num_objects > 0)
+	{
+		cardinality_error = cardinality_sum_errors / cardinality_num_objects;
+
+		/* Track the convergence of the models, whatever collect_stat is */
+		if (query_context.use_aqo)
+			stat_cache_add_error(query_context.query_hash, cardinality_error);
+	}
+
 	if (query_context.collect_stat)
 	{
 		INSTR_TIME_SET_CURRENT(endtime);
 		INSTR_TIME_SUBTRACT(endtime, query_context.query_starttime);
 		totaltime = INSTR_TIME_GET_DOUBLE(endtime);
-		if (query_context.learn_aqo && cardinality_num_objects > 0)
-			cardinality_error = cardinality_sum_errors /
-				cardinality_num_objects;
-		else
-			cardinality_error = -1;
-
-		stat = get_aqo_stat(query_context.query_hash);
-		if (stat != NULL)
-		{
-			if (query_context.use_aqo)
-				update_query_stat_row(stat->execution_time_with_aqo,
-									  &stat->execution_time_with_aqo_size,
-									  stat->planning_time_with_aqo,
-									  &stat->planning_time_with_aqo_size,
-									  stat->cardinality_error_with_aqo,
-									  &stat->cardinality_error_with_aqo_size,
-									  query_context.query_planning_time,
-									  totaltime - query_context.query_planning_time,
-									  cardinality_error,
-									  &stat->executions_with_aqo);
-			else
-				update_query_stat_row(stat->execution_time_without_aqo,
-									  &stat->execution_time_without_aqo_size,
-									  stat->planning_time_without_aqo,
-									  &stat->planning_time_without_aqo_size,
-									  stat->cardinality_error_without_aqo,
-									  &stat->cardinality_error_without_aqo_size,
-									  query_context.query_planning_time,
-									  totaltime - query_context.query_planning_time,
-									  cardinality_error,
-									  &stat->executions_without_aqo);
-		}
 	}
 	selectivity_cache_clear();
 
 	/*
-	 * Store all learn data into the AQO service relations.
+	 * Store all learn data into the AQO service relations, either through
+	 * the background worker or right now.
 	 */
-	if ((query_context.collect_stat) && (stat != NULL))
+	if (!aqo_learn_async ||
+		!learn_queue_send(learn_samples, query_context.collect_stat,
+						  query_context.query_planning_time,
+						  totaltime - query_context.query_planning_time,
+						  cardinality_error))
 	{
-		if (!query_context.adding_query && query_context.auto_tuning)
-			automatical_query_tuning(query_context.query_hash, stat);
+		learn_apply_samples(learn_samples);
 
-		update_aqo_stat(query_context.fspace_hash, stat);
-		pfree_query_stat(stat);
+		if (query_context.collect_stat)
+			learn_apply_stat(query_context.query_planning_time,
+							 totaltime - query_context.query_planning_time,
+							 cardinality_error);
+
+		/* The worker takes snapshots of the unlogged knowledge base */
+		if (learn_samples != NIL && aqo_snapshot_interval > 0 &&
+			knowledge_base_is_unlogged())
+			learn_worker_ensure();
 	}
+
+	foreach(l, learn_samples)
+		pfree(((AQOLearnSample *) lfirst(l))->features);
+	list_free_deep(learn_samples);
+	learn_samples = NIL;
+
+	/* The worker writes the usage marks */
+	if (usage_cache_push())
+		learn_worker_ensure();
+
 	RemoveFromQueryContext(queryDesc);
 
 end:
@@ -675,6 +754,20 @@ void print_into_explain(PlannedStmt *plannedstmt, IntoClause *into,
 		prev_ExplainOnePlan_hook(plannedstmt, into, es, queryString,
 								params, planduration, queryEnv);
 
+	/* Efficiency of the planning memo of the query planned with AQO */
+	if (query_context.explain_aqo && es->verbose)
+	{
+		int			memo_lookups;
+		int			memo_hits;
+
+		fss_memo_get_stat(&memo_lookups, &memo_hits);
+		ExplainPropertyInteger("FSS lookups", NULL, memo_lookups, es);
+		ExplainPropertyFloat("FSS memo hit rate", "%",
+							 memo_lookups > 0 ?
+								100. * memo_hits / memo_lookups : 0.,
+							 1, es);
+	}
+
 #ifdef AQO_EXPLAIN
 	if (query_context.explain_aqo)
 	{
@@ -55,6 +55,7 @@
 
 static bool isQueryUsingSystemRelation(Query *query);
 static bool isQueryUsingSystemRelation_walker(Node *node, void *context);
+static bool query_is_sampled(int query_hash);
 
 /*
  * Saves query text into query_text variable.
@@ -108,6 +109,7 @@ aqo_planner(Query *parse,
 	bool		query_is_stored;
 	Datum		query_params[5];
 	bool		query_nulls[5] = {false, false, false, false, false};
+	uint64		generation;
 
 	selectivity_cache_clear();
 	query_context.explain_aqo = false;
@@ -119,7 +121,7 @@ aqo_planner(Query *parse,
 	  */
 	if ((parse->commandType != CMD_SELECT && parse->commandType != CMD_INSERT &&
 		parse->commandType != CMD_UPDATE && parse->commandType != CMD_DELETE) ||
-		get_extension_oid("aqo", true) == InvalidOid ||
+		!aqo_extension_exists() ||
 		creating_extension ||
 		/*IsInParallelMode() ||*/ IsParallelWorker() ||
 		aqo_mode == AQO_MODE_DISABLED || isQueryUsingSystemRelation(parse))
@@ -138,6 +140,7 @@ aqo_planner(Query *parse,
 		return call_default_planner(parse, cursorOptions, boundParams);
 	}
 
+	generation = query_cache_generation();
 	query_is_stored = find_query(query_context.query_hash, &query_params[0],
 															&query_nulls[0]);
 
@@ -216,7 +219,7 @@ aqo_planner(Query *parse,
 		query_context.auto_tuning = DatumGetBool(query_params[4]);
 		query_context.collect_stat = query_context.auto_tuning;
 		if (!query_context.learn_aqo && !query_context.use_aqo && !query_context.auto_tuning)
-			add_deactivated_query(query_context.query_hash);
+			add_deactivated_query(query_context.query_hash, generation);
 		if (RecoveryInProgress())
 		{
 			query_context.learn_aqo = false;
@@ -230,11 +233,54 @@ aqo_planner(Query *parse,
 			query_context.auto_tuning = false;
 		}
 	}
+
+	/*
+	 * Neither instrument nor learn from the skipped executions. Query types
+	 * of the forced mode are not stored, but they are sampled the same way.
+	 */
+	if ((query_context.learn_aqo || query_context.collect_stat) &&
+		!query_is_sampled(query_context.query_hash))
+	{
+		query_context.learn_aqo = false;
+		query_context.collect_stat = false;
+	}
 	query_context.explain_aqo = query_context.use_aqo;
 
+	if (query_is_stored || query_context.adding_query)
+		usage_touch_query(query_context.query_hash);
+
+	if (query_context.use_aqo)
+	{
+		fss_memo_init();
+		if (aqo_prefetch_fspace)
+			fss_memo_prefetch();
+	}
+
 	return call_default_planner(parse, cursorOptions, boundParams);
 }
 
+/*
+ * Decides whether the current execution of the query type is learned from.
+ * Only aqo.learn_sample_rate of executions are learned from, and only if
+ * the convergence map in shared memory shows that the cardinality error of
+ * the query type has converged. Query types which are not in the map are
+ * learned from on every execution.
+ */
+static bool
+query_is_sampled(int query_hash)
+{
+	bool		converged;
+
+	if (aqo_learn_sample_rate >= 1)
+		return true;
+
+	if (!stat_cache_converged(query_hash, &converged) || !converged)
+		return true;
+
+	/* borrowed from drandom() in float.c */
+	return (random() / ((double) MAX_RANDOM_VALUE + 1)) < aqo_learn_sample_rate;
+}
+
 /*
  * Turn off all AQO functionality for the current query.
  */
@@ -0,0 +1,398 @@
+#include "aqo.h"
+
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+/*****************************************************************************
+ *
+ *	SHARED QUERY SETTINGS DIRECTORY
+ *
+ * Keeps the rows of aqo_queries in shared memory, so that aqo_planner()
+ * does not scan the index of aqo_queries for every planned statement.
+ *
+ * The directory is a shared hash table of at most aqo.query_cache_size
+ * entries which is filled on demand by find_query(). If the table is full,
+ * new query types are simply not cached.
+ *
+ * A second shared hash table of the same size keeps the set of deactivated
+ * query types, i.e. the ones with learn_aqo, use_aqo and auto_tuning turned
+ * off, for which aqo_planner() returns right after the query hash is
+ * computed. It replaces the backend-local set when the directory is
+ * available, so the query type is deactivated for every session at once.
+ *
+ * Coherence follows the same rules as the shared model cache. add_query()
+ * and update_query() remove the entry of the changed query type
+ * immediately and once again at the end of the transaction, and the
+ * backend bypasses the directory until then. Manual changes of aqo_queries
+ * remove all entries of the database through the trigger on aqo_queries.
+ * The generation counter prevents a concurrent reader from storing the
+ * older version of a row or deactivating a query type which has just been
+ * turned on.
+ *
+ *****************************************************************************/
+
+/*
+ * The OID of aqo_queries is a part of the key, so settings of a dropped
+ * extension are never found after it is created again.
+ */
+typedef struct
+{
+	Oid			dbid;
+	Oid			relid;
+	int			query_hash;
+} QueryCacheKey;
+
+typedef struct
+{
+	QueryCacheKey key;
+	bool		learn_aqo;
+	bool		use_aqo;
+	int			fspace_hash;
+	bool		auto_tuning;
+} QueryCacheEntry;
+
+typedef struct
+{
+	LWLock	   *lock;
+	pg_atomic_uint64 generation;
+	int			size;
+} QueryCacheState;
+
+static QueryCacheState *query_cache = NULL;
+static HTAB *query_cache_htab = NULL;
+static HTAB *deactivated_htab = NULL;
+
+/*
+ * Keys of the query types changed by the current transaction. They are
+ * invalidated once again at the end of the transaction.
+ */
+static List *pending_queries = NIL;
+static bool pending_reset = false;
+
+static bool query_cache_is_usable(void);
+static bool query_cache_set_key(QueryCacheKey *key, int query_hash);
+static void query_cache_remove(QueryCacheKey *key);
+static void query_cache_remove_database(Oid dbid);
+
+
+/*
+ * Returns the amount of shared memory needed by the directory.
+ */
+Size
+query_cache_shmem_size(void)
+{
+	Size		size = MAXALIGN(sizeof(QueryCacheState));
+
+	if (aqo_query_cache_size > 0)
+	{
+		size = add_size(size, hash_estimate_size(aqo_query_cache_size,
+												 sizeof(QueryCacheEntry)));
+		size = add_size(size, hash_estimate_size(aqo_query_cache_size,
+												 sizeof(QueryCacheKey)));
+	}
+
+	return size;
+}
+
+/*
+ * Allocates or attaches to the directory. The caller must hold
+ * AddinShmemInitLock.
+ */
+void
+query_cache_shmem_init(LWLock *lock)
+{
+	bool		found;
+	HASHCTL		info;
+
+	query_cache = ShmemInitStruct("aqo query cache",
+								  sizeof(QueryCacheState),
+								  &found);
+	if (!found)
+	{
+		query_cache->lock = lock;
+		pg_atomic_init_u64(&query_cache->generation, 0);
+		query_cache->size = aqo_query_cache_size;
+	}
+
+	if (query_cache->size <= 0)
+		return;
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(QueryCacheKey);
+	info.entrysize = sizeof(QueryCacheEntry);
+	query_cache_htab = ShmemInitHash("aqo query cache hash",
+									 query_cache->size, query_cache->size,
+									 &info,
+									 HASH_ELEM | HASH_BLOBS);
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(QueryCacheKey);
+	info.entrysize = sizeof(QueryCacheKey);
+	deactivated_htab = ShmemInitHash("aqo deactivated queries",
+									 query_cache->size, query_cache->size,
+									 &info,
+									 HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * Returns true if the shared directory is available, in which case it also
+ * keeps the set of deactivated query types.
+ */
+bool
+query_cache_enabled(void)
+{
+	return query_cache != NULL && query_cache->size > 0;
+}
+
+/*
+ * Checks whether the directory may be used by the current backend.
+ */
+static bool
+query_cache_is_usable(void)
+{
+	return query_cache_enabled() &&
+		   pending_queries == NIL && !pending_reset;
+}
+
+/*
+ * Fills the directory key. Returns false if aqo_queries does not exist.
+ */
+static bool
+query_cache_set_key(QueryCacheKey *key, int query_hash)
+{
+	MemSet(key, 0, sizeof(*key));
+	key->dbid = MyDatabaseId;
+	key->relid = get_aqo_relid(AQO_QUERIES);
+	key->query_hash = query_hash;
+
+	return OidIsValid(key->relid);
+}
+
+/*
+ * Returns the current generation of the directory. The caller passes it to
+ * query_cache_store() after reading the row from the heap.
+ */
+uint64
+query_cache_generation(void)
+{
+	if (query_cache == NULL)
+		return 0;
+
+	return pg_atomic_read_u64(&query_cache->generation);
+}
+
+/*
+ * Looks for the settings of given query type. Returns true if they were
+ * found.
+ */
+bool
+query_cache_lookup(int query_hash, bool *learn_aqo, bool *use_aqo,
+				   int *fspace_hash, bool *auto_tuning)
+{
+	QueryCacheKey key;
+	QueryCacheEntry *entry;
+	bool		found = false;
+
+	if (!query_cache_is_usable() || !query_cache_set_key(&key, query_hash))
+		return false;
+
+	LWLockAcquire(query_cache->lock, LW_SHARED);
+	entry = (QueryCacheEntry *) hash_search(query_cache_htab, &key,
+											HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		*learn_aqo = entry->learn_aqo;
+		*use_aqo = entry->use_aqo;
+		*fspace_hash = entry->fspace_hash;
+		*auto_tuning = entry->auto_tuning;
+		found = true;
+	}
+	LWLockRelease(query_cache->lock);
+
+	return found;
+}
+
+/*
+ * Stores the settings read from the heap into the directory.
+ * 'generation' is the value returned by query_cache_generation() before the
+ * row was read; the settings are not stored if the directory has been
+ * invalidated since then.
+ */
+void
+query_cache_store(int query_hash, bool learn_aqo, bool use_aqo,
+				  int fspace_hash, bool auto_tuning, uint64 generation)
+{
+	QueryCacheKey key;
+	QueryCacheEntry *entry;
+
+	if (!query_cache_is_usable() || !query_cache_set_key(&key, query_hash))
+		return;
+
+	LWLockAcquire(query_cache->lock, LW_EXCLUSIVE);
+
+	if (pg_atomic_read_u64(&query_cache->generation) != generation)
+	{
+		LWLockRelease(query_cache->lock);
+		return;
+	}
+
+	/* HASH_ENTER_NULL returns NULL if the directory is full */
+	entry = (QueryCacheEntry *) hash_search(query_cache_htab, &key,
+											HASH_ENTER_NULL, NULL);
+	if (entry != NULL)
+	{
+		entry->learn_aqo = learn_aqo;
+		entry->use_aqo = use_aqo;
+		entry->fspace_hash = fspace_hash;
+		entry->auto_tuning = auto_tuning;
+	}
+
+	LWLockRelease(query_cache->lock);
+}
+
+/*
+ * Checks whether the query type is in the shared set of deactivated ones.
+ */
+bool
+query_cache_is_deactivated(int query_hash)
+{
+	QueryCacheKey key;
+	bool		found;
+
+	if (!query_cache_is_usable() || !query_cache_set_key(&key, query_hash))
+		return false;
+
+	LWLockAcquire(query_cache->lock, LW_SHARED);
+	hash_search(deactivated_htab, &key, HASH_FIND, &found);
+	LWLockRelease(query_cache->lock);
+
+	return found;
+}
+
+/*
+ * Adds the query type into the shared set of deactivated ones.
+ * 'generation' is the value returned by query_cache_generation() before the
+ * settings of the query type were read.
+ */
+void
+query_cache_deactivate(int query_hash, uint64 generation)
+{
+	QueryCacheKey key;
+
+	if (!query_cache_is_usable() || !query_cache_set_key(&key, query_hash))
+		return;
+
+	LWLockAcquire(query_cache->lock, LW_EXCLUSIVE);
+	if (pg_atomic_read_u64(&query_cache->generation) == generation)
+		hash_search(deactivated_htab, &key, HASH_ENTER_NULL, NULL);
+	LWLockRelease(query_cache->lock);
+}
+
+/*
+ * Removes the settings with given key and increments the generation
+ * counter.
+ */
+static void
+query_cache_remove(QueryCacheKey *key)
+{
+	LWLockAcquire(query_cache->lock, LW_EXCLUSIVE);
+	pg_atomic_fetch_add_u64(&query_cache->generation, 1);
+	hash_search(query_cache_htab, key, HASH_REMOVE, NULL);
+	hash_search(deactivated_htab, key, HASH_REMOVE, NULL);
+	LWLockRelease(query_cache->lock);
+}
+
+/*
+ * Removes the settings of all query types of the given database.
+ */
+static void
+query_cache_remove_database(Oid dbid)
+{
+	HASH_SEQ_STATUS hash_seq;
+	QueryCacheEntry *entry;
+	QueryCacheKey *key;
+
+	LWLockAcquire(query_cache->lock, LW_EXCLUSIVE);
+	pg_atomic_fetch_add_u64(&query_cache->generation, 1);
+
+	hash_seq_init(&hash_seq, query_cache_htab);
+	while ((entry = (QueryCacheEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.dbid == dbid)
+			hash_search(query_cache_htab, &entry->key, HASH_REMOVE, NULL);
+	}
+
+	hash_seq_init(&hash_seq, deactivated_htab);
+	while ((key = (QueryCacheKey *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (key->dbid == dbid)
+			hash_search(deactivated_htab, key, HASH_REMOVE, NULL);
+	}
+
+	LWLockRelease(query_cache->lock);
+}
+
+/*
+ * Invalidates the settings of the given query type. Must be called by each
+ * writer of aqo_queries.
+ */
+void
+query_cache_invalidate(int query_hash)
+{
+	QueryCacheKey *key;
+	MemoryContext oldCxt;
+
+	if (!query_cache_enabled())
+		return;
+
+	oldCxt = MemoryContextSwitchTo(TopMemoryContext);
+	key = palloc(sizeof(*key));
+	if (!query_cache_set_key(key, query_hash))
+	{
+		pfree(key);
+		MemoryContextSwitchTo(oldCxt);
+		return;
+	}
+	pending_queries = lappend(pending_queries, key);
+	MemoryContextSwitchTo(oldCxt);
+
+	query_cache_remove(key);
+}
+
+/*
+ * Invalidates the settings of all query types of the current database. Used
+ * if aqo_queries was changed by the user.
+ */
+void
+query_cache_reset(void)
+{
+	if (!query_cache_enabled())
+		return;
+
+	pending_reset = true;
+	query_cache_remove_database(MyDatabaseId);
+}
+
+/*
+ * Repeats the invalidations made by the finished transaction.
+ */
+void
+query_cache_at_xact_end(void)
+{
+	ListCell   *l;
+
+	if (pending_queries == NIL && !pending_reset)
+		return;
+
+	if (pending_reset)
+		query_cache_remove_database(MyDatabaseId);
+	else
+		foreach(l, pending_queries)
+			query_cache_remove((QueryCacheKey *) lfirst(l));
+
+	list_free_deep(pending_queries);
+	pending_queries = NIL;
+	pending_reset = false;
+}
@@ -0,0 +1,27 @@
+CREATE EXTENSION aqo;
+
+INSERT INTO aqo_queries VALUES (1, true, true, 1, false);
+INSERT INTO aqo_query_texts VALUES (1, 'SELECT 1');
+INSERT INTO aqo_data VALUES (1, 1, 2, aqo_model_pack('{{1,2},{3,4}}', '{5,6}'));
+INSERT INTO aqo_query_stat VALUES (1, aqo_stat_pack('{1,2}', NULL, NULL, NULL, NULL, NULL, 2, 0));
+
+SELECT aqo_export(current_setting('data_directory') || '/aqo_export.kb');
+
+DELETE FROM aqo_queries WHERE query_hash = 1;
+SELECT count(*) FROM aqo_data;
+
+SELECT aqo_import(current_setting('data_directory') || '/aqo_export.kb');
+SELECT * FROM aqo_queries ORDER BY query_hash;
+SELECT * FROM aqo_query_texts ORDER BY query_hash;
+SELECT fspace_hash, fsspace_hash, nfeatures,
+	   aqo_model_features(model), aqo_model_targets(model)
+	FROM aqo_data;
+SELECT query_hash, (aqo_stat_unpack(stat)).execution_time_with_aqo
+	FROM aqo_query_stat;
+
+-- Existing rows are kept
+SELECT aqo_import(current_setting('data_directory') || '/aqo_export.kb');
+
+SELECT aqo_export('aqo_export.kb');  -- fail
+
+DROP EXTENSION aqo;
@@ -50,6 +50,41 @@ EXPLAIN (COSTS FALSE)
 SELECT * FROM aqo_test0
 WHERE a < 5 AND b < 5 AND c < 5 AND d < 5;
 
+-- Converged query types are sampled in the forced mode too
+SET aqo.learn_sample_rate = 0;
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SET aqo.mode = 'controlled';
+SELECT max(xmin::text::bigint) AS data_xmin FROM aqo_data \gset
+SET aqo.mode = 'forced';
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SET aqo.mode = 'controlled';
+SELECT max(xmin::text::bigint) = :data_xmin AS not_learned FROM aqo_data;
+RESET aqo.learn_sample_rate;
+
+-- EXPLAIN VERBOSE reports the fss lookups of the planning
+SET aqo.mode = 'forced';
+CREATE FUNCTION aqo_explain_memo(query text) RETURNS SETOF text AS $$
+DECLARE
+	line text;
+BEGIN
+	FOR line IN EXECUTE 'EXPLAIN (VERBOSE, COSTS OFF) ' || query LOOP
+		IF line LIKE 'FSS%' THEN
+			RETURN NEXT regexp_replace(line, '[0-9.]+', 'N', 'g');
+		END IF;
+	END LOOP;
+END
+$$ LANGUAGE plpgsql;
+SELECT aqo_explain_memo('SELECT count(*) FROM aqo_test1 WHERE a < 100');
+DROP FUNCTION aqo_explain_memo(text);
+
 DROP INDEX aqo_test0_idx_a;
 DROP TABLE aqo_test0;
 
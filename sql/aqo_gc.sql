@@ -0,0 +1,22 @@
+CREATE EXTENSION aqo;
+
+INSERT INTO aqo_queries VALUES (1, true, true, 1, false),
+							   (2, true, true, 2, false),
+							   (3, true, true, 1, false);
+INSERT INTO aqo_data VALUES (1, 1, 0, aqo_model_pack(NULL, '{1}')),
+							(1, 2, 0, aqo_model_pack(NULL, '{1}')),
+							(2, 1, 0, aqo_model_pack(NULL, '{1}')),
+							(3, 1, 0, aqo_model_pack(NULL, '{1}'));
+INSERT INTO aqo_data_usage VALUES (1, 1, '2020-01-03'), (2, 1, '2020-01-01');
+INSERT INTO aqo_query_usage VALUES (1, '2020-01-02'), (5, '2020-01-01');
+
+-- No query type uses feature space 3, model (2, 1) is the oldest one
+SELECT aqo_gc(2);
+SELECT fspace_hash, fsspace_hash FROM aqo_data ORDER BY fspace_hash, fsspace_hash;
+SELECT fspace_hash, fsspace_hash FROM aqo_data_usage;
+SELECT query_hash FROM aqo_query_usage;
+
+SELECT aqo_gc(0);
+SELECT count(*) FROM aqo_data;
+
+DROP EXTENSION aqo;
@@ -162,6 +162,47 @@ EXPLAIN SELECT t1.a AS a, t2.a AS b, t3.a AS c, t4.a AS d
 FROM aqo_test1 AS t1, aqo_test1 AS t2, aqo_test1 AS t3, aqo_test1 AS t4
 WHERE t1.a = t2.b AND t2.a = t3.b AND t3.a = t4.b;
 
+-- Models learned in the forced mode
+SET aqo.mode = 'controlled';
+SELECT merged AS conflicts_merged, dropped AS conflicts_dropped
+	FROM aqo_update_conflicts() \gset
+SET aqo.mode = 'forced';
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SET aqo.mode = 'controlled';
+SELECT max(xmin::text::bigint) AS data_xmin FROM aqo_data \gset
+
+-- The same object changes the model less than aqo.model_change_threshold
+SET aqo.model_change_threshold = 1;
+SET aqo.mode = 'forced';
+SELECT count(*) FROM aqo_test1 WHERE a < 100;
+SET aqo.mode = 'controlled';
+SELECT max(xmin::text::bigint) = :data_xmin AS not_written FROM aqo_data;
+
+-- A new object is written
+SET aqo.mode = 'forced';
+SELECT count(*) FROM aqo_test1 WHERE a < 5;
+SET aqo.mode = 'controlled';
+SELECT max(xmin::text::bigint) = :data_xmin AS not_written FROM aqo_data;
+RESET aqo.model_change_threshold;
+
+-- Predictions better than aqo.learn_error_threshold are not learned
+SELECT max(xmin::text::bigint) AS data_xmin FROM aqo_data \gset
+SET aqo.learn_error_threshold = 100;
+SET aqo.mode = 'forced';
+SELECT count(*) FROM aqo_test1 WHERE a < 5;
+SET aqo.mode = 'controlled';
+SELECT max(xmin::text::bigint) = :data_xmin AS not_learned FROM aqo_data;
+RESET aqo.learn_error_threshold;
+SET aqo.mode = 'forced';
+SELECT count(*) FROM aqo_test1 WHERE a < 5;
+SET aqo.mode = 'controlled';
+SELECT max(xmin::text::bigint) = :data_xmin AS not_learned FROM aqo_data;
+
+-- Serial learning has no concurrent updates to retry
+SELECT merged = :conflicts_merged AS no_merged,
+	dropped = :conflicts_dropped AS no_dropped
+	FROM aqo_update_conflicts();
+
 DROP INDEX aqo_test0_idx_a;
 DROP TABLE aqo_test0;
 
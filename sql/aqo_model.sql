@@ -0,0 +1,48 @@
+CREATE EXTENSION aqo;
+
+SELECT aqo_model_features(aqo_model_pack('{{1,2},{3,4}}', '{5,6}'));
+SELECT aqo_model_targets(aqo_model_pack('{{1,2},{3,4}}', '{5,6}'));
+
+-- Model without features
+SELECT aqo_model_features(aqo_model_pack(NULL, '{7}')) IS NULL;
+SELECT aqo_model_targets(aqo_model_pack(NULL, '{7}'));
+
+-- Single precision models take half of the space
+SELECT length(aqo_model_pack('{{1,2},{3,4}}', '{5,6}'));
+SET aqo.model_single_precision = on;
+SELECT length(aqo_model_pack('{{1,2},{3,4}}', '{5,6}'));
+SELECT aqo_model_features(aqo_model_pack('{{1,2},{3,0.5}}', '{5,6}'));
+SELECT aqo_model_targets(aqo_model_pack('{{1,2},{3,4}}', '{5,-0.25}'));
+RESET aqo.model_single_precision;
+
+-- Models can be larger than the default capacity
+SELECT array_length(aqo_model_targets(aqo_model_pack(NULL,
+	array(SELECT generate_series(1, 100)::double precision))), 1);
+
+SELECT aqo_model_pack('{{1,2}}', '{5,6}');  -- fail
+SELECT aqo_model_features('\x00'::bytea);  -- fail
+
+SELECT execution_time_with_aqo, planning_time_with_aqo, executions_with_aqo
+	FROM aqo_stat_unpack(aqo_stat_pack('{1,2,3}', NULL, '{4}', NULL, '{0.5}', NULL, 3, 0));
+-- Only the newest values are kept
+SELECT execution_time_without_aqo
+	FROM aqo_stat_unpack(aqo_stat_pack(NULL,
+		array(SELECT generate_series(1, 25)::double precision),
+		NULL, NULL, NULL, NULL, 0, 25));
+
+SELECT aqo_stat_unpack('\x00'::bytea);  -- fail
+
+-- Feature spaces select their models by name
+SELECT aqo_models();
+INSERT INTO aqo_queries VALUES (1, true, true, 1, false);
+INSERT INTO aqo_data VALUES (1, 1, 2, aqo_model_pack('{{1,2},{3,4}}', '{5,6}'));
+SELECT aqo_set_model(1, 'knn');
+SELECT count(*) FROM aqo_data;
+SELECT aqo_set_model(1, 'unknown');  -- fail
+INSERT INTO aqo_fspace_settings VALUES (1, 'unknown');
+SELECT aqo_set_model(1, 'knn');
+SELECT count(*) FROM aqo_data;
+SELECT count(*) FROM aqo_fspace_settings;
+DELETE FROM aqo_queries WHERE query_hash = 1;
+
+DROP EXTENSION aqo;
@@ -0,0 +1,32 @@
+CREATE EXTENSION aqo;
+
+SELECT aqo_set_unlogged(true);
+SELECT relname, relpersistence FROM pg_class
+	WHERE relname IN ('aqo_queries', 'aqo_data', 'aqo_query_stat')
+	ORDER BY relname;
+
+INSERT INTO aqo_queries VALUES (1, true, true, 1, false);
+INSERT INTO aqo_data VALUES (1, 1, 0, aqo_model_pack(NULL, '{5}'));
+SELECT aqo_snapshot();
+SELECT fspace_hash, fsspace_hash FROM aqo_data_snapshot;
+
+-- Emulate crash recovery which empties unlogged tables
+TRUNCATE aqo_data, aqo_snapshot_marker;
+SELECT aqo_restore_snapshot();
+SELECT fspace_hash, fsspace_hash, aqo_model_targets(model) FROM aqo_data;
+SELECT aqo_restore_snapshot();
+
+-- Only the changed rows are written into the snapshot
+SELECT xmin::text::bigint AS snapshot_xmin FROM aqo_data_snapshot \gset
+SELECT aqo_snapshot();
+SELECT xmin::text::bigint = :snapshot_xmin AS kept FROM aqo_data_snapshot;
+UPDATE aqo_data SET model = aqo_model_pack(NULL, '{7}');
+SELECT aqo_snapshot();
+SELECT xmin::text::bigint = :snapshot_xmin AS kept,
+	   aqo_model_targets(model) FROM aqo_data_snapshot;
+
+SELECT aqo_set_unlogged(false);
+SELECT relpersistence FROM pg_class WHERE relname = 'aqo_data';
+SELECT count(*) FROM aqo_data_snapshot;
+
+DROP EXTENSION aqo;
@@ -0,0 +1,701 @@
+#include "aqo.h"
+
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+/*****************************************************************************
+ *
+ *	SHARED QUERY STATISTICS
+ *
+ * Accumulates the execution statistics of query types in shared memory, so
+ * that every execution does not read and rewrite its row of aqo_query_stat.
+ *
+ * The statistics is a shared hash table of at most aqo.stat_cache_size
+ * entries, split into AQO_NUM_STAT_CACHE_LOCKS partitions with a lock each.
+ * The first execution of a query type loads its row into the table, and the
+ * following executions are added to the entry under the lock of its
+ * partition, so executions of different query types rarely wait for each
+ * other. Changed entries are marked dirty and are written to aqo_query_stat
+ * by the background worker of the database every aqo.stat_flush_interval
+ * milliseconds and before the worker exits. An entry stays dirty until the
+ * transaction which has written it commits, and it is written again if it
+ * was changed meanwhile. If the table is full or no worker can be launched,
+ * the statistics of the query type is written to aqo_query_stat directly
+ * as before; an entry which is already in the table is updated too, so it
+ * does not lose the execution when it is written later.
+ *
+ * A second table of the same size, the convergence map, keeps the last
+ * cardinality errors of every query type which is learned with the
+ * predictions of AQO, whether its statistics is collected or not. It tells
+ * whether the models of the query type have converged, which is used to
+ * sample the executions to learn from. If the map is full, new query types
+ * are not tracked and are considered as not converged.
+ *
+ * Manual inserts, updates and truncation of aqo_query_stat remove all
+ * entries of the database through the trigger on the table, including the
+ * ones which have not been written yet. Deletion of rows, which also happens
+ * when query types are removed from aqo_queries, removes only the entries of
+ * the deleted rows. The rules of coherence are the same as for the shared
+ * directory of query settings.
+ *
+ *****************************************************************************/
+
+typedef struct
+{
+	Oid			dbid;
+	Oid			relid;
+	int			query_hash;
+} StatCacheKey;
+
+/* The QueryStat of the entry follows the header */
+typedef struct
+{
+	StatCacheKey key;
+	bool		dirty;
+	uint64		changes;		/* number of updates of the entry */
+} StatCacheEntry;
+
+#define StatCacheEntryStat(entry) \
+	((QueryStat *) ((char *) (entry) + MAXALIGN(sizeof(StatCacheEntry))))
+
+/*
+ * Entry of the convergence map. Its QueryStat keeps only the series of
+ * cardinality errors with AQO, and only as many values as the convergence
+ * test needs.
+ */
+typedef struct
+{
+	StatCacheKey key;
+	bool		converged;
+} ConvergenceEntry;
+
+#define ConvergenceEntryStat(entry) \
+	((QueryStat *) ((char *) (entry) + MAXALIGN(sizeof(ConvergenceEntry))))
+
+#define CONVERGENCE_CAPACITY	(auto_tuning_window_size + 2)
+
+typedef struct
+{
+	LWLockPadded *locks;		/* AQO_NUM_STAT_CACHE_LOCKS partition locks */
+	pg_atomic_uint64 generation;
+	int			size;
+	int			capacity;
+} StatCacheState;
+
+static StatCacheState *stat_cache = NULL;
+static HTAB *stat_cache_htab = NULL;
+static HTAB *convergence_htab = NULL;
+
+/*
+ * Set if the current transaction changed aqo_query_stat manually. Keys of
+ * the rows it deleted are removed once again at the end of the transaction.
+ */
+static bool pending_reset = false;
+static List *pending_keys = NIL;
+
+/*
+ * Entries written by the current transaction and the number of their
+ * updates at that moment. They become clean when the transaction commits,
+ * unless the subtransaction which has written them is aborted.
+ */
+typedef struct
+{
+	StatCacheKey key;
+	uint64		changes;
+	SubTransactionId subid;
+} StatCacheFlushed;
+
+static StatCacheFlushed *flushed = NULL;
+static int	nflushed = 0;
+
+static Size stat_cache_entry_size(void);
+static Size convergence_entry_size(void);
+static LWLock *stat_cache_partition_lock(uint32 hashcode);
+static void stat_cache_lock_all(LWLockMode mode);
+static void stat_cache_unlock_all(void);
+static bool stat_cache_is_usable(void);
+static bool stat_cache_set_key(StatCacheKey *key, int query_hash);
+static void stat_cache_remove(StatCacheKey *key);
+static void stat_cache_remove_database(Oid dbid);
+static void stat_cache_set_clean(void);
+
+
+static Size
+stat_cache_entry_size(void)
+{
+	return MAXALIGN(sizeof(StatCacheEntry)) + QueryStatSize(aqo_stat_size);
+}
+
+static Size
+convergence_entry_size(void)
+{
+	return MAXALIGN(sizeof(ConvergenceEntry)) +
+		   QueryStatSize(CONVERGENCE_CAPACITY);
+}
+
+/*
+ * Returns the amount of shared memory needed by the statistics.
+ */
+Size
+stat_cache_shmem_size(void)
+{
+	Size		size = MAXALIGN(sizeof(StatCacheState));
+
+	if (aqo_stat_cache_size > 0)
+	{
+		size = add_size(size, hash_estimate_size(aqo_stat_cache_size,
+												 stat_cache_entry_size()));
+		size = add_size(size, hash_estimate_size(aqo_stat_cache_size,
+												 convergence_entry_size()));
+	}
+
+	return size;
+}
+
+/*
+ * Allocates or attaches to the statistics. The caller must hold
+ * AddinShmemInitLock.
+ */
+void
+stat_cache_shmem_init(LWLockPadded *locks)
+{
+	bool		found;
+	HASHCTL		info;
+
+	stat_cache = ShmemInitStruct("aqo stat cache",
+								 sizeof(StatCacheState),
+								 &found);
+	if (!found)
+	{
+		stat_cache->locks = locks;
+		pg_atomic_init_u64(&stat_cache->generation, 0);
+		stat_cache->size = aqo_stat_cache_size;
+		stat_cache->capacity = aqo_stat_size;
+	}
+
+	if (stat_cache->size <= 0)
+		return;
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(StatCacheKey);
+	info.entrysize = stat_cache_entry_size();
+	info.num_partitions = AQO_NUM_STAT_CACHE_LOCKS;
+	stat_cache_htab = ShmemInitHash("aqo stat cache hash",
+									stat_cache->size, stat_cache->size,
+									&info,
+									HASH_ELEM | HASH_BLOBS | HASH_PARTITION);
+
+	/*
+	 * Both tables hash the same key with the same function, so an entry of
+	 * the convergence map is in the same partition as the statistics of its
+	 * query type.
+	 */
+	info.entrysize = convergence_entry_size();
+	convergence_htab = ShmemInitHash("aqo convergence hash",
+									 stat_cache->size, stat_cache->size,
+									 &info,
+									 HASH_ELEM | HASH_BLOBS | HASH_PARTITION);
+}
+
+/*
+ * Returns the lock of the partition which contains the key with given hash
+ * code.
+ */
+static LWLock *
+stat_cache_partition_lock(uint32 hashcode)
+{
+	return &stat_cache->locks[hashcode % AQO_NUM_STAT_CACHE_LOCKS].lock;
+}
+
+/*
+ * Locks all partitions, which is needed to scan the table. The partitions
+ * are always locked in the same order.
+ */
+static void
+stat_cache_lock_all(LWLockMode mode)
+{
+	int			i;
+
+	for (i = 0; i < AQO_NUM_STAT_CACHE_LOCKS; ++i)
+		LWLockAcquire(&stat_cache->locks[i].lock, mode);
+}
+
+static void
+stat_cache_unlock_all(void)
+{
+	int			i;
+
+	for (i = AQO_NUM_STAT_CACHE_LOCKS - 1; i >= 0; --i)
+		LWLockRelease(&stat_cache->locks[i].lock);
+}
+
+/*
+ * Checks whether the statistics may be used by the current backend.
+ */
+static bool
+stat_cache_is_usable(void)
+{
+	return stat_cache != NULL && stat_cache->size > 0 &&
+		   stat_cache->capacity == aqo_stat_size && !pending_reset;
+}
+
+/*
+ * Fills the key. Returns false if aqo_query_stat does not exist.
+ */
+static bool
+stat_cache_set_key(StatCacheKey *key, int query_hash)
+{
+	MemSet(key, 0, sizeof(*key));
+	key->dbid = MyDatabaseId;
+	key->relid = get_aqo_relid(AQO_QUERY_STAT);
+	key->query_hash = query_hash;
+
+	return OidIsValid(key->relid);
+}
+
+/*
+ * Adds the execution to the statistics of the query type in shared memory.
+ * Returns a copy of the updated statistics, or NULL if the shared
+ * statistics can not be used; then the caller must update aqo_query_stat
+ * itself. If 'load' is false, only the query type which is already in the
+ * table is updated.
+ */
+QueryStat *
+stat_cache_update(int query_hash, bool use_aqo, double planning_time,
+				  double execution_time, double cardinality_error, bool load)
+{
+	StatCacheKey key;
+	StatCacheEntry *entry;
+	QueryStat  *stat;
+	QueryStat  *stored = NULL;
+	uint64		generation;
+	uint32		hashcode;
+	LWLock	   *lock;
+	bool		found;
+
+	if (!stat_cache_is_usable() || !stat_cache_set_key(&key, query_hash))
+		return NULL;
+
+	generation = pg_atomic_read_u64(&stat_cache->generation);
+	hashcode = get_hash_value(stat_cache_htab, &key);
+	lock = stat_cache_partition_lock(hashcode);
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	entry = (StatCacheEntry *) hash_search_with_hash_value(stat_cache_htab,
+														   &key, hashcode,
+														   HASH_FIND, NULL);
+	if (entry == NULL && !load)
+	{
+		LWLockRelease(lock);
+		return NULL;
+	}
+	else if (entry == NULL)
+	{
+		/* Load the row without holding the lock */
+		LWLockRelease(lock);
+
+		stored = get_aqo_stat(query_hash);
+		if (stored == NULL)
+			return NULL;
+
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+		if (pg_atomic_read_u64(&stat_cache->generation) != generation)
+		{
+			LWLockRelease(lock);
+			pfree_query_stat(stored);
+			return NULL;
+		}
+
+		/* HASH_ENTER_NULL returns NULL if the table is full */
+		entry = (StatCacheEntry *)
+			hash_search_with_hash_value(stat_cache_htab, &key, hashcode,
+										HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+		{
+			LWLockRelease(lock);
+			pfree_query_stat(stored);
+			return NULL;
+		}
+
+		/* Another backend could load the row meanwhile */
+		if (!found)
+		{
+			memcpy(StatCacheEntryStat(entry), stored, VARSIZE(stored));
+			entry->dirty = false;
+			entry->changes = 0;
+		}
+	}
+
+	update_query_stat_row(StatCacheEntryStat(entry), use_aqo,
+						  planning_time, execution_time, cardinality_error);
+	entry->dirty = true;
+	entry->changes++;
+
+	stat = palloc_query_stat();
+	memcpy(stat, StatCacheEntryStat(entry), VARSIZE(stat));
+	LWLockRelease(lock);
+
+	if (stored != NULL)
+		pfree_query_stat(stored);
+
+	return stat;
+}
+
+/*
+ * Adds the mean cardinality error of an execution which used the predictions
+ * of AQO to the convergence map and checks whether the error has converged.
+ */
+void
+stat_cache_add_error(int query_hash, double cardinality_error)
+{
+	StatCacheKey key;
+	ConvergenceEntry *entry;
+	QueryStat  *stat;
+	uint32		hashcode;
+	LWLock	   *lock;
+	bool		found;
+
+	if (convergence_htab == NULL || !stat_cache_set_key(&key, query_hash))
+		return;
+
+	hashcode = get_hash_value(convergence_htab, &key);
+	lock = stat_cache_partition_lock(hashcode);
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+
+	/* HASH_ENTER_NULL returns NULL if the map is full */
+	entry = (ConvergenceEntry *)
+		hash_search_with_hash_value(convergence_htab, &key, hashcode,
+									HASH_ENTER_NULL, &found);
+	if (entry == NULL)
+	{
+		LWLockRelease(lock);
+		return;
+	}
+
+	stat = ConvergenceEntryStat(entry);
+	if (!found)
+	{
+		MemSet(stat, 0, QueryStatSize(CONVERGENCE_CAPACITY));
+		SET_VARSIZE(stat, QueryStatSize(CONVERGENCE_CAPACITY));
+		stat->version = AQO_STAT_VERSION;
+		stat->nseries = STAT_NSERIES;
+		stat->capacity = CONVERGENCE_CAPACITY;
+	}
+
+	query_stat_append(stat, STAT_CARDINALITY_ERROR_WITH_AQO,
+					  cardinality_error);
+	entry->converged = query_stat_converged(stat);
+
+	LWLockRelease(lock);
+}
+
+/*
+ * Looks whether the cardinality error of the query type has converged.
+ * Returns false if the query type is not in the convergence map.
+ */
+bool
+stat_cache_converged(int query_hash, bool *converged)
+{
+	StatCacheKey key;
+	ConvergenceEntry *entry;
+	uint32		hashcode;
+	LWLock	   *lock;
+	bool		found = false;
+
+	if (convergence_htab == NULL || !stat_cache_set_key(&key, query_hash))
+		return false;
+
+	hashcode = get_hash_value(convergence_htab, &key);
+	lock = stat_cache_partition_lock(hashcode);
+
+	LWLockAcquire(lock, LW_SHARED);
+	entry = (ConvergenceEntry *)
+		hash_search_with_hash_value(convergence_htab, &key, hashcode,
+									HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		*converged = entry->converged;
+		found = true;
+	}
+	LWLockRelease(lock);
+
+	return found;
+}
+
+/*
+ * Checks whether the database has statistics which is not written to
+ * aqo_query_stat yet.
+ */
+bool
+stat_cache_has_dirty(Oid dbid)
+{
+	HASH_SEQ_STATUS hash_seq;
+	StatCacheEntry *entry;
+	bool		dirty = false;
+
+	if (stat_cache_htab == NULL)
+		return false;
+
+	stat_cache_lock_all(LW_SHARED);
+	hash_seq_init(&hash_seq, stat_cache_htab);
+	while ((entry = (StatCacheEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.dbid == dbid && entry->dirty)
+		{
+			dirty = true;
+			hash_seq_term(&hash_seq);
+			break;
+		}
+	}
+	stat_cache_unlock_all();
+
+	return dirty;
+}
+
+/*
+ * Writes the changed statistics of the current database to aqo_query_stat.
+ * Must be called inside a transaction; the entries stay dirty until it
+ * commits.
+ */
+void
+stat_cache_flush(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	StatCacheEntry *entry;
+	ConvergenceEntry *centry;
+	QueryStat **stats;
+	StatCacheFlushed *written;
+	int			nstats = 0;
+	Oid			relid;
+	int			i;
+
+	if (stat_cache_htab == NULL || pending_reset)
+		return;
+
+	relid = get_aqo_relid(AQO_QUERY_STAT);
+	stats = palloc(sizeof(QueryStat *) * stat_cache->size);
+	written = palloc(sizeof(StatCacheFlushed) * stat_cache->size);
+
+	stat_cache_lock_all(LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, stat_cache_htab);
+	while ((entry = (StatCacheEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.dbid != MyDatabaseId)
+			continue;
+
+		/* Entries of a dropped extension are not needed anymore */
+		if (entry->key.relid != relid)
+		{
+			hash_search(stat_cache_htab, &entry->key, HASH_REMOVE, NULL);
+			continue;
+		}
+
+		if (!entry->dirty)
+			continue;
+
+		stats[nstats] = palloc_query_stat();
+		memcpy(stats[nstats], StatCacheEntryStat(entry),
+			   VARSIZE(stats[nstats]));
+		written[nstats].key = entry->key;
+		written[nstats].changes = entry->changes;
+		written[nstats].subid = GetCurrentSubTransactionId();
+		nstats++;
+	}
+
+	hash_seq_init(&hash_seq, convergence_htab);
+	while ((centry = (ConvergenceEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (centry->key.dbid == MyDatabaseId && centry->key.relid != relid)
+			hash_search(convergence_htab, &centry->key, HASH_REMOVE, NULL);
+	}
+	stat_cache_unlock_all();
+
+	if (flushed == NULL)
+		flushed = MemoryContextAlloc(TopMemoryContext,
+									 sizeof(StatCacheFlushed) *
+									 stat_cache->size);
+
+	for (i = 0; i < nstats; ++i)
+	{
+		/* Write the entry again next time if the row was updated meanwhile */
+		if (update_aqo_stat(written[i].key.query_hash, stats[i]) &&
+			nflushed < stat_cache->size)
+			flushed[nflushed++] = written[i];
+		pfree_query_stat(stats[i]);
+	}
+
+	pfree(stats);
+	pfree(written);
+}
+
+/*
+ * Marks the entries written by the committed transaction as clean unless
+ * they were updated after that.
+ */
+static void
+stat_cache_set_clean(void)
+{
+	StatCacheEntry *entry;
+	uint32		hashcode;
+	LWLock	   *lock;
+	int			i;
+
+	for (i = 0; i < nflushed; ++i)
+	{
+		hashcode = get_hash_value(stat_cache_htab, &flushed[i].key);
+		lock = stat_cache_partition_lock(hashcode);
+
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+		entry = (StatCacheEntry *)
+			hash_search_with_hash_value(stat_cache_htab, &flushed[i].key,
+										hashcode, HASH_FIND, NULL);
+		if (entry != NULL && entry->changes == flushed[i].changes)
+			entry->dirty = false;
+		LWLockRelease(lock);
+	}
+}
+
+/*
+ * Removes the statistics and the convergence of the query type with given
+ * key.
+ */
+static void
+stat_cache_remove(StatCacheKey *key)
+{
+	uint32		hashcode = get_hash_value(stat_cache_htab, key);
+	LWLock	   *lock = stat_cache_partition_lock(hashcode);
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	pg_atomic_fetch_add_u64(&stat_cache->generation, 1);
+	hash_search_with_hash_value(stat_cache_htab, key, hashcode,
+								HASH_REMOVE, NULL);
+	hash_search_with_hash_value(convergence_htab, key, hashcode,
+								HASH_REMOVE, NULL);
+	LWLockRelease(lock);
+}
+
+/*
+ * Discards the statistics of the query type whose row was deleted from
+ * aqo_query_stat. The statistics of other query types is kept.
+ */
+void
+stat_cache_forget(int query_hash)
+{
+	StatCacheKey *key;
+	MemoryContext oldCxt;
+
+	if (stat_cache_htab == NULL)
+		return;
+
+	oldCxt = MemoryContextSwitchTo(TopMemoryContext);
+	key = palloc(sizeof(*key));
+	if (!stat_cache_set_key(key, query_hash))
+	{
+		pfree(key);
+		MemoryContextSwitchTo(oldCxt);
+		return;
+	}
+	pending_keys = lappend(pending_keys, key);
+	MemoryContextSwitchTo(oldCxt);
+
+	stat_cache_remove(key);
+}
+
+/*
+ * Removes the statistics and the convergence of all query types of the given
+ * database.
+ */
+static void
+stat_cache_remove_database(Oid dbid)
+{
+	HASH_SEQ_STATUS hash_seq;
+	StatCacheEntry *entry;
+	ConvergenceEntry *centry;
+
+	stat_cache_lock_all(LW_EXCLUSIVE);
+	pg_atomic_fetch_add_u64(&stat_cache->generation, 1);
+
+	hash_seq_init(&hash_seq, stat_cache_htab);
+	while ((entry = (StatCacheEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.dbid == dbid)
+			hash_search(stat_cache_htab, &entry->key, HASH_REMOVE, NULL);
+	}
+
+	hash_seq_init(&hash_seq, convergence_htab);
+	while ((centry = (ConvergenceEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (centry->key.dbid == dbid)
+			hash_search(convergence_htab, &centry->key, HASH_REMOVE, NULL);
+	}
+
+	stat_cache_unlock_all();
+}
+
+/*
+ * Discards the statistics of all query types of the current database. Used
+ * if aqo_queries or aqo_query_stat was changed by the user.
+ */
+void
+stat_cache_reset(void)
+{
+	if (stat_cache_htab == NULL)
+		return;
+
+	pending_reset = true;
+	stat_cache_remove_database(MyDatabaseId);
+}
+
+/*
+ * Keeps dirty the entries written by the aborted subtransaction and passes
+ * the entries written by the committed one to its parent.
+ */
+void
+stat_cache_at_subxact_end(bool commit, SubTransactionId mySubid,
+						  SubTransactionId parentSubid)
+{
+	int			n = 0;
+	int			i;
+
+	for (i = 0; i < nflushed; ++i)
+	{
+		if (flushed[i].subid == mySubid)
+		{
+			if (!commit)
+				continue;
+			flushed[i].subid = parentSubid;
+		}
+		flushed[n++] = flushed[i];
+	}
+	nflushed = n;
+}
+
+/*
+ * Marks the entries written by the committed transaction as clean and
+ * repeats the invalidation made by the finished transaction.
+ */
+void
+stat_cache_at_xact_end(bool commit)
+{
+	ListCell   *l;
+
+	if (commit && nflushed > 0)
+		stat_cache_set_clean();
+	nflushed = 0;
+
+	if (pending_keys == NIL && !pending_reset)
+		return;
+
+	if (pending_reset)
+		stat_cache_remove_database(MyDatabaseId);
+	else
+		foreach(l, pending_keys)
+			stat_cache_remove((StatCacheKey *) lfirst(l));
+
+	list_free_deep(pending_keys);
+	pending_keys = NIL;
+	pending_reset = false;
+}
@@ -3,6 +3,20 @@
 #include "access/heapam.h"
 #include "access/table.h"
 #include "access/tableam.h"
+#include "access/xlog.h"
+#include "catalog/pg_authid.h"
+#include "commands/extension.h"
+#include "funcapi.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/fd.h"
+#include "storage/lmgr.h"
+#include "storage/shmem.h"
+#include "utils/acl.h"
+#include "utils/hashutils.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
 
 /*****************************************************************************
  *
@@ -15,20 +29,83 @@
 
 HTAB *deactivated_queries = NULL;
 
-static ArrayType *form_matrix(double **matrix, int nrows, int ncols);
-static void deform_matrix(Datum datum, double **matrix);
+/*
+ * Names of AQO service relations and their indexes. The relations live in
+ * schema "public" regardless of the search_path.
+ */
+static const char *aqo_relnames[AQO_NUM_RELATIONS] = {
+	"aqo_queries",
+	"aqo_query_texts",
+	"aqo_query_stat",
+	"aqo_fspace_settings",
+	"aqo_data"
+};
+
+static const char *aqo_indnames[AQO_NUM_RELATIONS] = {
+	"aqo_queries_query_hash_idx",
+	"aqo_query_texts_query_hash_idx",
+	"aqo_query_stat_idx",
+	"aqo_fspace_settings_idx",
+	"aqo_fss_access_idx"
+};
+
+/*
+ * OIDs of AQO service relations and their indexes. They are resolved once
+ * per backend and reset by relcache invalidation of any of them.
+ */
+static Oid	aqo_relids[AQO_NUM_RELATIONS];
+static Oid	aqo_indids[AQO_NUM_RELATIONS];
+static bool aqo_relids_valid = false;
+static bool aqo_extension_found = false;
+
+/*
+ * Numbers of concurrent updates of AQO rows which were merged with ours or
+ * lost after AQO_UPDATE_RETRIES attempts. They are cluster-wide if AQO is
+ * loaded through shared_preload_libraries, and backend-local otherwise.
+ */
+typedef struct
+{
+	pg_atomic_uint64 merged;
+	pg_atomic_uint64 dropped;
+} UpdateConflictCounters;
+
+static UpdateConflictCounters *update_conflicts = NULL;
+static UpdateConflictCounters local_update_conflicts;
+
+/*
+ * Partitioned locks which serialize learning of one model, see
+ * learn_fss_batch(). They exist only if AQO is loaded through
+ * shared_preload_libraries.
+ */
+static LWLockPadded *learn_locks = NULL;
+
+static bool lookup_aqo_relids(void);
+static bool aqo_relation_is_readable(Relation heap);
+static void aqo_relcache_callback(Datum arg, Oid relid);
+static LWLock *get_learn_lock(int fspace_hash, int fss_hash);
+
+static QueryStat *get_packed_stat(Datum datum);
+static ArrayType *form_stat_series(QueryStat *stat, QueryStatSeries series);
+
+static ArrayType *form_matrix(double *matrix, int nrows, int ncols);
+static void deform_matrix(Datum datum, double *matrix);
 
 static ArrayType *form_vector(double *vector, int nrows);
 static void deform_vector(Datum datum, double *vector, int *nelems);
 
-#define FormVectorSz(v_name)			(form_vector((v_name), (v_name ## _size)))
-#define DeformVectorSz(datum, v_name)	(deform_vector((datum), (v_name), &(v_name ## _size)))
-
 
 static bool my_simple_heap_update(Relation relation,
 								  ItemPointer otid,
 								  HeapTuple tup,
-								  bool *update_indexes);
+								  bool *update_indexes,
+								  bool wait,
+								  TransactionId *xwait);
+
+static bool insert_model_row(Relation heap, Relation index,
+							 Datum *values, bool *isnull,
+							 TransactionId *xwait);
+static TransactionId remove_model_row(Relation heap, Relation index,
+									  ItemPointer tid, Datum *values);
 
 static bool my_index_insert(Relation indexRelation,
 							Datum *values,
@@ -38,16 +115,253 @@ static bool my_index_insert(Relation indexRelation,
 							IndexUniqueCheck checkUnique);
 
 
+/*
+ * Resolves OIDs of AQO service relations if they are not known yet.
+ * Returns false if some of the relations do not exist. Missing relations
+ * are not remembered, so they will be looked up again by the next call.
+ */
+static bool
+lookup_aqo_relids(void)
+{
+	Oid			nspid;
+	int			i;
+
+	if (aqo_relids_valid)
+		return true;
+
+	nspid = get_namespace_oid("public", true);
+	if (!OidIsValid(nspid))
+		return false;
+
+	for (i = 0; i < AQO_NUM_RELATIONS; ++i)
+	{
+		aqo_relids[i] = get_relname_relid(aqo_relnames[i], nspid);
+		aqo_indids[i] = get_relname_relid(aqo_indnames[i], nspid);
+		if (!OidIsValid(aqo_relids[i]) || !OidIsValid(aqo_indids[i]))
+			return false;
+	}
+
+	aqo_relids_valid = true;
+	return true;
+}
+
+/*
+ * Forgets the cached OIDs if one of AQO service relations was changed or
+ * dropped. Drop of the extension drops its relations, so the cached state of
+ * the extension is reset too. Changes of aqo_fspace_settings invalidate its
+ * relcache entry, so the cached models of feature spaces are forgotten here.
+ */
+static void
+aqo_relcache_callback(Datum arg, Oid relid)
+{
+	int			i;
+
+	if (!aqo_relids_valid)
+		return;
+
+	if (OidIsValid(relid))
+	{
+		for (i = 0; i < AQO_NUM_RELATIONS; ++i)
+			if (relid == aqo_relids[i] || relid == aqo_indids[i])
+				break;
+
+		if (i == AQO_NUM_RELATIONS)
+			return;
+	}
+
+	aqo_relids_valid = false;
+	aqo_extension_found = false;
+	fspace_model_cache_reset();
+}
+
+/*
+ * Registers the invalidation callback of the cache of AQO relation OIDs.
+ */
+void
+init_aqo_relids_cache(void)
+{
+	CacheRegisterRelcacheCallback(aqo_relcache_callback, (Datum) 0);
+}
+
+/*
+ * Returns the OID of given AQO service relation or InvalidOid if it does not
+ * exist.
+ */
+Oid
+get_aqo_relid(AQORelation rel)
+{
+	if (!lookup_aqo_relids())
+		return InvalidOid;
+
+	return aqo_relids[rel];
+}
+
+/*
+ * Opens given AQO service relation and its index.
+ * Returns false if they do not exist.
+ */
+bool
+open_aqo_relation(AQORelation rel, LOCKMODE lockmode,
+				  Relation *heap, Relation *index)
+{
+	if (!lookup_aqo_relids())
+		return false;
+
+	*heap = heap_open(aqo_relids[rel], lockmode);
+	*index = index_open(aqo_indids[rel], lockmode);
+	return true;
+}
+
+/*
+ * Checks whether the opened AQO service relation can be read. A standby has
+ * no data of unlogged relations, so the knowledge base in the unlogged mode
+ * is considered empty there.
+ */
+static bool
+aqo_relation_is_readable(Relation heap)
+{
+	return !RecoveryInProgress() || RelationNeedsWAL(heap);
+}
+
+/*
+ * Checks whether AQO extension is created in the current database.
+ * The positive answer is cached together with OIDs of AQO relations.
+ */
+bool
+aqo_extension_exists(void)
+{
+	if (aqo_extension_found)
+		return true;
+
+	aqo_extension_found = OidIsValid(get_extension_oid("aqo", true)) &&
+						  lookup_aqo_relids();
+	return aqo_extension_found;
+}
+
+/*
+ * Returns the amount of shared memory needed by the conflict counters.
+ */
+Size
+storage_shmem_size(void)
+{
+	return MAXALIGN(sizeof(UpdateConflictCounters));
+}
+
+/*
+ * Allocates or attaches to the conflict counters and remembers the learn
+ * locks. The caller must hold AddinShmemInitLock.
+ */
+void
+storage_shmem_init(LWLockPadded *locks)
+{
+	bool		found;
+
+	learn_locks = locks;
+
+	update_conflicts = ShmemInitStruct("aqo update conflicts",
+									   sizeof(UpdateConflictCounters),
+									   &found);
+	if (!found)
+	{
+		pg_atomic_init_u64(&update_conflicts->merged, 0);
+		pg_atomic_init_u64(&update_conflicts->dropped, 0);
+	}
+}
+
+static UpdateConflictCounters *
+get_update_conflicts(void)
+{
+	static bool local_initialized = false;
+
+	if (update_conflicts != NULL)
+		return update_conflicts;
+
+	if (!local_initialized)
+	{
+		pg_atomic_init_u64(&local_update_conflicts.merged, 0);
+		pg_atomic_init_u64(&local_update_conflicts.dropped, 0);
+		local_initialized = true;
+	}
+	return &local_update_conflicts;
+}
+
+/*
+ * Returns the learn lock of the model's partition or NULL if there are no
+ * learn locks.
+ */
+static LWLock *
+get_learn_lock(int fspace_hash, int fss_hash)
+{
+	uint32		h;
+
+	if (learn_locks == NULL)
+		return NULL;
+
+	h = hash_combine((uint32) fspace_hash, (uint32) fss_hash);
+	return &learn_locks[h % AQO_NUM_LEARN_LOCKS].lock;
+}
+
+/*
+ * Counts the concurrent update of an AQO row which was merged with ours or
+ * lost.
+ */
+void
+count_update_conflict(bool merged)
+{
+	UpdateConflictCounters *counters = get_update_conflicts();
+
+	if (merged)
+		pg_atomic_fetch_add_u64(&counters->merged, 1);
+	else
+		pg_atomic_fetch_add_u64(&counters->dropped, 1);
+}
+
+PG_FUNCTION_INFO_V1(aqo_update_conflicts);
+
+/*
+ * Returns the numbers of merged and lost concurrent updates.
+ */
+Datum
+aqo_update_conflicts(PG_FUNCTION_ARGS)
+{
+	UpdateConflictCounters *counters = get_update_conflicts();
+	TupleDesc	tupdesc;
+	Datum		values[2];
+	bool		nulls[2] = { false, false };
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	values[0] = Int64GetDatum((int64) pg_atomic_read_u64(&counters->merged));
+	values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&counters->dropped));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+													  values, nulls)));
+}
+
+/*
+ * Checks whether the knowledge base is switched to the unlogged mode by
+ * aqo_set_unlogged().
+ */
+bool
+knowledge_base_is_unlogged(void)
+{
+	Oid			relid = get_aqo_relid(AQO_DATA);
+
+	return OidIsValid(relid) &&
+		   get_rel_persistence(relid) == RELPERSISTENCE_UNLOGGED;
+}
+
 /*
  * Returns whether the query with given hash is in aqo_queries.
  * If yes, returns the content of the first line with given hash.
+ * The shared directory of query settings is checked first.
  */
 bool
 find_query(int query_hash,
 		   Datum *search_values,
 		   bool *search_nulls)
 {
-	RangeVar   *aqo_queries_table_rv;
 	Relation	aqo_queries_heap;
 	HeapTuple	tuple;
 	TupleTableSlot *slot;
@@ -56,23 +370,37 @@ find_query(int query_hash,
 	LOCKMODE	lockmode = AccessShareLock;
 
 	Relation	query_index_rel;
-	Oid			query_index_rel_oid;
 	IndexScanDesc query_index_scan;
 	ScanKeyData key;
 
 	bool		find_ok = false;
+	bool		learn_aqo;
+	bool		use_aqo;
+	int			fspace_hash;
+	bool		auto_tuning;
+	uint64		generation;
+
+	if (query_cache_lookup(query_hash, &learn_aqo, &use_aqo,
+						   &fspace_hash, &auto_tuning))
+	{
+		search_values[0] = Int32GetDatum(query_hash);
+		search_values[1] = BoolGetDatum(learn_aqo);
+		search_values[2] = BoolGetDatum(use_aqo);
+		search_values[3] = Int32GetDatum(fspace_hash);
+		search_values[4] = BoolGetDatum(auto_tuning);
+		memset(search_nulls, 0, sizeof(bool) * 5);
+		return true;
+	}
+
+	generation = query_cache_generation();
 
-	query_index_rel_oid = RelnameGetRelid("aqo_queries_query_hash_idx");
-	if (!OidIsValid(query_index_rel_oid))
+	if (!open_aqo_relation(AQO_QUERIES, lockmode,
+						   &aqo_queries_heap, &query_index_rel))
 	{
 		disable_aqo_for_query();
 		return false;
 	}
 
-	aqo_queries_table_rv = makeRangeVar("public", "aqo_queries", -1);
-	aqo_queries_heap = heap_openrv(aqo_queries_table_rv, lockmode);
-
-	query_index_rel = index_open(query_index_rel_oid, lockmode);
 	query_index_scan = index_beginscan(aqo_queries_heap,
 									   query_index_rel,
 									   SnapshotSelf,
@@ -97,6 +425,12 @@ find_query(int query_hash,
 		Assert(shouldFree != true);
 		heap_deform_tuple(tuple, aqo_queries_heap->rd_att,
 												search_values, search_nulls);
+		query_cache_store(query_hash,
+						  DatumGetBool(search_values[1]),
+						  DatumGetBool(search_values[2]),
+						  DatumGetInt32(search_values[3]),
+						  DatumGetBool(search_values[4]),
+						  generation);
 	}
 
 	ExecDropSingleTupleTableSlot(slot);
@@ -115,7 +449,6 @@ bool
 add_query(int query_hash, bool learn_aqo, bool use_aqo,
 		  int fspace_hash, bool auto_tuning)
 {
-	RangeVar   *aqo_queries_table_rv;
 	Relation	aqo_queries_heap;
 	HeapTuple	tuple;
 
@@ -125,7 +458,6 @@ add_query(int query_hash, bool learn_aqo, bool use_aqo,
 	bool		nulls[5] = {false, false, false, false, false};
 
 	Relation	query_index_rel;
-	Oid			query_index_rel_oid;
 
 	values[0] = Int32GetDatum(query_hash);
 	values[1] = BoolGetDatum(learn_aqo);
@@ -133,16 +465,14 @@ add_query(int query_hash, bool learn_aqo, bool use_aqo,
 	values[3] = Int32GetDatum(fspace_hash);
 	values[4] = BoolGetDatum(auto_tuning);
 
-	query_index_rel_oid = RelnameGetRelid("aqo_queries_query_hash_idx");
-	if (!OidIsValid(query_index_rel_oid))
+	if (!open_aqo_relation(AQO_QUERIES, lockmode,
+						   &aqo_queries_heap, &query_index_rel))
 	{
 		disable_aqo_for_query();
 		return false;
 	}
-	query_index_rel = index_open(query_index_rel_oid, lockmode);
 
-	aqo_queries_table_rv = makeRangeVar("public", "aqo_queries", -1);
-	aqo_queries_heap = heap_openrv(aqo_queries_table_rv, lockmode);
+	query_cache_invalidate(query_hash);
 
 	tuple = heap_form_tuple(RelationGetDescr(aqo_queries_heap),
 							values, nulls);
@@ -178,7 +508,6 @@ bool
 update_query(int query_hash, bool learn_aqo, bool use_aqo,
 			 int fspace_hash, bool auto_tuning)
 {
-	RangeVar   *aqo_queries_table_rv;
 	Relation	aqo_queries_heap;
 	HeapTuple	tuple,
 				nw_tuple;
@@ -191,25 +520,23 @@ update_query(int query_hash, bool learn_aqo, bool use_aqo,
 	LOCKMODE	lockmode = RowExclusiveLock;
 
 	Relation	query_index_rel;
-	Oid			query_index_rel_oid;
 	IndexScanDesc query_index_scan;
 	ScanKeyData key;
 
 	Datum		values[5];
 	bool		isnull[5] = { false, false, false, false, false };
 	bool		replace[5] = { false, true, true, true, true };
+	int			attempt;
 
-	query_index_rel_oid = RelnameGetRelid("aqo_queries_query_hash_idx");
-	if (!OidIsValid(query_index_rel_oid))
+	if (!open_aqo_relation(AQO_QUERIES, lockmode,
+						   &aqo_queries_heap, &query_index_rel))
 	{
 		disable_aqo_for_query();
 		return false;
 	}
 
-	aqo_queries_table_rv = makeRangeVar("public", "aqo_queries", -1);
-	aqo_queries_heap = heap_openrv(aqo_queries_table_rv, lockmode);
+	query_cache_invalidate(query_hash);
 
-	query_index_rel = index_open(query_index_rel_oid, lockmode);
 	query_index_scan = index_beginscan(aqo_queries_heap,
 									   query_index_rel,
 									   SnapshotSelf,
@@ -222,40 +549,51 @@ update_query(int query_hash, bool learn_aqo, bool use_aqo,
 				F_INT4EQ,
 				Int32GetDatum(query_hash));
 
-	index_rescan(query_index_scan, &key, 1, NULL, 0);
 	slot = MakeSingleTupleTableSlot(query_index_scan->heapRelation->rd_att,
 															&TTSOpsBufferHeapTuple);
-	find_ok = index_getnext_slot(query_index_scan, ForwardScanDirection, slot);
-	Assert(find_ok);
-	tuple = ExecFetchSlotHeapTuple(slot, true, &shouldFree);
-	Assert(shouldFree != true);
 
-	heap_deform_tuple(tuple, aqo_queries_heap->rd_att,
-					  values, isnull);
+	/*
+	 * If somebody concurrently updates the tuple, our settings are applied
+	 * to its new version, at most AQO_UPDATE_RETRIES times. A concurrently
+	 * deleted query type is not updated.
+	 */
+	for (attempt = 0;; ++attempt)
+	{
+		index_rescan(query_index_scan, &key, 1, NULL, 0);
+		find_ok = index_getnext_slot(query_index_scan, ForwardScanDirection,
+									 slot);
+		if (!find_ok)
+			break;
+		tuple = ExecFetchSlotHeapTuple(slot, true, &shouldFree);
+		Assert(shouldFree != true);
+
+		heap_deform_tuple(tuple, aqo_queries_heap->rd_att,
+						  values, isnull);
 
-	values[1] = BoolGetDatum(learn_aqo);
-	values[2] = BoolGetDatum(use_aqo);
-	values[3] = Int32GetDatum(fspace_hash);
-	values[4] = BoolGetDatum(auto_tuning);
+		values[1] = BoolGetDatum(learn_aqo);
+		values[2] = BoolGetDatum(use_aqo);
+		values[3] = Int32GetDatum(fspace_hash);
+		values[4] = BoolGetDatum(auto_tuning);
 
-	nw_tuple = heap_modify_tuple(tuple, aqo_queries_heap->rd_att,
-								 values, isnull, replace);
-	if (my_simple_heap_update(aqo_queries_heap, &(nw_tuple->t_self), nw_tuple,
-			&update_indexes))
-	{
-		if (update_indexes)
-			my_index_insert(query_index_rel, values, isnull,
-							&(nw_tuple->t_self),
-							aqo_queries_heap, UNIQUE_CHECK_YES);
-	}
-	else
-	{
-		/*
-		 * Ooops, somebody concurrently updated the tuple. We have to merge
-		 * our changes somehow, but now we just discard ours. We don't believe
-		 * in high probability of simultaneously finishing of two long,
-		 * complex, and important queries, so we don't loss important data.
-		 */
+		nw_tuple = heap_modify_tuple(tuple, aqo_queries_heap->rd_att,
+									 values, isnull, replace);
+		if (my_simple_heap_update(aqo_queries_heap, &(nw_tuple->t_self),
+								  nw_tuple, &update_indexes, true, NULL))
+		{
+			if (update_indexes)
+				my_index_insert(query_index_rel, values, isnull,
+								&(nw_tuple->t_self),
+								aqo_queries_heap, UNIQUE_CHECK_YES);
+			if (attempt > 0)
+				count_update_conflict(true);
+			break;
+		}
+
+		if (attempt >= AQO_UPDATE_RETRIES)
+		{
+			count_update_conflict(false);
+			break;
+		}
 	}
 
 	ExecDropSingleTupleTableSlot(slot);
@@ -275,7 +613,6 @@ update_query(int query_hash, bool learn_aqo, bool use_aqo,
 bool
 add_query_text(int query_hash, const char *query_text)
 {
-	RangeVar   *aqo_query_texts_table_rv;
 	Relation	aqo_query_texts_heap;
 	HeapTuple	tuple;
 
@@ -285,24 +622,16 @@ add_query_text(int query_hash, const char *query_text)
 	bool		isnull[2] = {false, false};
 
 	Relation	query_index_rel;
-	Oid			query_index_rel_oid;
 
 	values[0] = Int32GetDatum(query_hash);
 	values[1] = CStringGetTextDatum(query_text);
 
-	query_index_rel_oid = RelnameGetRelid("aqo_query_texts_query_hash_idx");
-	if (!OidIsValid(query_index_rel_oid))
+	if (!open_aqo_relation(AQO_QUERY_TEXTS, lockmode,
+						   &aqo_query_texts_heap, &query_index_rel))
 	{
 		disable_aqo_for_query();
 		return false;
 	}
-	query_index_rel = index_open(query_index_rel_oid, lockmode);
-
-	aqo_query_texts_table_rv = makeRangeVar("public",
-											"aqo_query_texts",
-											-1);
-	aqo_query_texts_heap = heap_openrv(aqo_query_texts_table_rv,
-									   lockmode);
 
 	tuple = heap_form_tuple(RelationGetDescr(aqo_query_texts_heap),
 							values, isnull);
@@ -335,23 +664,21 @@ add_query_text(int query_hash, const char *query_text)
 }
 
 /*
- * Loads feature subspace (fss) from table aqo_data into memory.
- * The last column of the returned matrix is for target values of objects.
+ * Loads feature subspace (fss) from the shared model cache or, if it is
+ * not cached, from table aqo_data into memory.
  * Returns false if the operation failed, true otherwise.
  *
  * 'fss_hash' is the hash of feature subspace which is supposed to be loaded
  * 'ncols' is the number of clauses in the feature subspace
- * 'matrix' is an allocated memory for matrix with the size of aqo_K rows
- *			and nhashes columns
- * 'targets' is an allocated memory with size aqo_K for target values
- *			of the objects
- * 'rows' is the pointer in which the function stores actual number of
- *			objects in the given feature space
+ * 'methods' is the model of the current feature space
+ * 'state' is the pointer in which the function stores the state of the
+ *			model, built by its deserialize method
+ * 'mcxt' is the memory context in which the state is allocated
  */
 bool
-load_fss(int fss_hash, int ncols, double **matrix, double *targets, int *rows)
+load_fss(int fss_hash, int ncols, const AQOModelMethods *methods,
+		 void **state, MemoryContext mcxt)
 {
-	RangeVar   *aqo_data_table_rv;
 	Relation	aqo_data_heap;
 	HeapTuple	tuple;
 	TupleTableSlot *slot;
@@ -359,28 +686,41 @@ load_fss(int fss_hash, int ncols, double **matrix, double *targets, int *rows)
 	bool		find_ok = false;
 
 	Relation	data_index_rel;
-	Oid			data_index_rel_oid;
 	IndexScanDesc data_index_scan;
 	ScanKeyData	key[2];
 
 	LOCKMODE	lockmode = AccessShareLock;
 
-	Datum		values[5];
-	bool		isnull[5];
+	Datum		values[4];
+	bool		isnull[4];
 
 	bool		success = true;
-
-	data_index_rel_oid = RelnameGetRelid("aqo_fss_access_idx");
-	if (!OidIsValid(data_index_rel_oid))
+	bool		cached;
+	uint64		cache_generation;
+	MemoryContext oldCxt;
+
+	oldCxt = MemoryContextSwitchTo(mcxt);
+	cached = fss_cache_lookup(query_context.fspace_hash, fss_hash, ncols,
+							  methods, state);
+	MemoryContextSwitchTo(oldCxt);
+	if (cached)
+		return true;
+	cache_generation = fss_cache_generation();
+
+	if (!open_aqo_relation(AQO_DATA, lockmode,
+						   &aqo_data_heap, &data_index_rel))
 	{
 		disable_aqo_for_query();
 		return false;
 	}
 
-	aqo_data_table_rv = makeRangeVar("public", "aqo_data", -1);
-	aqo_data_heap = heap_openrv(aqo_data_table_rv, lockmode);
+	if (!aqo_relation_is_readable(aqo_data_heap))
+	{
+		index_close(data_index_rel, lockmode);
+		heap_close(aqo_data_heap, lockmode);
+		return false;
+	}
 
-	data_index_rel = index_open(data_index_rel_oid, lockmode);
 	data_index_scan = index_beginscan(aqo_data_heap,
 									  data_index_rel,
 									  SnapshotSelf,
@@ -413,11 +753,9 @@ load_fss(int fss_hash, int ncols, double **matrix, double *targets, int *rows)
 
 		if (DatumGetInt32(values[2]) == ncols)
 		{
-			if (ncols > 0)
-				/* The case than an object has not any filters, no selectivities. */
-				deform_matrix(values[3], matrix);
-
-			deform_vector(values[4], targets, rows);
+			oldCxt = MemoryContextSwitchTo(mcxt);
+			*state = methods->deserialize(values[3], ncols);
+			MemoryContextSwitchTo(oldCxt);
 		}
 		else
 		{
@@ -436,190 +774,684 @@ load_fss(int fss_hash, int ncols, double **matrix, double *targets, int *rows)
 	index_close(data_index_rel, lockmode);
 	heap_close(aqo_data_heap, lockmode);
 
+	if (success)
+		fss_cache_store(query_context.fspace_hash, fss_hash, ncols,
+						methods, *state, cache_generation);
+
 	return success;
 }
 
 /*
- * Updates the specified line in the specified feature subspace.
+ * Loads all feature subspaces of the given feature space from aqo_data with
+ * one range scan over aqo_fss_access_idx and stores them into the planning
+ * memo. The states are deserialized in 'mcxt', and the memo keeps them.
  * Returns false if the operation failed, true otherwise.
- *
- * 'fss_hash' specifies the feature subspace
- * 'nrows' x 'ncols' is the shape of 'matrix'
- * 'targets' is vector of size 'nrows'
  */
 bool
-update_fss(int fss_hash, int nrows, int ncols, double **matrix, double *targets)
+load_fspace(int fspace_hash, MemoryContext mcxt)
 {
-	RangeVar   *aqo_data_table_rv;
 	Relation	aqo_data_heap;
-	TupleDesc	tuple_desc;
-	HeapTuple	tuple,
-				nw_tuple;
-
+	HeapTuple	tuple;
 	TupleTableSlot *slot;
 	bool		shouldFree;
-	bool		find_ok = false;
-	bool		update_indexes;
-
-	LOCKMODE	lockmode = RowExclusiveLock;
 
 	Relation	data_index_rel;
-	Oid			data_index_rel_oid;
 	IndexScanDesc data_index_scan;
-	ScanKeyData	key[2];
+	ScanKeyData	key;
 
-	Datum		values[5];
-	bool		isnull[5] = { false, false, false, false, false };
-	bool		replace[5] = { false, false, false, true, true };
+	LOCKMODE	lockmode = AccessShareLock;
 
-	data_index_rel_oid = RelnameGetRelid("aqo_fss_access_idx");
-	if (!OidIsValid(data_index_rel_oid))
+	Datum		values[4];
+	bool		isnull[4];
+
+	MemoryContext tupleCxt;
+	MemoryContext oldCxt;
+	const AQOModelMethods *methods;
+	void	   *state;
+	int			ncols;
+
+	methods = get_fspace_model(fspace_hash);
+	if (methods == NULL)
+		return false;
+
+	if (!open_aqo_relation(AQO_DATA, lockmode,
+						   &aqo_data_heap, &data_index_rel))
 	{
 		disable_aqo_for_query();
 		return false;
 	}
 
-	aqo_data_table_rv = makeRangeVar("public", "aqo_data", -1);
-	aqo_data_heap = heap_openrv(aqo_data_table_rv, lockmode);
-
-	tuple_desc = RelationGetDescr(aqo_data_heap);
+	/* The feature space has no models to be looked up */
+	if (!aqo_relation_is_readable(aqo_data_heap))
+	{
+		index_close(data_index_rel, lockmode);
+		heap_close(aqo_data_heap, lockmode);
+		return true;
+	}
 
-	data_index_rel = index_open(data_index_rel_oid, lockmode);
 	data_index_scan = index_beginscan(aqo_data_heap,
 									  data_index_rel,
 									  SnapshotSelf,
-									  2,
+									  1,
 									  0);
 
-	ScanKeyInit(&key[0],
+	ScanKeyInit(&key,
 				1,
 				BTEqualStrategyNumber,
 				F_INT4EQ,
-				Int32GetDatum(query_context.fspace_hash));
-
-	ScanKeyInit(&key[1],
-				2,
-				BTEqualStrategyNumber,
-				F_INT4EQ,
-				Int32GetDatum(fss_hash));
+				Int32GetDatum(fspace_hash));
 
-	index_rescan(data_index_scan, key, 2, NULL, 0);
+	index_rescan(data_index_scan, &key, 1, NULL, 0);
 
 	slot = MakeSingleTupleTableSlot(data_index_scan->heapRelation->rd_att,
-															&TTSOpsBufferHeapTuple);
-	find_ok = index_getnext_slot(data_index_scan, ForwardScanDirection, slot);
+														&TTSOpsBufferHeapTuple);
+	tupleCxt = AllocSetContextCreate(CurrentMemoryContext,
+									 "AQO fspace prefetch",
+									 ALLOCSET_DEFAULT_SIZES);
 
-	if (!find_ok)
+	while (index_getnext_slot(data_index_scan, ForwardScanDirection, slot))
 	{
-		values[0] = Int32GetDatum(query_context.fspace_hash);
-		values[1] = Int32GetDatum(fss_hash);
-		values[2] = Int32GetDatum(ncols);
-
-		if (ncols > 0)
-			values[3] = PointerGetDatum(form_matrix(matrix, nrows, ncols));
-		else
-			isnull[3] = true;
+		oldCxt = MemoryContextSwitchTo(tupleCxt);
 
-		values[4] = PointerGetDatum(form_vector(targets, nrows));
-		tuple = heap_form_tuple(tuple_desc, values, isnull);
-		PG_TRY();
-		{
-			simple_heap_insert(aqo_data_heap, tuple);
-			my_index_insert(data_index_rel, values, isnull, &(tuple->t_self),
-							aqo_data_heap, UNIQUE_CHECK_YES);
-		}
-		PG_CATCH();
-		{
-			CommandCounterIncrement();
-			simple_heap_delete(aqo_data_heap, &(tuple->t_self));
-			PG_RE_THROW();
-		}
-		PG_END_TRY();
-	}
-	else
-	{
 		tuple = ExecFetchSlotHeapTuple(slot, true, &shouldFree);
 		Assert(shouldFree != true);
 		heap_deform_tuple(tuple, aqo_data_heap->rd_att, values, isnull);
 
-		if (ncols > 0)
-			values[3] = PointerGetDatum(form_matrix(matrix, nrows, ncols));
-		else
-			isnull[3] = true;
+		ncols = DatumGetInt32(values[2]);
+		MemoryContextSwitchTo(mcxt);
+		state = methods->deserialize(values[3], ncols);
+		MemoryContextSwitchTo(tupleCxt);
 
-		values[4] = PointerGetDatum(form_vector(targets, nrows));
-		nw_tuple = heap_modify_tuple(tuple, tuple_desc,
-									 values, isnull, replace);
-		if (my_simple_heap_update(aqo_data_heap, &(nw_tuple->t_self), nw_tuple,
-															&update_indexes))
-		{
-			if (update_indexes)
-				my_index_insert(data_index_rel, values, isnull,
-								&(nw_tuple->t_self),
-								aqo_data_heap, UNIQUE_CHECK_YES);
-		}
-		else
-		{
-			/*
-			 * Ooops, somebody concurrently updated the tuple. We have to
-			 * merge our changes somehow, but now we just discard ours. We
-			 * don't believe in high probability of simultaneously finishing
-			 * of two long, complex, and important queries, so we don't loss
-			 * important data.
-			 */
-		}
+		fss_memo_store(DatumGetInt32(values[1]), ncols, methods, state);
+
+		MemoryContextSwitchTo(oldCxt);
+		MemoryContextReset(tupleCxt);
 	}
 
+	MemoryContextDelete(tupleCxt);
 	ExecDropSingleTupleTableSlot(slot);
 	index_endscan(data_index_scan);
 	index_close(data_index_rel, lockmode);
 	heap_close(aqo_data_heap, lockmode);
 
-	CommandCounterIncrement();
-
 	return true;
 }
 
 /*
- * Returns QueryStat for the given query_hash. Returns empty QueryStat if
- * no statistics is stored for the given query_hash in table aqo_query_stat.
- * Returns NULL and executes disable_aqo_for_query if aqo_query_stat
- * is not found.
+ * Models whose last update has not been written to aqo_data because it
+ * changed the stored model by less than aqo.model_change_threshold. The
+ * next learning of such a model continues from the pending version, so small
+ * changes accumulate in memory until they are worth writing. A pending
+ * version is valid only while the stored tuple is the one it was learned
+ * from; it is forgotten as soon as somebody else changes the model.
  */
-QueryStat *
-get_aqo_stat(int query_hash)
+typedef struct
 {
-	RangeVar   *aqo_stat_table_rv;
-	Relation	aqo_stat_heap;
-	HeapTuple	tuple;
-	LOCKMODE	heap_lock = AccessShareLock;
+	int			fspace_hash;
+	int			fss_hash;
+} PendingModelKey;
 
-	Relation	stat_index_rel;
-	Oid			stat_index_rel_oid;
-	IndexScanDesc stat_index_scan;
-	ScanKeyData key;
-	LOCKMODE	index_lock = AccessShareLock;
+typedef struct
+{
+	PendingModelKey key;
+	ItemPointerData tid;
+	TransactionId xmin;
+	const AQOModelMethods *methods;
+	int			ncols;
+	void	   *state;
+} PendingModel;
 
-	Datum		values[9];
-	bool		nulls[9];
+/* The pending models are forgotten at once if there are too many of them */
+#define AQO_MAX_PENDING_MODELS	(1024)
 
-	QueryStat  *stat = palloc_query_stat();
+static HTAB *pending_models = NULL;
+static MemoryContext PendingModelsContext = NULL;
+
+/*
+ * Copies the state of the model into the memory context.
+ */
+static void *
+model_state_copy(const AQOModelMethods *methods, const void *state,
+				 int ncols, MemoryContext mcxt)
+{
+	Size		size = methods->memory_size(state, ncols);
+	void	   *copy = MemoryContextAlloc(mcxt, size);
+
+	memcpy(copy, state, size);
+	return copy;
+}
+
+/*
+ * Looks for the pending version of the model learned from given tuple.
+ * Returns its copy or NULL if it is not found.
+ */
+static void *
+pending_model_load(PendingModelKey *key, HeapTuple tuple,
+				   const AQOModelMethods *methods, int ncols)
+{
+	PendingModel *entry;
+
+	if (pending_models == NULL)
+		return NULL;
+
+	entry = (PendingModel *) hash_search(pending_models, key, HASH_FIND, NULL);
+	if (entry == NULL)
+		return NULL;
+
+	if (!ItemPointerEquals(&entry->tid, &tuple->t_self) ||
+		entry->xmin != HeapTupleHeaderGetXmin(tuple->t_data) ||
+		entry->methods != methods || entry->ncols != ncols)
+	{
+		pfree(entry->state);
+		hash_search(pending_models, key, HASH_REMOVE, NULL);
+		return NULL;
+	}
+
+	return model_state_copy(methods, entry->state, ncols,
+							CurrentMemoryContext);
+}
+
+/*
+ * Remembers the model which was learned from given tuple but not written.
+ */
+static void
+pending_model_store(PendingModelKey *key, HeapTuple tuple,
+					const AQOModelMethods *methods, const void *state,
+					int ncols)
+{
+	PendingModel *entry;
+	HASHCTL		info;
+	bool		found;
+
+	if (pending_models != NULL &&
+		hash_get_num_entries(pending_models) >= AQO_MAX_PENDING_MODELS)
+	{
+		hash_destroy(pending_models);
+		MemoryContextReset(PendingModelsContext);
+		pending_models = NULL;
+	}
+
+	if (pending_models == NULL)
+	{
+		if (PendingModelsContext == NULL)
+			PendingModelsContext = AllocSetContextCreate(TopMemoryContext,
+														 "AQO pending models",
+														 ALLOCSET_DEFAULT_SIZES);
+
+		MemSet(&info, 0, sizeof(info));
+		info.keysize = sizeof(PendingModelKey);
+		info.entrysize = sizeof(PendingModel);
+		info.hcxt = PendingModelsContext;
+		pending_models = hash_create("AQO pending models", 64, &info,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = (PendingModel *) hash_search(pending_models, key, HASH_ENTER,
+										 &found);
+	if (found)
+		pfree(entry->state);
+
+	entry->tid = tuple->t_self;
+	entry->xmin = HeapTupleHeaderGetXmin(tuple->t_data);
+	entry->methods = methods;
+	entry->ncols = ncols;
+	entry->state = model_state_copy(methods, state, ncols,
+									PendingModelsContext);
+}
+
+/*
+ * Forgets the pending version of the model, if any.
+ */
+static void
+pending_model_forget(PendingModelKey *key)
+{
+	PendingModel *entry;
+
+	if (pending_models == NULL)
+		return;
+
+	entry = (PendingModel *) hash_search(pending_models, key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		pfree(entry->state);
+		hash_search(pending_models, key, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Relations and scan of aqo_data shared by the groups of one batch.
+ */
+typedef struct
+{
+	Relation	heap;
+	Relation	index;
+	IndexScanDesc scan;
+	TupleTableSlot *slot;
+	const AQOModelMethods *methods;
+	/* True if the backend must not wait for other learners of a model */
+	bool		nowait;
+} LearnBatchState;
+
+/* Result of learn_fss_group() */
+typedef enum
+{
+	/* The model is written, or the update is not worth writing or lost */
+	LEARN_GROUP_DONE,
+	/* The new model is formed in the slot, and the caller inserts it */
+	LEARN_GROUP_NEW,
+	/* Another backend learns the model, and the samples are not applied */
+	LEARN_GROUP_BUSY
+} LearnGroupResult;
+
+/*
+ * Learns the model of one feature subspace from its samples and writes it.
+ * 'attempt' is the number of previous attempts to write the model.
+ *
+ * The learn lock of the model's partition serializes only reading the model
+ * and learning the samples on top of it, so concurrent learners of one model
+ * rarely learn from the same version. It does not cover the write: the heap
+ * and index writes may wait for I/O and relation extension locks, and
+ * interrupts are held together with an LWLock, so the model is written after
+ * the lock is released. The write does not wait for other transactions. If
+ * the tuple which was read is not the current one anymore, the samples are
+ * learned again on top of the new version, at most AQO_UPDATE_RETRIES times,
+ * after the transaction which has written it ends. A concurrently deleted
+ * model is learned from scratch and inserted. LWLocks are invisible to the
+ * deadlock detector, so the lock is not held while waiting for that
+ * transaction either.
+ *
+ * If the state says nowait, the backend waits neither for the lock nor for
+ * the transaction; then the samples are not applied and LEARN_GROUP_BUSY is
+ * returned.
+ *
+ * If 'new_slot' is not NULL, a model which is not stored yet is not
+ * inserted here. It is formed in a new slot returned in 'new_slot', and
+ * LEARN_GROUP_NEW is returned.
+ */
+static LearnGroupResult
+learn_fss_group(LearnBatchState *state, AQOLearnGroup *group, int attempt,
+				TupleTableSlot **new_slot)
+{
+	TupleDesc	tuple_desc = RelationGetDescr(state->heap);
+	AQOLearnSample *first = (AQOLearnSample *) linitial(group->samples);
+	HeapTuple	tuple = NULL;
+	HeapTuple	nw_tuple;
+	bool		shouldFree;
+	bool		find_ok;
+	bool		update_indexes;
+	ScanKeyData	key[2];
+
+	Datum		values[4];
+	bool		isnull[4];
+	bool		replace[4] = { false, false, false, true };
+
+	const AQOModelMethods *methods = state->methods;
+	void	   *model = NULL;
+	void	   *old_model;
+	int			ncols;
+	int			old_ncols;
+	PendingModelKey pkey;
+	LWLock	   *learn_lock;
+	TransactionId xwait;
+	ListCell   *ls;
+	LearnGroupResult result = LEARN_GROUP_DONE;
+
+	learn_lock = get_learn_lock(query_context.fspace_hash, group->fss_hash);
+
+	MemSet(&pkey, 0, sizeof(pkey));
+	pkey.fspace_hash = query_context.fspace_hash;
+	pkey.fss_hash = group->fss_hash;
+
+	ScanKeyInit(&key[0],
+				1,
+				BTEqualStrategyNumber,
+				F_INT4EQ,
+				Int32GetDatum(query_context.fspace_hash));
+
+	ScanKeyInit(&key[1],
+				2,
+				BTEqualStrategyNumber,
+				F_INT4EQ,
+				Int32GetDatum(group->fss_hash));
+
+	for (;; ++attempt)
+	{
+		bool		small = false;
+
+		if (learn_lock != NULL)
+		{
+			if (!state->nowait)
+				LWLockAcquire(learn_lock, LW_EXCLUSIVE);
+			else if (!LWLockConditionalAcquire(learn_lock, LW_EXCLUSIVE))
+			{
+				result = LEARN_GROUP_BUSY;
+				break;
+			}
+		}
+
+		ncols = first->ncols;
+		old_ncols = ncols;
+		old_model = NULL;
+		if (model != NULL)
+			pfree(model);
+		model = NULL;
+
+		index_rescan(state->scan, key, 2, NULL, 0);
+		find_ok = index_getnext_slot(state->scan, ForwardScanDirection,
+									 state->slot);
+
+		if (find_ok)
+		{
+			tuple = ExecFetchSlotHeapTuple(state->slot, true, &shouldFree);
+			Assert(shouldFree != true);
+			heap_deform_tuple(tuple, tuple_desc, values, isnull);
+
+			if (DatumGetInt32(values[2]) == ncols)
+			{
+				model = methods->deserialize(values[3], ncols);
+
+				if (aqo_model_change_threshold > 0 && methods->change != NULL)
+				{
+					/* Keep the stored model to measure the change */
+					old_model = model;
+					model = pending_model_load(&pkey, tuple, methods, ncols);
+					if (model == NULL)
+						model = model_state_copy(methods, old_model, ncols,
+												 CurrentMemoryContext);
+				}
+			}
+			else
+				elog(WARNING, "unexpected number of features for hash (%d, %d):\
+							   expected %d features, obtained %d",
+							   query_context.fspace_hash,
+							   group->fss_hash, ncols, DatumGetInt32(values[2]));
+		}
+
+		/* Samples of one fss are learned in the order of their collection */
+		foreach(ls, group->samples)
+		{
+			AQOLearnSample *sample = (AQOLearnSample *) lfirst(ls);
+
+			if (sample->ncols != ncols)
+			{
+				/* Hash collision, the model is learned from scratch */
+				ncols = sample->ncols;
+				if (model != NULL)
+					pfree(model);
+				model = NULL;
+			}
+			model = methods->learn(model, ncols, aqo_model_capacity,
+								   sample->features, sample->target);
+		}
+
+		if (old_model != NULL)
+		{
+			small = (ncols == old_ncols &&
+					 methods->change(old_model, model, ncols) <
+					 aqo_model_change_threshold);
+
+			if (small)
+				pending_model_store(&pkey, tuple, methods, model, ncols);
+
+			pfree(old_model);
+		}
+
+		if (!small)
+		{
+			pending_model_forget(&pkey);
+			fss_cache_invalidate(query_context.fspace_hash, group->fss_hash);
+
+			values[3] = PointerGetDatum(methods->serialize(model, ncols));
+			isnull[3] = false;
+		}
+
+		if (learn_lock != NULL)
+			LWLockRelease(learn_lock);
+
+		if (small)
+			break;
+
+		learn_worker_note_change();
+
+		if (!find_ok)
+		{
+			values[0] = Int32GetDatum(query_context.fspace_hash);
+			values[1] = Int32GetDatum(group->fss_hash);
+			values[2] = Int32GetDatum(ncols);
+			isnull[0] = isnull[1] = isnull[2] = false;
+
+			if (new_slot != NULL)
+			{
+				*new_slot = table_slot_create(state->heap, NULL);
+				memcpy((*new_slot)->tts_values, values, sizeof(values));
+				memcpy((*new_slot)->tts_isnull, isnull, sizeof(isnull));
+				ExecStoreVirtualTuple(*new_slot);
+				result = LEARN_GROUP_NEW;
+				break;
+			}
+
+			if (insert_model_row(state->heap, state->index,
+								 values, isnull, &xwait))
+			{
+				if (attempt > 0)
+					count_update_conflict(true);
+				break;
+			}
+		}
+		else
+		{
+			nw_tuple = heap_modify_tuple(tuple, tuple_desc,
+										 values, isnull, replace);
+			if (my_simple_heap_update(state->heap, &(nw_tuple->t_self),
+									  nw_tuple, &update_indexes, false,
+									  &xwait))
+			{
+				if (update_indexes)
+					my_index_insert(state->index, values, isnull,
+									&(nw_tuple->t_self),
+									state->heap, UNIQUE_CHECK_YES);
+				if (attempt > 0)
+					count_update_conflict(true);
+				break;
+			}
+		}
+
+		if (attempt >= AQO_UPDATE_RETRIES)
+		{
+			count_update_conflict(false);
+			break;
+		}
+
+		if (TransactionIdIsValid(xwait))
+		{
+			if (state->nowait)
+			{
+				result = LEARN_GROUP_BUSY;
+				break;
+			}
+
+			if (find_ok)
+				XactLockTableWait(xwait, state->heap, &(tuple->t_self),
+								  XLTW_Update);
+			else
+				XactLockTableWait(xwait, state->heap, NULL,
+								  XLTW_InsertIndexUnique);
+		}
+	}
+
+	if (model != NULL)
+		pfree(model);
+
+	return result;
+}
+
+/*
+ * Applies the learning samples of the current query to their models in one
+ * pass over aqo_data: the relation is opened once, every model is read and
+ * written once, new models are inserted with one table_multi_insert() call,
+ * and the command counter is incremented once. An update which changes the
+ * stored model by less than aqo.model_change_threshold is not written.
+ * Returns false if the operation failed, true otherwise.
+ *
+ * A new model may conflict with the same model inserted concurrently by
+ * another backend. Then our row is removed, and its samples are learned
+ * again on top of the other model as by learn_fss_group().
+ *
+ * With aqo.learn_lock = skip or defer a backend never waits for another
+ * learner of a model, see learn_fss_group(). The samples of such a model are
+ * skipped or sent to the background worker. The worker itself always waits.
+ *
+ * 'groups' is a list of AQOLearnGroup with distinct fss_hash values
+ */
+bool
+learn_fss_batch(List *groups)
+{
+	LearnBatchState state;
+	LOCKMODE	lockmode = RowExclusiveLock;
+	List	   *deferred = NIL;
+	ListCell   *lg;
+	LearnGroupResult result;
+	TupleTableSlot **new_slots;
+	AQOLearnGroup **new_groups;
+	int			nnew = 0;
+	int			i;
+
+	if (groups == NIL)
+		return true;
+
+	/* The stored models of an unknown model are never touched */
+	state.methods = get_fspace_model(query_context.fspace_hash);
+	if (state.methods == NULL)
+		return true;
+
+	if (!open_aqo_relation(AQO_DATA, lockmode, &state.heap, &state.index))
+	{
+		disable_aqo_for_query();
+		return false;
+	}
+
+	/* Do not delay the query if another backend learns the model */
+	state.nowait = (aqo_learn_lock != AQO_LEARN_LOCK_WAIT &&
+					!IsBackgroundWorker);
+
+	state.scan = index_beginscan(state.heap, state.index, SnapshotSelf, 2, 0);
+	state.slot = MakeSingleTupleTableSlot(RelationGetDescr(state.heap),
+										  &TTSOpsBufferHeapTuple);
+
+	new_slots = palloc(sizeof(TupleTableSlot *) * list_length(groups));
+	new_groups = palloc(sizeof(AQOLearnGroup *) * list_length(groups));
+
+	foreach(lg, groups)
+	{
+		AQOLearnGroup *group = (AQOLearnGroup *) lfirst(lg);
+
+		result = learn_fss_group(&state, group, 0, &new_slots[nnew]);
+		if (result == LEARN_GROUP_NEW)
+			new_groups[nnew++] = group;
+		else if (result == LEARN_GROUP_BUSY &&
+				 aqo_learn_lock == AQO_LEARN_LOCK_DEFER)
+			deferred = list_concat(deferred, list_copy(group->samples));
+	}
+
+	if (nnew > 0)
+		table_multi_insert(state.heap, new_slots, nnew,
+						   GetCurrentCommandId(true), 0, NULL);
+
+	for (i = 0; i < nnew; ++i)
+	{
+		TupleTableSlot *new_slot = new_slots[i];
+		TransactionId xwait;
+
+		/* The heap insertion has replaced the values by the tuple */
+		slot_getallattrs(new_slot);
+		if (my_index_insert(state.index,
+							new_slot->tts_values, new_slot->tts_isnull,
+							&(new_slot->tts_tid), state.heap,
+							UNIQUE_CHECK_PARTIAL))
+		{
+			ExecDropSingleTupleTableSlot(new_slot);
+			continue;
+		}
+
+		xwait = remove_model_row(state.heap, state.index,
+								 &(new_slot->tts_tid), new_slot->tts_values);
+		ExecDropSingleTupleTableSlot(new_slot);
+
+		if (TransactionIdIsValid(xwait))
+		{
+			if (state.nowait)
+			{
+				if (aqo_learn_lock == AQO_LEARN_LOCK_DEFER)
+					deferred = list_concat(deferred,
+										   list_copy(new_groups[i]->samples));
+				continue;
+			}
+			XactLockTableWait(xwait, state.heap, NULL,
+							  XLTW_InsertIndexUnique);
+		}
+
+		if (learn_fss_group(&state, new_groups[i], 1, NULL) ==
+			LEARN_GROUP_BUSY && aqo_learn_lock == AQO_LEARN_LOCK_DEFER)
+			deferred = list_concat(deferred,
+								   list_copy(new_groups[i]->samples));
+	}
+
+	pfree(new_slots);
+	pfree(new_groups);
+	ExecDropSingleTupleTableSlot(state.slot);
+	index_endscan(state.scan);
+	index_close(state.index, lockmode);
+	heap_close(state.heap, lockmode);
+
+	CommandCounterIncrement();
+
+	/* The worker learns the deferred samples; otherwise they are skipped */
+	if (deferred != NIL)
+	{
+		learn_queue_send(deferred, false, 0, 0, 0);
+		list_free(deferred);
+	}
+
+	return true;
+}
+
+/*
+ * Returns QueryStat for the given query_hash. Returns empty QueryStat if
+ * no statistics is stored for the given query_hash in table aqo_query_stat.
+ * Returns NULL and executes disable_aqo_for_query if aqo_query_stat
+ * is not found.
+ */
+QueryStat *
+get_aqo_stat(int query_hash)
+{
+	Relation	aqo_stat_heap;
+	HeapTuple	tuple;
+	LOCKMODE	lockmode = AccessShareLock;
+
+	Relation	stat_index_rel;
+	IndexScanDesc stat_index_scan;
+	ScanKeyData key;
+
+	Datum		values[2];
+	bool		nulls[2];
+
+	QueryStat  *stat = palloc_query_stat();
+	QueryStat  *stored;
+	int			series;
+	int			i;
 
 	TupleTableSlot *slot;
 	bool		shouldFree;
 	bool		find_ok = false;
 
-	stat_index_rel_oid = RelnameGetRelid("aqo_query_stat_idx");
-	if (!OidIsValid(stat_index_rel_oid))
+	if (!open_aqo_relation(AQO_QUERY_STAT, lockmode,
+						   &aqo_stat_heap, &stat_index_rel))
 	{
 		disable_aqo_for_query();
+		pfree_query_stat(stat);
 		return NULL;
 	}
 
-	aqo_stat_table_rv = makeRangeVar("public", "aqo_query_stat", -1);
-	aqo_stat_heap = heap_openrv(aqo_stat_table_rv, heap_lock);
-
-	stat_index_rel = index_open(stat_index_rel_oid, index_lock);
 	stat_index_scan = index_beginscan(aqo_stat_heap,
 									  stat_index_rel,
 									  SnapshotSelf,
@@ -644,21 +1476,28 @@ get_aqo_stat(int query_hash)
 		Assert(shouldFree != true);
 		heap_deform_tuple(tuple, aqo_stat_heap->rd_att, values, nulls);
 
-		DeformVectorSz(values[1], stat->execution_time_with_aqo);
-		DeformVectorSz(values[2], stat->execution_time_without_aqo);
-		DeformVectorSz(values[3], stat->planning_time_with_aqo);
-		DeformVectorSz(values[4], stat->planning_time_without_aqo);
-		DeformVectorSz(values[5], stat->cardinality_error_with_aqo);
-		DeformVectorSz(values[6], stat->cardinality_error_without_aqo);
+		stored = get_packed_stat(values[1]);
+
+		if (stored->capacity == stat->capacity)
+			memcpy(stat, stored, VARSIZE(stored));
+		else
+		{
+			/* Keep the newest values if the capacity has been changed */
+			for (series = 0; series < STAT_NSERIES; ++series)
+				for (i = 0; i < query_stat_nelems(stored, series); ++i)
+					query_stat_append(stat, series,
+									  query_stat_get(stored, series, i));
+			stat->executions_with_aqo = stored->executions_with_aqo;
+			stat->executions_without_aqo = stored->executions_without_aqo;
+		}
 
-		stat->executions_with_aqo = DatumGetInt64(values[7]);
-		stat->executions_without_aqo = DatumGetInt64(values[8]);
+		pfree(stored);
 	}
 
 	ExecDropSingleTupleTableSlot(slot);
 	index_endscan(stat_index_scan);
-	index_close(stat_index_rel, index_lock);
-	heap_close(aqo_stat_heap, heap_lock);
+	index_close(stat_index_rel, lockmode);
+	heap_close(aqo_stat_heap, lockmode);
 
 	return stat;
 }
@@ -666,11 +1505,13 @@ get_aqo_stat(int query_hash)
 /*
  * Saves given QueryStat for the given query_hash.
  * Executes disable_aqo_for_query if aqo_query_stat is not found.
+ * Returns false if the row was updated or deleted concurrently; then the
+ * statistics is not saved, and the caller may add its changes to the new
+ * version or insert it again.
  */
-void
+bool
 update_aqo_stat(int query_hash, QueryStat *stat)
 {
-	RangeVar   *aqo_stat_table_rv;
 	Relation	aqo_stat_heap;
 	HeapTuple	tuple,
 				nw_tuple;
@@ -684,31 +1525,24 @@ update_aqo_stat(int query_hash, QueryStat *stat)
 	LOCKMODE	lockmode = RowExclusiveLock;
 
 	Relation	stat_index_rel;
-	Oid			stat_index_rel_oid;
 	IndexScanDesc stat_index_scan;
 	ScanKeyData	key;
 
-	Datum		values[9];
-	bool		isnull[9] = { false, false, false,
-							  false, false, false,
-							  false, false, false };
-	bool		replace[9] = { false, true, true,
-							    true, true, true,
-								true, true, true };
+	Datum		values[2];
+	bool		isnull[2] = { false, false };
+	bool		replace[2] = { false, true };
+	bool		updated = true;
 
-	stat_index_rel_oid = RelnameGetRelid("aqo_query_stat_idx");
-	if (!OidIsValid(stat_index_rel_oid))
+	if (!open_aqo_relation(AQO_QUERY_STAT, lockmode,
+						   &aqo_stat_heap, &stat_index_rel))
 	{
 		disable_aqo_for_query();
-		return;
+		return true;
 	}
 
-	aqo_stat_table_rv = makeRangeVar("public", "aqo_query_stat", -1);
-	aqo_stat_heap = heap_openrv(aqo_stat_table_rv, lockmode);
-
 	tuple_desc = RelationGetDescr(aqo_stat_heap);
+	learn_worker_note_change();
 
-	stat_index_rel = index_open(stat_index_rel_oid, lockmode);
 	stat_index_scan = index_beginscan(aqo_stat_heap,
 									  stat_index_rel,
 									  SnapshotSelf,
@@ -728,15 +1562,7 @@ update_aqo_stat(int query_hash, QueryStat *stat)
 	find_ok = index_getnext_slot(stat_index_scan, ForwardScanDirection, slot);
 
 	/*values[0] will be initialized later */
-	values[1] = PointerGetDatum(FormVectorSz(stat->execution_time_with_aqo));
-	values[2] = PointerGetDatum(FormVectorSz(stat->execution_time_without_aqo));
-	values[3] = PointerGetDatum(FormVectorSz(stat->planning_time_with_aqo));
-	values[4] = PointerGetDatum(FormVectorSz(stat->planning_time_without_aqo));
-	values[5] = PointerGetDatum(FormVectorSz(stat->cardinality_error_with_aqo));
-	values[6] = PointerGetDatum(FormVectorSz(stat->cardinality_error_without_aqo));
-
-	values[7] = Int64GetDatum(stat->executions_with_aqo);
-	values[8] = Int64GetDatum(stat->executions_without_aqo);
+	values[1] = PointerGetDatum(stat);
 
 	if (!find_ok)
 	{
@@ -764,7 +1590,7 @@ update_aqo_stat(int query_hash, QueryStat *stat)
 		nw_tuple = heap_modify_tuple(tuple, tuple_desc,
 									 values, isnull, replace);
 		if (my_simple_heap_update(aqo_stat_heap, &(nw_tuple->t_self), nw_tuple,
-															&update_indexes))
+								  &update_indexes, true, NULL))
 		{
 			/* NOTE: insert index tuple iff heap update succeeded! */
 			if (update_indexes)
@@ -773,15 +1599,7 @@ update_aqo_stat(int query_hash, QueryStat *stat)
 								aqo_stat_heap, UNIQUE_CHECK_YES);
 		}
 		else
-		{
-			/*
-			 * Ooops, somebody concurrently updated the tuple. We have to
-			 * merge our changes somehow, but now we just discard ours. We
-			 * don't believe in high probability of simultaneously finishing
-			 * of two long, complex, and important queries, so we don't loss
-			 * important data.
-			 */
-		}
+			updated = false;
 	}
 
 	ExecDropSingleTupleTableSlot(slot);
@@ -790,33 +1608,906 @@ update_aqo_stat(int query_hash, QueryStat *stat)
 	heap_close(aqo_stat_heap, lockmode);
 
 	CommandCounterIncrement();
+
+	return updated;
+}
+
+/*
+ * Detoasts the packed model and checks its header.
+ */
+AQOPackedModel *
+get_packed_model(Datum datum)
+{
+	AQOPackedModel *model = (AQOPackedModel *) PG_DETOAST_DATUM(datum);
+
+	if (VARSIZE(model) < offsetof(AQOPackedModel, data) ||
+		model->version != AQO_MODEL_VERSION ||
+		(model->flags & ~AQO_MODEL_FLOAT4) != 0 ||
+		model->nrows < 0 || model->nrows > AQO_MAX_MODEL_CAPACITY ||
+		model->ncols < 0 ||
+		VARSIZE(model) != AQOPackedModelSize(model->nrows, model->ncols,
+											 model->flags))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid AQO model format")));
+
+	return model;
+}
+
+/*
+ * Forms the packed model for storage from simple C-arrays. The model is
+ * stored in single precision if aqo.model_single_precision is on.
+ */
+bytea *
+form_model(double *matrix, double *targets, int nrows, int ncols)
+{
+	uint16		flags = aqo_model_single_precision ? AQO_MODEL_FLOAT4 : 0;
+	Size		size = AQOPackedModelSize(nrows, ncols, flags);
+	AQOPackedModel *model = palloc0(size);
+	int			i;
+
+	SET_VARSIZE(model, size);
+	model->version = AQO_MODEL_VERSION;
+	model->flags = flags;
+	model->nrows = nrows;
+	model->ncols = ncols;
+	if (flags & AQO_MODEL_FLOAT4)
+	{
+		float4	   *data = (float4 *) model->data;
+
+		for (i = 0; i < nrows * ncols; ++i)
+			data[i] = (float4) matrix[i];
+		for (i = 0; i < nrows; ++i)
+			data[nrows * ncols + i] = (float4) targets[i];
+	}
+	else
+	{
+		memcpy(model->data, matrix, sizeof(double) * nrows * ncols);
+		memcpy(&model->data[nrows * ncols], targets, sizeof(double) * nrows);
+	}
+
+	return (bytea *) model;
+}
+
+/*
+ * Allocates one block for the row-major matrix of 'nrows' rows and 'ncols'
+ * columns followed by 'nrows' targets. Returns the matrix; the block is
+ * freed with it.
+ */
+double *
+alloc_model(int nrows, int ncols, double **targets)
+{
+	double	   *matrix = palloc(sizeof(double) * Max(nrows, 1) * (ncols + 1));
+
+	*targets = &matrix[nrows * ncols];
+	return matrix;
+}
+
+/*
+ * Expands the packed model from storage into simple C-arrays allocated by
+ * alloc_model() with room for at least 'capacity' rows.
+ * 'ncols' is the number of features stored in the nfeatures column.
+ */
+void
+deform_model(Datum datum, int ncols, int capacity, double **matrix_p,
+			 double **targets_p, int *nrows)
+{
+	AQOPackedModel *model = get_packed_model(datum);
+	double	   *matrix;
+	double	   *targets;
+
+	if (model->ncols != ncols)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid AQO model format"),
+				 errdetail("Model has %d features, expected %d.",
+						   model->ncols, ncols)));
+
+	matrix = alloc_model(Max(capacity, model->nrows), ncols, &targets);
+	unpack_model(model, matrix, targets);
+	*nrows = model->nrows;
+	*matrix_p = matrix;
+	*targets_p = targets;
+
+	if ((Pointer) model != DatumGetPointer(datum))
+		pfree(model);
+}
+
+/*
+ * Copies the matrix and the targets of the packed model into the arrays of
+ * the caller, which have room for its rows.
+ */
+void
+unpack_model(AQOPackedModel *model, double *matrix, double *targets)
+{
+	int			nvalues = model->nrows * model->ncols;
+	int			i;
+
+	if (model->flags & AQO_MODEL_FLOAT4)
+	{
+		float4	   *data = (float4 *) model->data;
+
+		for (i = 0; i < nvalues; ++i)
+			matrix[i] = data[i];
+		for (i = 0; i < model->nrows; ++i)
+			targets[i] = data[nvalues + i];
+	}
+	else
+	{
+		memcpy(matrix, model->data, sizeof(double) * nvalues);
+		memcpy(targets, &model->data[nvalues], sizeof(double) * model->nrows);
+	}
+}
+
+PG_FUNCTION_INFO_V1(aqo_model_pack);
+PG_FUNCTION_INFO_V1(aqo_model_features);
+PG_FUNCTION_INFO_V1(aqo_model_targets);
+
+/*
+ * Packs the feature matrix and the targets into the model format of
+ * aqo_data. The matrix is NULL for models without features.
+ */
+Datum
+aqo_model_pack(PG_FUNCTION_ARGS)
+{
+	ArrayType  *features;
+	ArrayType  *targets_array;
+	double	   *matrix = NULL;
+	double	   *targets;
+	int			nrows;
+	int			ncols = 0;
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+
+	targets_array = PG_GETARG_ARRAYTYPE_P(1);
+	nrows = ArrayGetNItems(ARR_NDIM(targets_array), ARR_DIMS(targets_array));
+	if (nrows > AQO_MAX_MODEL_CAPACITY)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("model can not contain more than %d rows",
+						AQO_MAX_MODEL_CAPACITY)));
+	targets = palloc(sizeof(double) * Max(nrows, 1));
+	deform_vector(PointerGetDatum(targets_array), targets, &nrows);
+
+	if (!PG_ARGISNULL(0))
+	{
+		features = PG_GETARG_ARRAYTYPE_P(0);
+		if (ARR_NDIM(features) == 2)
+		{
+			if (ARR_DIMS(features)[0] != nrows)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("number of rows of features does not match the number of targets")));
+			ncols = ARR_DIMS(features)[1];
+		}
+		else if (ARR_NDIM(features) != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("features must be a two-dimensional array")));
+	}
+
+	if (ncols > 0)
+	{
+		matrix = palloc(sizeof(double) * nrows * ncols);
+		deform_matrix(PG_GETARG_DATUM(0), matrix);
+	}
+
+	PG_RETURN_BYTEA_P(form_model(matrix, targets, nrows, ncols));
+}
+
+/*
+ * Returns the feature matrix of the packed model, or NULL if the model has
+ * no features.
+ */
+Datum
+aqo_model_features(PG_FUNCTION_ARGS)
+{
+	AQOPackedModel *model = get_packed_model(PG_GETARG_DATUM(0));
+	double	   *matrix;
+	double	   *targets;
+	int			nrows;
+
+	if (model->ncols == 0)
+		PG_RETURN_NULL();
+
+	deform_model(PG_GETARG_DATUM(0), model->ncols, 0,
+				 &matrix, &targets, &nrows);
+
+	PG_RETURN_ARRAYTYPE_P(form_matrix(matrix, nrows, model->ncols));
+}
+
+/*
+ * Returns the targets of the packed model.
+ */
+Datum
+aqo_model_targets(PG_FUNCTION_ARGS)
+{
+	AQOPackedModel *model = get_packed_model(PG_GETARG_DATUM(0));
+	double	   *matrix;
+	double	   *targets;
+	int			nrows;
+
+	deform_model(PG_GETARG_DATUM(0), model->ncols, 0,
+				 &matrix, &targets, &nrows);
+
+	PG_RETURN_ARRAYTYPE_P(form_vector(targets, nrows));
+}
+
+/*
+ * Returns the palloc'd copy of the packed statistics and checks its header.
+ * A short inline value is only int-aligned in the tuple, so the int64 and
+ * double fields are read from the copy.
+ */
+static QueryStat *
+get_packed_stat(Datum datum)
+{
+	QueryStat  *stat = (QueryStat *) PG_DETOAST_DATUM_COPY(datum);
+	bool		valid;
+	int			series;
+
+	valid = VARSIZE(stat) >= offsetof(QueryStat, data) &&
+			stat->version == AQO_STAT_VERSION &&
+			stat->nseries == STAT_NSERIES &&
+			stat->capacity >= 0 &&
+			VARSIZE(stat) == QueryStatSize(stat->capacity);
+
+	for (series = 0; valid && series < STAT_NSERIES; ++series)
+		valid = stat->rings[series].size >= 0 &&
+				stat->rings[series].size <= stat->capacity &&
+				stat->rings[series].head >= 0 &&
+				(stat->rings[series].head < stat->capacity ||
+				 stat->rings[series].head == 0);
+
+	if (!valid)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid AQO statistics format")));
+
+	return stat;
+}
+
+/*
+ * Forms ArrayType object of the series from the oldest value to the newest
+ * one.
+ */
+static ArrayType *
+form_stat_series(QueryStat *stat, QueryStatSeries series)
+{
+	int			nelems = query_stat_nelems(stat, series);
+	double	   *vector = palloc(sizeof(double) * (nelems + 1));
+	ArrayType  *array;
+	int			i;
+
+	for (i = 0; i < nelems; ++i)
+		vector[i] = query_stat_get(stat, series, i);
+	array = form_vector(vector, nelems);
+	pfree(vector);
+	return array;
+}
+
+PG_FUNCTION_INFO_V1(aqo_stat_pack);
+PG_FUNCTION_INFO_V1(aqo_stat_unpack);
+
+/*
+ * Packs the series of query statistics into the format of aqo_query_stat.
+ * Only the newest values which fit into the statistics are kept. NULL
+ * arguments are considered as empty series.
+ */
+Datum
+aqo_stat_pack(PG_FUNCTION_ARGS)
+{
+	QueryStat  *stat = palloc_query_stat();
+	bytea	   *result;
+	ArrayType  *array;
+	double	   *vector;
+	int			nelems;
+	int			series;
+	int			i;
+
+	for (series = 0; series < STAT_NSERIES; ++series)
+	{
+		if (PG_ARGISNULL(series))
+			continue;
+
+		array = PG_GETARG_ARRAYTYPE_P(series);
+		vector = palloc(sizeof(double) *
+						(ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array)) + 1));
+		deform_vector(PointerGetDatum(array), vector, &nelems);
+		for (i = 0; i < nelems; ++i)
+			query_stat_append(stat, series, vector[i]);
+		pfree(vector);
+	}
+
+	stat->executions_with_aqo = PG_ARGISNULL(STAT_NSERIES) ? 0 :
+		PG_GETARG_INT64(STAT_NSERIES);
+	stat->executions_without_aqo = PG_ARGISNULL(STAT_NSERIES + 1) ? 0 :
+		PG_GETARG_INT64(STAT_NSERIES + 1);
+
+	result = palloc(VARSIZE(stat));
+	memcpy(result, stat, VARSIZE(stat));
+	pfree_query_stat(stat);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * Expands the packed statistics into the series from the oldest value to the
+ * newest one and the numbers of executions.
+ */
+Datum
+aqo_stat_unpack(PG_FUNCTION_ARGS)
+{
+	QueryStat  *stat = get_packed_stat(PG_GETARG_DATUM(0));
+	TupleDesc	tupdesc;
+	Datum		values[STAT_NSERIES + 2];
+	bool		nulls[STAT_NSERIES + 2];
+	int			series;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	MemSet(nulls, 0, sizeof(nulls));
+	for (series = 0; series < STAT_NSERIES; ++series)
+		values[series] = PointerGetDatum(form_stat_series(stat, series));
+	values[STAT_NSERIES] = Int64GetDatum(stat->executions_with_aqo);
+	values[STAT_NSERIES + 1] = Int64GetDatum(stat->executions_without_aqo);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+													  values, nulls)));
+}
+
+/*
+ * The knowledge base file starts with the header and contains one section
+ * per AQO service relation in the order of AQORelation. A section starts
+ * with the number and the types of the attributes of the relation, which
+ * must match the installed version of the extension. Each row is preceded
+ * by byte 1, the section ends with byte 0. An attribute is a null flag byte
+ * followed by its value: int4 and bool are stored in the native format,
+ * varlena values as their length and data. The file is portable only
+ * between servers of the same architecture.
+ */
+#define AQO_KB_MAGIC		0x4B4F5141	/* "AQOK" */
+#define AQO_KB_VERSION		1
+
+/* The number of rows inserted by one call of table_multi_insert() */
+#define AQO_KB_BATCH_SIZE	1000
+
+typedef struct
+{
+	uint32		magic;
+	uint32		version;
+	int32		nsections;
+} AQOKnowledgeBaseHeader;
+
+typedef struct
+{
+	FILE	   *file;
+	const char *filename;
+} AQOKnowledgeBaseFile;
+
+static void
+kb_write(AQOKnowledgeBaseFile *kb, const void *data, Size size)
+{
+	if (fwrite(data, 1, size, kb->file) != size)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to file \"%s\": %m", kb->filename)));
+}
+
+static void
+kb_read(AQOKnowledgeBaseFile *kb, void *data, Size size)
+{
+	if (fread(data, 1, size, kb->file) != size)
+	{
+		if (ferror(kb->file))
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", kb->filename)));
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid AQO knowledge base file \"%s\"",
+						kb->filename)));
+	}
+}
+
+static void
+kb_write_attr(AQOKnowledgeBaseFile *kb, Form_pg_attribute attr,
+			  Datum value, bool isnull)
+{
+	uint8		flag = isnull ? 1 : 0;
+
+	kb_write(kb, &flag, sizeof(flag));
+	if (isnull)
+		return;
+
+	switch (attr->atttypid)
+	{
+		case INT4OID:
+			{
+				int32		val = DatumGetInt32(value);
+
+				kb_write(kb, &val, sizeof(val));
+				break;
+			}
+		case BOOLOID:
+			{
+				uint8		val = DatumGetBool(value) ? 1 : 0;
+
+				kb_write(kb, &val, sizeof(val));
+				break;
+			}
+		case BYTEAOID:
+		case TEXTOID:
+		case VARCHAROID:
+			{
+				struct varlena *val = PG_DETOAST_DATUM(value);
+				uint32		len = VARSIZE(val) - VARHDRSZ;
+
+				kb_write(kb, &len, sizeof(len));
+				kb_write(kb, VARDATA(val), len);
+				if ((Pointer) val != DatumGetPointer(value))
+					pfree(val);
+				break;
+			}
+		default:
+			elog(ERROR, "unexpected type %u of an AQO service relation",
+				 attr->atttypid);
+	}
+}
+
+static void
+kb_read_attr(AQOKnowledgeBaseFile *kb, Form_pg_attribute attr,
+			 Datum *value, bool *isnull)
+{
+	uint8		flag;
+
+	kb_read(kb, &flag, sizeof(flag));
+	*isnull = (flag != 0);
+	*value = (Datum) 0;
+	if (*isnull)
+		return;
+
+	switch (attr->atttypid)
+	{
+		case INT4OID:
+			{
+				int32		val;
+
+				kb_read(kb, &val, sizeof(val));
+				*value = Int32GetDatum(val);
+				break;
+			}
+		case BOOLOID:
+			{
+				uint8		val;
+
+				kb_read(kb, &val, sizeof(val));
+				*value = BoolGetDatum(val != 0);
+				break;
+			}
+		case BYTEAOID:
+		case TEXTOID:
+		case VARCHAROID:
+			{
+				struct varlena *val;
+				uint32		len;
+
+				kb_read(kb, &len, sizeof(len));
+				if (len > MaxAllocSize - VARHDRSZ)
+					ereport(ERROR,
+							(errcode(ERRCODE_DATA_CORRUPTED),
+							 errmsg("invalid AQO knowledge base file \"%s\"",
+									kb->filename)));
+				val = palloc(len + VARHDRSZ);
+				SET_VARSIZE(val, len + VARHDRSZ);
+				kb_read(kb, VARDATA(val), len);
+				if (attr->atttypid != BYTEAOID)
+					pg_verifymbstr(VARDATA(val), len, false);
+				*value = PointerGetDatum(val);
+				break;
+			}
+		default:
+			elog(ERROR, "unexpected type %u of an AQO service relation",
+				 attr->atttypid);
+	}
+}
+
+/*
+ * Checks whether the relation has a row with given values of the leading
+ * int4 columns of its index.
+ */
+static bool
+kb_row_exists(Relation heap, Relation index, Datum *keys, int nkeys)
+{
+	IndexScanDesc scan;
+	ScanKeyData key[2];
+	TupleTableSlot *slot;
+	bool		found;
+	int			i;
+
+	Assert(nkeys <= lengthof(key));
+
+	scan = index_beginscan(heap, index, SnapshotSelf, nkeys, 0);
+	for (i = 0; i < nkeys; ++i)
+		ScanKeyInit(&key[i],
+					i + 1,
+					BTEqualStrategyNumber,
+					F_INT4EQ,
+					keys[i]);
+	index_rescan(scan, key, nkeys, NULL, 0);
+
+	slot = MakeSingleTupleTableSlot(RelationGetDescr(heap),
+									&TTSOpsBufferHeapTuple);
+	found = index_getnext_slot(scan, ForwardScanDirection, slot);
+
+	ExecDropSingleTupleTableSlot(slot);
+	index_endscan(scan);
+	return found;
+}
+
+/*
+ * Checks whether the row read from the file is well-formed. A model is
+ * checked by the deserialize method of its feature space; the models of an
+ * unregistered model can not be checked.
+ */
+static void
+kb_check_row(AQOKnowledgeBaseFile *kb, AQORelation rel,
+			 Datum *values, bool *isnull, int nkeys)
+{
+	const AQOModelMethods *methods;
+	int			i;
+
+	for (i = 0; i < nkeys; ++i)
+		if (isnull[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("invalid AQO knowledge base file \"%s\"",
+							kb->filename)));
+
+	if (rel == AQO_DATA && !isnull[3])
+	{
+		if (isnull[2])
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("invalid AQO model format")));
+
+		methods = get_fspace_model(DatumGetInt32(values[0]));
+		if (methods != NULL)
+			pfree(methods->deserialize(values[3], DatumGetInt32(values[2])));
+	}
+	else if (rel == AQO_QUERY_STAT && !isnull[1])
+		pfree(get_packed_stat(values[1]));
+}
+
+/*
+ * Inserts the batch of rows into the relation and its indexes.
+ */
+static void
+kb_flush_batch(EState *estate, TupleTableSlot **slots, int nslots,
+			   BulkInsertState bistate)
+{
+	ResultRelInfo *rri = estate->es_result_relation_info;
+	List	   *recheck;
+	int			i;
+
+	table_multi_insert(rri->ri_RelationDesc, slots, nslots,
+					   GetCurrentCommandId(true), 0, bistate);
+	learn_worker_note_change();
+
+	for (i = 0; i < nslots; ++i)
+	{
+		ResetPerTupleExprContext(estate);
+		recheck = ExecInsertIndexTuples(slots[i], estate, false, NULL, NIL);
+		list_free(recheck);
+		ExecClearTuple(slots[i]);
+	}
+
+	CommandCounterIncrement();
 }
 
 /*
- * Expands matrix from storage into simple C-array.
+ * Imports one section of the file into the relation. Rows which already
+ * exist or whose query type does not exist are skipped. Returns the number
+ * of inserted rows.
+ */
+static int64
+kb_import_relation(AQOKnowledgeBaseFile *kb, AQORelation rel,
+				   Relation queries_heap, Relation queries_index)
+{
+	Relation	heap;
+	Relation	index;
+	TupleDesc	tupdesc;
+	EState	   *estate;
+	ResultRelInfo *rri;
+	BulkInsertState bistate;
+	MemoryContext batch_context;
+	MemoryContext old_context;
+	TupleTableSlot *slots[AQO_KB_BATCH_SIZE];
+	Datum	   *values;
+	bool	   *isnull;
+	int			nslots = 0;
+	int			nkeys = (rel == AQO_DATA) ? 2 : 1;
+	int64		nrows = 0;
+	int32		section[2];
+	Oid			typid;
+	uint8		flag;
+	int			i;
+
+	if (!open_aqo_relation(rel, RowExclusiveLock, &heap, &index))
+		elog(ERROR, "AQO service relations do not exist");
+	tupdesc = RelationGetDescr(heap);
+
+	kb_read(kb, section, sizeof(section));
+	if (section[0] != rel || section[1] != tupdesc->natts)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("AQO knowledge base file \"%s\" does not match the installed version of the extension",
+						kb->filename)));
+	for (i = 0; i < tupdesc->natts; ++i)
+	{
+		kb_read(kb, &typid, sizeof(typid));
+		if (typid != TupleDescAttr(tupdesc, i)->atttypid)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("AQO knowledge base file \"%s\" does not match the installed version of the extension",
+							kb->filename)));
+	}
+
+	estate = CreateExecutorState();
+	rri = makeNode(ResultRelInfo);
+	InitResultRelInfo(rri, heap, 1, NULL, 0);
+	ExecOpenIndices(rri, false);
+	estate->es_result_relations = rri;
+	estate->es_num_result_relations = 1;
+	estate->es_result_relation_info = rri;
+
+	bistate = GetBulkInsertState();
+	batch_context = AllocSetContextCreate(CurrentMemoryContext,
+										  "AQO knowledge base import",
+										  ALLOCSET_DEFAULT_SIZES);
+	for (i = 0; i < AQO_KB_BATCH_SIZE; ++i)
+		slots[i] = table_slot_create(heap, NULL);
+
+	for (;;)
+	{
+		kb_read(kb, &flag, sizeof(flag));
+		if (flag == 0)
+			break;
+		if (flag != 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("invalid AQO knowledge base file \"%s\"",
+							kb->filename)));
+
+		old_context = MemoryContextSwitchTo(batch_context);
+		values = slots[nslots]->tts_values;
+		isnull = slots[nslots]->tts_isnull;
+		ExecClearTuple(slots[nslots]);
+		for (i = 0; i < tupdesc->natts; ++i)
+			kb_read_attr(kb, TupleDescAttr(tupdesc, i), &values[i], &isnull[i]);
+		kb_check_row(kb, rel, values, isnull, nkeys);
+		MemoryContextSwitchTo(old_context);
+
+		/* The first column of every other relation refers to aqo_queries */
+		if (kb_row_exists(heap, index, values, nkeys) ||
+			(rel != AQO_QUERIES &&
+			 !kb_row_exists(queries_heap, queries_index, values, 1)))
+			continue;
+
+		/* Statistics not written yet must not overwrite the imported row */
+		if (rel == AQO_QUERY_STAT)
+			stat_cache_forget(DatumGetInt32(values[0]));
+
+		ExecStoreVirtualTuple(slots[nslots]);
+		if (++nslots == AQO_KB_BATCH_SIZE)
+		{
+			kb_flush_batch(estate, slots, nslots, bistate);
+			nrows += nslots;
+			nslots = 0;
+			MemoryContextReset(batch_context);
+		}
+	}
+
+	if (nslots > 0)
+	{
+		kb_flush_batch(estate, slots, nslots, bistate);
+		nrows += nslots;
+	}
+
+	for (i = 0; i < AQO_KB_BATCH_SIZE; ++i)
+		ExecDropSingleTupleTableSlot(slots[i]);
+	MemoryContextDelete(batch_context);
+	FreeBulkInsertState(bistate);
+	ExecCloseIndices(rri);
+	FreeExecutorState(estate);
+
+	index_close(index, RowExclusiveLock);
+	heap_close(heap, RowExclusiveLock);
+
+	return nrows;
+}
+
+PG_FUNCTION_INFO_V1(aqo_export);
+PG_FUNCTION_INFO_V1(aqo_import);
+
+/*
+ * Writes the whole knowledge base into the file on the server. Returns the
+ * number of written rows.
+ */
+Datum
+aqo_export(PG_FUNCTION_ARGS)
+{
+	AQOKnowledgeBaseFile kb;
+	AQOKnowledgeBaseHeader header;
+	Relation	heap;
+	Relation	index;
+	TupleDesc	tupdesc;
+	TableScanDesc scan;
+	HeapTuple	tuple;
+	Datum	   *values;
+	bool	   *isnull;
+	int64		nrows = 0;
+	int32		section[2];
+	uint8		flag;
+	int			rel;
+	int			i;
+
+	if (!is_member_of_role(GetUserId(), DEFAULT_ROLE_WRITE_SERVER_FILES))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser or a member of the pg_write_server_files role to export the AQO knowledge base")));
+
+	kb.filename = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	if (!is_absolute_path(kb.filename))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_NAME),
+				 errmsg("relative path not allowed for the AQO knowledge base file")));
+
+	kb.file = AllocateFile(kb.filename, PG_BINARY_W);
+	if (kb.file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for writing: %m",
+						kb.filename)));
+
+	header.magic = AQO_KB_MAGIC;
+	header.version = AQO_KB_VERSION;
+	header.nsections = AQO_NUM_RELATIONS;
+	kb_write(&kb, &header, sizeof(header));
+
+	for (rel = 0; rel < AQO_NUM_RELATIONS; ++rel)
+	{
+		if (!open_aqo_relation(rel, AccessShareLock, &heap, &index))
+			elog(ERROR, "AQO service relations do not exist");
+		tupdesc = RelationGetDescr(heap);
+
+		section[0] = rel;
+		section[1] = tupdesc->natts;
+		kb_write(&kb, section, sizeof(section));
+		for (i = 0; i < tupdesc->natts; ++i)
+			kb_write(&kb, &TupleDescAttr(tupdesc, i)->atttypid, sizeof(Oid));
+
+		values = palloc(sizeof(Datum) * tupdesc->natts);
+		isnull = palloc(sizeof(bool) * tupdesc->natts);
+		flag = 1;
+
+		scan = table_beginscan(heap, GetActiveSnapshot(), 0, NULL);
+		while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+		{
+			heap_deform_tuple(tuple, tupdesc, values, isnull);
+			kb_write(&kb, &flag, sizeof(flag));
+			for (i = 0; i < tupdesc->natts; ++i)
+				kb_write_attr(&kb, TupleDescAttr(tupdesc, i),
+							  values[i], isnull[i]);
+			nrows++;
+		}
+		table_endscan(scan);
+
+		flag = 0;
+		kb_write(&kb, &flag, sizeof(flag));
+
+		pfree(values);
+		pfree(isnull);
+		index_close(index, AccessShareLock);
+		heap_close(heap, AccessShareLock);
+	}
+
+	if (FreeFile(kb.file) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", kb.filename)));
+
+	PG_RETURN_INT64(nrows);
+}
+
+/*
+ * Adds the knowledge base from the file on the server to the current one.
+ * The rows which already exist are kept. Returns the number of inserted
+ * rows.
+ */
+Datum
+aqo_import(PG_FUNCTION_ARGS)
+{
+	AQOKnowledgeBaseFile kb;
+	AQOKnowledgeBaseHeader header;
+	Relation	queries_heap;
+	Relation	queries_index;
+	int64		nrows = 0;
+	int			rel;
+
+	if (!is_member_of_role(GetUserId(), DEFAULT_ROLE_READ_SERVER_FILES))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser or a member of the pg_read_server_files role to import the AQO knowledge base")));
+
+	kb.filename = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	kb.file = AllocateFile(kb.filename, PG_BINARY_R);
+	if (kb.file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for reading: %m",
+						kb.filename)));
+
+	kb_read(&kb, &header, sizeof(header));
+	if (header.magic != AQO_KB_MAGIC)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid AQO knowledge base file \"%s\"",
+						kb.filename)));
+	if (header.version != AQO_KB_VERSION ||
+		header.nsections != AQO_NUM_RELATIONS)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("AQO knowledge base file \"%s\" does not match the installed version of the extension",
+						kb.filename)));
+
+	if (!open_aqo_relation(AQO_QUERIES, RowExclusiveLock,
+						   &queries_heap, &queries_index))
+		elog(ERROR, "AQO service relations do not exist");
+
+	/*
+	 * aqo_queries goes first, so the other rows can refer to its rows, and
+	 * aqo_fspace_settings goes before aqo_data, so its models are checked
+	 * in the right format.
+	 */
+	for (rel = 0; rel < AQO_NUM_RELATIONS; ++rel)
+	{
+		nrows += kb_import_relation(&kb, rel, queries_heap, queries_index);
+		if (rel == AQO_FSPACE_SETTINGS)
+			fspace_model_cache_reset();
+	}
+
+	index_close(queries_index, RowExclusiveLock);
+	heap_close(queries_heap, RowExclusiveLock);
+	FreeFile(kb.file);
+
+	/* The rows are inserted bypassing the triggers which reset the caches */
+	CacheInvalidateRelcacheByRelid(get_aqo_relid(AQO_FSPACE_SETTINGS));
+	fini_deactivated_queries_storage();
+	init_deactivated_queries_storage();
+	query_cache_reset();
+	fss_cache_reset();
+
+	PG_RETURN_INT64(nrows);
+}
+
+/*
+ * Expands matrix from storage into simple row-major C-array.
  */
 void
-deform_matrix(Datum datum, double **matrix)
+deform_matrix(Datum datum, double *matrix)
 {
 	ArrayType  *array = DatumGetArrayTypePCopy(PG_DETOAST_DATUM(datum));
 	int			nelems;
 	Datum	   *values;
-	int			rows;
-	int			cols;
-	int			i,
-				j;
+	int			i;
 
 	deconstruct_array(array,
 					  FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
 					  &values, NULL, &nelems);
-	if (nelems != 0)
-	{
-		rows = ARR_DIMS(array)[0];
-		cols = ARR_DIMS(array)[1];
-		for (i = 0; i < rows; ++i)
-			for (j = 0; j < cols; ++j)
-				matrix[i][j] = DatumGetFloat8(values[i * cols + j]);
-	}
+	for (i = 0; i < nelems; ++i)
+		matrix[i] = DatumGetFloat8(values[i]);
 	pfree(values);
 	pfree(array);
 }
@@ -842,25 +2533,23 @@ deform_vector(Datum datum, double *vector, int *nelems)
 }
 
 /*
- * Forms ArrayType object for storage from simple C-array matrix.
+ * Forms ArrayType object for storage from simple row-major C-array matrix.
  */
 ArrayType *
-form_matrix(double **matrix, int nrows, int ncols)
+form_matrix(double *matrix, int nrows, int ncols)
 {
 	Datum	   *elems;
 	ArrayType  *array;
 	int			dims[2];
 	int			lbs[2];
-	int			i,
-				j;
+	int			i;
 
 	dims[0] = nrows;
 	dims[1] = ncols;
 	lbs[0] = lbs[1] = 1;
 	elems = palloc(sizeof(*elems) * nrows * ncols);
-	for (i = 0; i < nrows; ++i)
-		for (j = 0; j < ncols; ++j)
-			elems[i * ncols + j] = Float8GetDatum(matrix[i][j]);
+	for (i = 0; i < nrows * ncols; ++i)
+		elems[i] = Float8GetDatum(matrix[i]);
 
 	array = construct_md_array(elems, NULL, 2, dims, lbs,
 							   FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd');
@@ -892,21 +2581,27 @@ form_vector(double *vector, int nrows)
 }
 
 /*
- * Returns true if updated successfully, false if updated concurrently by
- * another session, error otherwise.
+ * Returns true if updated successfully, false if updated or deleted
+ * concurrently by another session, error otherwise.
+ * If 'wait' is false, does not wait for the transaction which is updating the
+ * tuple; then returns false and sets 'xwait' to that transaction, which may
+ * be invalid if it is not known.
  */
 static bool
 my_simple_heap_update(Relation relation, ItemPointer otid, HeapTuple tup,
-					  bool *update_indexes)
+					  bool *update_indexes, bool wait, TransactionId *xwait)
 {
 	TM_Result result;
 	TM_FailureData hufd;
 	LockTupleMode lockmode;
 
 	Assert(update_indexes != NULL);
+	Assert(wait || xwait != NULL);
+	if (xwait != NULL)
+		*xwait = InvalidTransactionId;
 	result = heap_update(relation, otid, tup,
 						 GetCurrentCommandId(true), InvalidSnapshot,
-						 true /* wait for commit */ ,
+						 wait,
 						 &hufd, &lockmode);
 	switch (result)
 	{
@@ -924,10 +2619,14 @@ my_simple_heap_update(Relation relation, ItemPointer otid, HeapTuple tup,
 			return true;
 
 		case TM_Updated:
+		case TM_Deleted:
+			/* The caller reads the row again, if it still exists */
 			return false;
 			break;
 
 		case TM_BeingModified:
+			if (xwait != NULL)
+				*xwait = hufd.xmax;
 			return false;
 			break;
 
@@ -938,6 +2637,69 @@ my_simple_heap_update(Relation relation, ItemPointer otid, HeapTuple tup,
 	return false;
 }
 
+/*
+ * Inserts the new model into aqo_data. Returns false if another transaction
+ * has inserted the model of the same fss concurrently; then our tuple is
+ * deleted, and 'xwait' is set to that transaction if it is still running.
+ * The uniqueness is checked without waiting, so the caller decides whether
+ * to wait for that transaction.
+ */
+static bool
+insert_model_row(Relation heap, Relation index, Datum *values, bool *isnull,
+				 TransactionId *xwait)
+{
+	HeapTuple	tuple = heap_form_tuple(RelationGetDescr(heap), values, isnull);
+
+	*xwait = InvalidTransactionId;
+
+	simple_heap_insert(heap, tuple);
+	if (my_index_insert(index, values, isnull, &(tuple->t_self), heap,
+						UNIQUE_CHECK_PARTIAL))
+	{
+		heap_freetuple(tuple);
+		return true;
+	}
+
+	*xwait = remove_model_row(heap, index, &(tuple->t_self), values);
+	heap_freetuple(tuple);
+	return false;
+}
+
+/*
+ * Deletes our model row with given tid which conflicts with the row of the
+ * same fss inserted by another transaction. Returns that transaction if it
+ * is still running, InvalidTransactionId otherwise.
+ */
+static TransactionId
+remove_model_row(Relation heap, Relation index, ItemPointer tid,
+				 Datum *values)
+{
+	SnapshotData snap;
+	IndexScanDesc scan;
+	ScanKeyData key[2];
+	TupleTableSlot *slot;
+	TransactionId xwait = InvalidTransactionId;
+
+	/* The tuple must be visible to be deleted */
+	CommandCounterIncrement();
+	simple_heap_delete(heap, tid);
+
+	/* The dirty snapshot reports the inserter which is still running */
+	InitDirtySnapshot(snap);
+	scan = index_beginscan(heap, index, &snap, 2, 0);
+	ScanKeyInit(&key[0], 1, BTEqualStrategyNumber, F_INT4EQ, values[0]);
+	ScanKeyInit(&key[1], 2, BTEqualStrategyNumber, F_INT4EQ, values[1]);
+	index_rescan(scan, key, 2, NULL, 0);
+
+	slot = MakeSingleTupleTableSlot(RelationGetDescr(heap),
+									&TTSOpsBufferHeapTuple);
+	if (index_getnext_slot(scan, ForwardScanDirection, slot))
+		xwait = snap.xmin;
+
+	ExecDropSingleTupleTableSlot(slot);
+	index_endscan(scan);
+	return xwait;
+}
 
 /* Provides correct insert in both PostgreQL 9.6.X and 10.X.X */
 static bool
@@ -985,19 +2747,33 @@ fini_deactivated_queries_storage(void)
 	deactivated_queries = NULL;
 }
 
-/* Checks whether the query with given hash is deactivated */
+/*
+ * Checks whether the query with given hash is deactivated. The shared set
+ * is used instead of the local one if the shared directory of query
+ * settings is available.
+ */
 bool
 query_is_deactivated(int query_hash)
 {
 	bool		found;
 
+	if (query_cache_enabled())
+		return query_cache_is_deactivated(query_hash);
+
 	hash_search(deactivated_queries, &query_hash, HASH_FIND, &found);
 	return found;
 }
 
-/* Adds given query hash into the set of hashes of deactivated queries*/
+/*
+ * Adds given query hash into the set of hashes of deactivated queries.
+ * 'generation' is the value of query_cache_generation() taken before the
+ * settings of the query were read.
+ */
 void
-add_deactivated_query(int query_hash)
+add_deactivated_query(int query_hash, uint64 generation)
 {
-	hash_search(deactivated_queries, &query_hash, HASH_ENTER, NULL);
+	if (query_cache_enabled())
+		query_cache_deactivate(query_hash, generation);
+	else
+		hash_search(deactivated_queries, &query_hash, HASH_ENTER, NULL);
 }
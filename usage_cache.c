@@ -0,0 +1,461 @@
+#include "aqo.h"
+
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/lsyscache.h"
+#include "utils/timestamp.h"
+
+/*****************************************************************************
+ *
+ *	KNOWLEDGE BASE USAGE
+ *
+ * Tracks when the models of aqo_data and the query types of aqo_queries
+ * were used last time, so that the garbage collector can evict the least
+ * recently used models (see aqo_gc()).
+ *
+ * The planner marks the query type and the models it predicts with in a
+ * backend-local table. At the end of the query the marks are moved into a
+ * shared hash table of at most aqo.usage_cache_size entries, and the
+ * background worker of the database writes them to aqo_query_usage and
+ * aqo_data_usage together with the execution statistics. A backend moves
+ * the mark of the same object at most once per AQO_USAGE_RESOLUTION, so the
+ * shared table is rarely locked. If the shared table is full, the marks are
+ * lost, which only makes the objects look older than they are.
+ *
+ * The shared table also remembers when the garbage of each database was
+ * collected last time, so that a new worker does not repeat it too soon.
+ *
+ *****************************************************************************/
+
+/* How often a backend moves the mark of the same object, ms */
+#define AQO_USAGE_RESOLUTION	(60000)
+
+/* Maximum number of marks remembered by a backend */
+#define AQO_USAGE_LOCAL_SIZE	(4096)
+
+typedef enum
+{
+	USAGE_QUERY = 0,
+	USAGE_FSS,
+	USAGE_GC
+} UsageKind;
+
+typedef struct
+{
+	Oid			dbid;
+	int32		kind;
+	int			hash1;			/* query_hash or fspace_hash */
+	int			hash2;			/* fss_hash */
+} UsageKey;
+
+typedef struct
+{
+	UsageKey	key;
+	TimestampTz last_used;
+} UsageEntry;
+
+typedef struct
+{
+	UsageKey	key;
+	TimestampTz last_used;
+	TimestampTz moved;
+	bool		pending;
+} LocalUsageEntry;
+
+typedef struct
+{
+	LWLock	   *lock;
+	int			size;
+} UsageCacheState;
+
+static UsageCacheState *usage_cache = NULL;
+static HTAB *usage_cache_htab = NULL;
+
+/* Marks of the current backend */
+static HTAB *local_usage = NULL;
+static int	local_npending = 0;
+
+static bool usage_cache_is_usable(void);
+static void usage_set_key(UsageKey *key, UsageKind kind, int hash1, int hash2);
+static void usage_touch(UsageKind kind, int hash1, int hash2);
+static ArrayType *form_int4_array(int *values, int n);
+static ArrayType *form_timestamptz_array(TimestampTz *values, int n);
+
+
+/*
+ * Returns the amount of shared memory needed by the usage marks.
+ */
+Size
+usage_cache_shmem_size(void)
+{
+	Size		size = MAXALIGN(sizeof(UsageCacheState));
+
+	if (aqo_usage_cache_size > 0)
+		size = add_size(size, hash_estimate_size(aqo_usage_cache_size,
+												 sizeof(UsageEntry)));
+
+	return size;
+}
+
+/*
+ * Allocates or attaches to the usage marks. The caller must hold
+ * AddinShmemInitLock.
+ */
+void
+usage_cache_shmem_init(LWLock *lock)
+{
+	bool		found;
+	HASHCTL		info;
+
+	usage_cache = ShmemInitStruct("aqo usage cache",
+								  sizeof(UsageCacheState),
+								  &found);
+	if (!found)
+	{
+		usage_cache->lock = lock;
+		usage_cache->size = aqo_usage_cache_size;
+	}
+
+	if (usage_cache->size <= 0)
+		return;
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(UsageKey);
+	info.entrysize = sizeof(UsageEntry);
+	usage_cache_htab = ShmemInitHash("aqo usage cache hash",
+									 usage_cache->size, usage_cache->size,
+									 &info,
+									 HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * The usage is tracked only if the garbage is collected.
+ */
+static bool
+usage_cache_is_usable(void)
+{
+	return usage_cache_htab != NULL && aqo_gc_interval > 0;
+}
+
+static void
+usage_set_key(UsageKey *key, UsageKind kind, int hash1, int hash2)
+{
+	MemSet(key, 0, sizeof(*key));
+	key->dbid = MyDatabaseId;
+	key->kind = kind;
+	key->hash1 = hash1;
+	key->hash2 = hash2;
+}
+
+/*
+ * Marks the object as used by the current statement.
+ */
+static void
+usage_touch(UsageKind kind, int hash1, int hash2)
+{
+	UsageKey	key;
+	LocalUsageEntry *entry;
+	TimestampTz now;
+	bool		found;
+
+	if (!usage_cache_is_usable())
+		return;
+
+	if (local_usage == NULL)
+	{
+		HASHCTL		info;
+
+		MemSet(&info, 0, sizeof(info));
+		info.keysize = sizeof(UsageKey);
+		info.entrysize = sizeof(LocalUsageEntry);
+		local_usage = hash_create("AQO usage marks", 256, &info,
+								  HASH_ELEM | HASH_BLOBS);
+	}
+
+	usage_set_key(&key, kind, hash1, hash2);
+	now = GetCurrentStatementStartTimestamp();
+
+	entry = (LocalUsageEntry *) hash_search(local_usage, &key,
+											HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->moved = 0;
+		entry->pending = false;
+	}
+	entry->last_used = now;
+
+	if (!entry->pending &&
+		(!found ||
+		 TimestampDifferenceExceeds(entry->moved, now, AQO_USAGE_RESOLUTION)))
+	{
+		entry->pending = true;
+		local_npending++;
+	}
+}
+
+/*
+ * Marks the query type as used.
+ */
+void
+usage_touch_query(int query_hash)
+{
+	usage_touch(USAGE_QUERY, query_hash, 0);
+}
+
+/*
+ * Marks the model as used.
+ */
+void
+usage_touch_fss(int fspace_hash, int fss_hash)
+{
+	usage_touch(USAGE_FSS, fspace_hash, fss_hash);
+}
+
+/*
+ * Moves the marks of the backend into shared memory. Returns true if a mark
+ * of a new object was added; then the caller should make sure that the
+ * worker of the database is running.
+ */
+bool
+usage_cache_push(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	LocalUsageEntry *entry;
+	UsageEntry *shared;
+	bool		found;
+	bool		added = false;
+
+	if (local_npending == 0 || usage_cache_htab == NULL)
+		return false;
+
+	LWLockAcquire(usage_cache->lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, local_usage);
+	while ((entry = (LocalUsageEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (!entry->pending)
+			continue;
+
+		/* HASH_ENTER_NULL returns NULL if the table is full */
+		shared = (UsageEntry *) hash_search(usage_cache_htab, &entry->key,
+											HASH_ENTER_NULL, &found);
+		if (shared != NULL)
+		{
+			if (!found || shared->last_used < entry->last_used)
+				shared->last_used = entry->last_used;
+			added |= !found;
+		}
+
+		entry->pending = false;
+		entry->moved = entry->last_used;
+	}
+	LWLockRelease(usage_cache->lock);
+
+	local_npending = 0;
+
+	/* Forget the marks if the backend has seen too many objects */
+	if (hash_get_num_entries(local_usage) > AQO_USAGE_LOCAL_SIZE)
+	{
+		hash_destroy(local_usage);
+		local_usage = NULL;
+	}
+
+	return added;
+}
+
+/*
+ * Checks whether the database has marks which are not written yet.
+ */
+bool
+usage_cache_has_entries(Oid dbid)
+{
+	HASH_SEQ_STATUS hash_seq;
+	UsageEntry *entry;
+	bool		has = false;
+
+	if (usage_cache_htab == NULL)
+		return false;
+
+	LWLockAcquire(usage_cache->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, usage_cache_htab);
+	while ((entry = (UsageEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.dbid == dbid && entry->key.kind != USAGE_GC)
+		{
+			has = true;
+			hash_seq_term(&hash_seq);
+			break;
+		}
+	}
+	LWLockRelease(usage_cache->lock);
+
+	return has;
+}
+
+static ArrayType *
+form_int4_array(int *values, int n)
+{
+	Datum	   *elems = palloc(sizeof(Datum) * (n + 1));
+	int			i;
+
+	for (i = 0; i < n; ++i)
+		elems[i] = Int32GetDatum(values[i]);
+	return construct_array(elems, n, INT4OID, sizeof(int32), true, 'i');
+}
+
+static ArrayType *
+form_timestamptz_array(TimestampTz *values, int n)
+{
+	Datum	   *elems = palloc(sizeof(Datum) * (n + 1));
+	int			i;
+
+	for (i = 0; i < n; ++i)
+		elems[i] = TimestampTzGetDatum(values[i]);
+	return construct_array(elems, n, TIMESTAMPTZOID, sizeof(TimestampTz),
+						   FLOAT8PASSBYVAL, 'd');
+}
+
+/*
+ * Writes the marks of the current database to aqo_query_usage and
+ * aqo_data_usage. Must be called inside a transaction.
+ */
+void
+usage_cache_flush(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	UsageEntry *entry;
+	int		   *query_hashes;
+	TimestampTz *query_times;
+	int		   *fspace_hashes;
+	int		   *fss_hashes;
+	TimestampTz *fss_times;
+	int			nqueries = 0;
+	int			nfss = 0;
+	Oid			argtypes[3];
+	Datum		args[3];
+
+	if (usage_cache_htab == NULL)
+		return;
+
+	query_hashes = palloc(sizeof(int) * usage_cache->size);
+	query_times = palloc(sizeof(TimestampTz) * usage_cache->size);
+	fspace_hashes = palloc(sizeof(int) * usage_cache->size);
+	fss_hashes = palloc(sizeof(int) * usage_cache->size);
+	fss_times = palloc(sizeof(TimestampTz) * usage_cache->size);
+
+	LWLockAcquire(usage_cache->lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, usage_cache_htab);
+	while ((entry = (UsageEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.dbid != MyDatabaseId || entry->key.kind == USAGE_GC)
+			continue;
+
+		if (entry->key.kind == USAGE_QUERY)
+		{
+			query_hashes[nqueries] = entry->key.hash1;
+			query_times[nqueries] = entry->last_used;
+			nqueries++;
+		}
+		else
+		{
+			fspace_hashes[nfss] = entry->key.hash1;
+			fss_hashes[nfss] = entry->key.hash2;
+			fss_times[nfss] = entry->last_used;
+			nfss++;
+		}
+		hash_search(usage_cache_htab, &entry->key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(usage_cache->lock);
+
+	SPI_connect();
+
+	argtypes[0] = get_array_type(INT4OID);
+	if (nqueries > 0)
+	{
+		argtypes[1] = get_array_type(TIMESTAMPTZOID);
+		args[0] = PointerGetDatum(form_int4_array(query_hashes, nqueries));
+		args[1] = PointerGetDatum(form_timestamptz_array(query_times,
+														 nqueries));
+		SPI_execute_with_args("INSERT INTO public.aqo_query_usage AS u "
+							  "SELECT * FROM pg_catalog.unnest($1, $2) "
+							  "ON CONFLICT (query_hash) DO UPDATE "
+							  "SET last_used = GREATEST(u.last_used, "
+							  "excluded.last_used)",
+							  2, argtypes, args, NULL, false, 0);
+	}
+
+	if (nfss > 0)
+	{
+		argtypes[1] = get_array_type(INT4OID);
+		argtypes[2] = get_array_type(TIMESTAMPTZOID);
+		args[0] = PointerGetDatum(form_int4_array(fspace_hashes, nfss));
+		args[1] = PointerGetDatum(form_int4_array(fss_hashes, nfss));
+		args[2] = PointerGetDatum(form_timestamptz_array(fss_times, nfss));
+		SPI_execute_with_args("INSERT INTO public.aqo_data_usage AS u "
+							  "SELECT * FROM pg_catalog.unnest($1, $2, $3) "
+							  "ON CONFLICT (fspace_hash, fsspace_hash) "
+							  "DO UPDATE "
+							  "SET last_used = GREATEST(u.last_used, "
+							  "excluded.last_used)",
+							  3, argtypes, args, NULL, false, 0);
+	}
+
+	SPI_finish();
+
+	pfree(query_hashes);
+	pfree(query_times);
+	pfree(fspace_hashes);
+	pfree(fss_hashes);
+	pfree(fss_times);
+}
+
+/*
+ * Checks whether aqo.gc_interval has passed since the garbage of the current
+ * database was collected last time.
+ */
+bool
+usage_gc_is_due(void)
+{
+	UsageKey	key;
+	UsageEntry *entry;
+	bool		due = true;
+
+	if (usage_cache_htab == NULL)
+		return true;
+
+	usage_set_key(&key, USAGE_GC, 0, 0);
+
+	LWLockAcquire(usage_cache->lock, LW_SHARED);
+	entry = (UsageEntry *) hash_search(usage_cache_htab, &key,
+									   HASH_FIND, NULL);
+	if (entry != NULL)
+		due = TimestampDifferenceExceeds(entry->last_used,
+										 GetCurrentTimestamp(),
+										 aqo_gc_interval);
+	LWLockRelease(usage_cache->lock);
+
+	return due;
+}
+
+/*
+ * Remembers that the garbage of the current database has been collected.
+ */
+void
+usage_gc_done(void)
+{
+	UsageKey	key;
+	UsageEntry *entry;
+
+	if (usage_cache_htab == NULL)
+		return;
+
+	usage_set_key(&key, USAGE_GC, 0, 0);
+
+	LWLockAcquire(usage_cache->lock, LW_EXCLUSIVE);
+	entry = (UsageEntry *) hash_search(usage_cache_htab, &key,
+									   HASH_ENTER_NULL, NULL);
+	if (entry != NULL)
+		entry->last_used = GetCurrentTimestamp();
+	LWLockRelease(usage_cache->lock);
+}
@@ -90,29 +90,20 @@ inverse_permutation(int *idx, int n)
 }
 
 /*
- * Allocates empty QueryStat object.
+ * Allocates empty QueryStat object which keeps up to aqo_stat_size values of
+ * each series.
  */
 QueryStat *
 palloc_query_stat(void)
 {
-	QueryStat  		*res;
-	MemoryContext	oldCxt;
-
-	oldCxt = MemoryContextSwitchTo(AQOMemoryContext);
-	res = palloc0(sizeof(*res));
-	res->execution_time_with_aqo = palloc(aqo_stat_size *
-								sizeof(res->execution_time_with_aqo[0]));
-	res->execution_time_without_aqo = palloc(aqo_stat_size *
-								sizeof(res->execution_time_without_aqo[0]));
-	res->planning_time_with_aqo = palloc(aqo_stat_size *
-								sizeof(res->planning_time_with_aqo[0]));
-	res->planning_time_without_aqo = palloc(aqo_stat_size *
-								sizeof(res->planning_time_without_aqo[0]));
-	res->cardinality_error_with_aqo = palloc(aqo_stat_size *
-								sizeof(res->cardinality_error_with_aqo[0]));
-	res->cardinality_error_without_aqo = palloc(aqo_stat_size *
-								sizeof(res->cardinality_error_without_aqo[0]));
-	MemoryContextSwitchTo(oldCxt);
+	Size		size = QueryStatSize(aqo_stat_size);
+	QueryStat  *res;
+
+	res = MemoryContextAllocZero(AQOMemoryContext, size);
+	SET_VARSIZE(res, size);
+	res->version = AQO_STAT_VERSION;
+	res->nseries = STAT_NSERIES;
+	res->capacity = aqo_stat_size;
 
 	return res;
 }
@@ -123,11 +114,53 @@ palloc_query_stat(void)
 void
 pfree_query_stat(QueryStat * stat)
 {
-	pfree(stat->execution_time_with_aqo);
-	pfree(stat->execution_time_without_aqo);
-	pfree(stat->planning_time_with_aqo);
-	pfree(stat->planning_time_without_aqo);
-	pfree(stat->cardinality_error_with_aqo);
-	pfree(stat->cardinality_error_without_aqo);
 	pfree(stat);
 }
+
+/*
+ * Adds the value to the end of the series. If the series is full, the oldest
+ * value is overwritten.
+ */
+void
+query_stat_append(QueryStat *stat, QueryStatSeries series, double value)
+{
+	QueryStatRing *ring = &stat->rings[series];
+	double	   *data = &stat->data[series * stat->capacity];
+
+	if (stat->capacity <= 0)
+		return;
+
+	if (ring->size < stat->capacity)
+	{
+		data[(ring->head + ring->size) % stat->capacity] = value;
+		ring->size++;
+	}
+	else
+	{
+		data[ring->head] = value;
+		ring->head = (ring->head + 1) % stat->capacity;
+	}
+}
+
+/*
+ * Returns i-th value of the series counting from the oldest one.
+ */
+double
+query_stat_get(QueryStat *stat, QueryStatSeries series, int i)
+{
+	QueryStatRing *ring = &stat->rings[series];
+
+	AssertArg(i >= 0 && i < ring->size);
+
+	return stat->data[series * stat->capacity +
+					  (ring->head + i) % stat->capacity];
+}
+
+/*
+ * Returns the number of values in the series.
+ */
+int
+query_stat_nelems(QueryStat *stat, QueryStatSeries series)
+{
+	return stat->rings[series].size;
+}